@@ -0,0 +1,61 @@
+#!/bin/bash
+# Sweeps loss rates through lossy_proxy and prints the goodput of each run
+# as CSV. Everything is set through the environment:
+#
+#   SIZE=20000000 LOSSES="0 0.01 0.05" CCS="reno cubic bbr" DELAY=10 \
+#   JITTER=0 RATE=100 SEEDS="1 2 3" PROXY_OPTS="-o 0.01" ./bench.sh
+#
+# RATE is the bottleneck in Mbit/s (0 for none), DELAY and JITTER are one
+# way, in ms. SENDER_OPTS and RECEIVER_OPTS are passed on as is.
+
+SIZE=${SIZE:-10000000}
+LOSSES=${LOSSES:-"0 0.001 0.01 0.02 0.05 0.1"}
+CCS=${CCS:-"reno cubic bbr"}
+SEEDS=${SEEDS:-1}
+DELAY=${DELAY:-5}
+JITTER=${JITTER:-0}
+RATE=${RATE:-0}
+PORT=${PORT:-9000}
+PROXY_PORT=${PROXY_PORT:-9100}
+TIMEOUT=${TIMEOUT:-120}
+
+cd "$(dirname "$0")"
+make -s obj reliable_sender reliable_receiver lossy_proxy || exit 1
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+head -c "$SIZE" /dev/urandom > "$work/in"
+
+echo "cc,loss,seed,seconds,goodput_mbps,ok"
+for cc in $CCS; do
+  for loss in $LOSSES; do
+    for seed in $SEEDS; do
+      ./lossy_proxy -l "$loss" -d "$DELAY" -j "$JITTER" -b "$RATE" \
+        -s "$seed" $PROXY_OPTS "$PROXY_PORT" 127.0.0.1 "$PORT" \
+        2> "$work/proxy.log" &
+      proxy=$!
+      timeout "$TIMEOUT" ./reliable_receiver $RECEIVER_OPTS "$PORT" \
+        "$work/out" > "$work/receiver.log" 2>&1 &
+      receiver=$!
+      sleep 0.2
+
+      start=$(date +%s%N)
+      timeout "$TIMEOUT" ./reliable_sender -c "$cc" $SENDER_OPTS 127.0.0.1 \
+        "$PROXY_PORT" "$work/in" "$SIZE" > "$work/sender.log" 2>&1
+      end=$(date +%s%N)
+      wait $receiver
+      kill $proxy
+      wait $proxy 2> /dev/null
+
+      ok=0
+      cmp -s "$work/in" "$work/out" && ok=1
+      awk -v cc="$cc" -v loss="$loss" -v seed="$seed" -v ns=$((end - start)) \
+        -v bytes="$SIZE" -v ok=$ok 'BEGIN {
+          s = ns / 1e9
+          printf "%s,%s,%s,%.3f,%.2f,%d\n", cc, loss, seed, s,
+                 bytes * 8 / s / 1e6, ok
+        }'
+      rm -f "$work/out"
+    done
+  done
+done
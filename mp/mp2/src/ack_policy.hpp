@@ -0,0 +1,111 @@
+#ifndef MP2_ACK_POLICY_HPP
+#define MP2_ACK_POLICY_HPP
+
+#include <stdint.h>
+
+// Delayed ACKs (RFC 1122): data that arrives in order is acknowledged every
+// ACK_EVERY packets, or ACK_DELAY_USEC after the first unacknowledged one
+#define ACK_EVERY 2
+#define ACK_DELAY_USEC 1000
+// In-order packets acknowledged at once when a flow starts and after any
+// sign of loss, while the sender's window is likely too small to keep
+// sending until the delayed ACK is due
+#define QUICKACK_PACKETS 16
+
+/**
+ * ack_policy decides when the receiving end of a flow acknowledges, without
+ * its sockets: reliable_receiver and transfer_sim feed it every packet of
+ * the flow and tell it about every ACK that goes out
+ *
+ * Only data that continues the flow while nothing is held out of order may
+ * wait for its ACK, so that the sender learns about holes and duplicates
+ * at once. Anything else, and the first QUICKACK_PACKETS in-order packets
+ * after it, is acknowledged at once.
+ */
+class ack_policy {
+ public:
+  /**
+   * @param delay whether in-order data may wait for its ACK at all
+   */
+  explicit ack_policy(bool delay = true)
+      : delay(delay), unacked(0), timestamp(0), deadline(0),
+        quickack(QUICKACK_PACKETS) {}
+
+  /**
+   * continues tells whether seqno is the next one of a flow with nothing
+   * held out of order, checked before the packet is taken in
+   *
+   * @param next the cumulative ACK of the flow
+   * @param highest one past the highest seqno the flow received
+   */
+  static bool continues(unsigned long seqno, unsigned long next,
+                        unsigned long highest) {
+    return seqno == next && highest == next;
+  }
+
+  /**
+   * on_packet counts a received packet towards the ACK of the flow
+   *
+   * @param in_order the packet was new data that continued the flow, see
+   *        continues()
+   * @param retransmit the packet was a retransmission or rebuilt something
+   * @param timestamp the timestamp of the packet
+   * @param now the time in microseconds
+   * @return true if the ACK can wait, false if it is due now
+   */
+  bool on_packet(bool in_order, bool retransmit, uint32_t timestamp,
+                 uint64_t now) {
+    if (!in_order || retransmit) {
+      quickack = QUICKACK_PACKETS;
+      return false;
+    }
+    if (!delay)
+      return false;
+    if (quickack > 0) {
+      quickack--;
+      return false;
+    }
+    if (unacked++ == 0) {
+      this->timestamp = timestamp;
+      deadline = now + ACK_DELAY_USEC;
+    }
+    return unacked < ACK_EVERY;
+  }
+
+  /**
+   * on_ack clears the delayed ACK as an ACK of the flow goes out
+   *
+   * @param timestamp the timestamp of the packet that triggered the ACK
+   * @return the timestamp the ACK echoes: a delayed ACK echoes the first
+   *         packet it covers, so that the RTT sample includes the delay
+   */
+  uint32_t on_ack(uint32_t timestamp) {
+    if (unacked > 0) {
+      timestamp = this->timestamp;
+      unacked = 0;
+    }
+    return timestamp;
+  }
+
+  /**
+   * pending tells whether a delayed ACK is waiting
+   */
+  bool pending() { return unacked > 0; }
+
+  /**
+   * due is when the pending delayed ACK has to go out
+   */
+  uint64_t due() { return deadline; }
+
+ private:
+  bool delay;
+  // in-order packets not acknowledged yet, the timestamp of the first of
+  // them and when their ACK is due
+  unsigned int unacked;
+  uint32_t timestamp;
+  uint64_t deadline;
+  // in-order packets left to acknowledge at once
+  unsigned int quickack;
+};
+
+#endif  // MP2_ACK_POLICY_HPP
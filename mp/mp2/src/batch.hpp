@@ -0,0 +1,429 @@
+#ifndef MP2_BATCH_HPP
+#define MP2_BATCH_HPP
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "wire.hpp"
+
+// First bytes of a manifest, "MP2B" as a le32
+#define BATCH_MAGIC 0x4232504d
+// Encoded size of the manifest header, and of an entry less its path
+#define BATCH_HEADER_SIZE 16
+#define BATCH_ENTRY_SIZE 14
+// Appended to the destination to name the stream a batch is received
+// into, it is unpacked into the destination once it is complete
+#define BATCH_SUFFIX ".batch"
+// Bytes copied at a time when unpacking without copy_file_range
+#define BATCH_COPY_SIZE (1 << 20)
+
+/**
+ * A batch sends a directory tree as one transfer: the file is a stream of
+ * the manifest followed by the data of every file in manifest order, so
+ * the files go back to back in one sequence space, with one handshake, one
+ * window and one FIN exchange for the lot. It is offered with
+ * HANDSHAKE_BATCH, see handshake.hpp.
+ *
+ * The manifest, all little-endian:
+ *
+ *  offset  size  field
+ *  0       4     BATCH_MAGIC
+ *  4       4     number of entries
+ *  8       8     size of the manifest, where the data of the first file
+ *                starts
+ *  16            the entries, each:
+ *    0     8     size in bytes, 0 for a directory
+ *    8     4     type and permission bits as in st_mode
+ *    12    2     length n of the path
+ *    14    n     path from the root of the tree, '/' separated
+ *
+ * A directory comes before everything in it. Only regular files and
+ * directories are sent.
+ */
+struct batch_entry {
+  std::string path;
+  uint32_t mode;
+  // size in bytes, and where the data starts in the stream
+  unsigned long long size, offset;
+};
+
+/**
+ * batch_manifest is the list of files of a batch and their place in the
+ * stream
+ *
+ * The sender scan()s a tree and open_stream()s it to read packets from,
+ * the receiver decode()s the stream it received and unpack()s it.
+ */
+class batch_manifest {
+ public:
+  batch_manifest() : total(0), files(0), directories(0), skipped(0) {}
+
+  /**
+   * scan lists the tree under dir
+   *
+   * @return false if dir is not a directory or cannot be read, errno tells
+   */
+  bool scan(const char* dir) {
+    struct stat st;
+
+    root = dir;
+    if (stat(dir, &st) < 0)
+      return false;
+    if (!S_ISDIR(st.st_mode)) {
+      errno = ENOTDIR;
+      return false;
+    }
+    if (!walk(""))
+      return false;
+    encode();
+    return true;
+  }
+
+  /**
+   * decode reads the manifest from the start of a received stream
+   *
+   * @param fd the stream
+   * @param length the size of the stream
+   * @return false if it is no manifest, is truncated, names a path that
+   *         leaves the tree, or does not account for the whole stream
+   */
+  bool decode(int fd, unsigned long long length) {
+    uint8_t header[BATCH_HEADER_SIZE];
+    unsigned long long size, pos, data;
+    uint32_t count, n;
+    batch_entry e;
+
+    if (pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        get_le32(header) != BATCH_MAGIC)
+      return false;
+    count = get_le32(header + 4);
+    size = get_le64(header + 8);
+    if (size > length || size < BATCH_HEADER_SIZE ||
+        (size - BATCH_HEADER_SIZE) / BATCH_ENTRY_SIZE < count)
+      return false;
+    encoded.resize(size);
+    if (pread(fd, encoded.data(), size, 0) != (ssize_t)size)
+      return false;
+
+    entries.clear();
+    files = directories = 0;
+    data = size;
+    for (pos = BATCH_HEADER_SIZE; count > 0; count--) {
+      if (pos + BATCH_ENTRY_SIZE > size)
+        return false;
+      e.size = get_le64(&encoded[pos]);
+      e.mode = get_le32(&encoded[pos + 8]);
+      n = get_le16(&encoded[pos + 12]);
+      pos += BATCH_ENTRY_SIZE;
+      if (pos + n > size)
+        return false;
+      e.path.assign((const char*)&encoded[pos], n);
+      pos += n;
+      if (!safe(e.path) || e.size > length - data ||
+          !(S_ISREG(e.mode) || (S_ISDIR(e.mode) && e.size == 0)))
+        return false;
+      e.offset = data;
+      data += e.size;
+      if (S_ISDIR(e.mode))
+        directories++;
+      else
+        files++;
+      entries.push_back(e);
+    }
+    total = data;
+    return pos == size && total == length;
+  }
+
+  /**
+   * unpack recreates the tree of a decoded manifest under dir from the
+   * stream, over what is there already
+   *
+   * @param fd the stream
+   * @param failed receives the path that could not be written, errno
+   *        tells why
+   * @return false if a file or directory could not be written
+   */
+  bool unpack(int fd, const char* dir, std::string* failed) {
+    std::string path;
+    int out;
+
+    *failed = dir;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+      return false;
+    for (const batch_entry& e : entries) {
+      *failed = path = std::string(dir) + "/" + e.path;
+      if (S_ISDIR(e.mode)) {
+        if (mkdir(path.c_str(), (e.mode & 0777) | 0700) < 0 &&
+            errno != EEXIST)
+          return false;
+        continue;
+      }
+      // a symbolic link left in the way is replaced, not followed
+      out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+                 e.mode & 0777);
+      if (out < 0 && errno == ELOOP && unlink(path.c_str()) == 0)
+        out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+                   e.mode & 0777);
+      if (out < 0)
+        return false;
+      if (!copy(fd, e.offset, out, e.size)) {
+        close(out);
+        return false;
+      }
+      if (close(out) < 0)
+        return false;
+    }
+    return true;
+  }
+
+  /**
+   * open_stream returns the stream of a scanned tree as a read-only FILE,
+   * which may be seeked. Each FILE reads the files on its own, several may
+   * be open at once
+   *
+   * A file that shrank or went away since the scan is padded with zeros,
+   * every file keeps the place the manifest gives it.
+   */
+  FILE* open_stream() {
+    cookie_io_functions_t io = {read_stream, NULL, seek_stream, close_stream};
+    stream* st = new stream();
+
+    st->manifest = this;
+    st->pos = 0;
+    st->index = entries.size();
+    st->file = NULL;
+    return fopencookie(st, "rb", io);
+  }
+
+  // the size of the stream
+  unsigned long long total;
+  unsigned long files, directories, skipped;
+  std::vector<batch_entry> entries;
+  std::vector<uint8_t> encoded;
+
+ private:
+  /**
+   * stream is where a FILE from open_stream() is in the stream
+   */
+  struct stream {
+    batch_manifest* manifest;
+    unsigned long long pos;
+    // the entry file is open on, entries.size() for none
+    size_t index;
+    FILE* file;
+  };
+
+  /**
+   * walk lists the directory rel of the tree and everything under it, in
+   * name order
+   */
+  bool walk(const std::string& rel) {
+    std::string dir = rel.empty() ? root : root + "/" + rel, path;
+    std::vector<std::string> names;
+    struct dirent* d;
+    struct stat st;
+    batch_entry e;
+    DIR* dp;
+
+    if ((dp = opendir(dir.c_str())) == NULL)
+      return false;
+    while ((d = readdir(dp)) != NULL)
+      if (strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0)
+        names.push_back(d->d_name);
+    closedir(dp);
+    std::sort(names.begin(), names.end());
+
+    for (const std::string& name : names) {
+      path = rel.empty() ? name : rel + "/" + name;
+      if (lstat((root + "/" + path).c_str(), &st) < 0)
+        return false;
+      e.path = path;
+      e.mode = st.st_mode;
+      e.size = S_ISREG(st.st_mode) ? st.st_size : 0;
+      if (S_ISDIR(st.st_mode)) {
+        entries.push_back(e);
+        directories++;
+        if (!walk(path))
+          return false;
+      } else if (S_ISREG(st.st_mode)) {
+        entries.push_back(e);
+        files++;
+      } else {
+        skipped++;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * encode serializes the manifest of the entries and lays their data out
+   * behind it
+   */
+  void encode() {
+    unsigned long long size = BATCH_HEADER_SIZE, pos;
+
+    for (const batch_entry& e : entries)
+      size += BATCH_ENTRY_SIZE + e.path.size();
+    encoded.assign(size, 0);
+    put_le32(&encoded[0], BATCH_MAGIC);
+    put_le32(&encoded[4], entries.size());
+    put_le64(&encoded[8], size);
+
+    total = size;
+    pos = BATCH_HEADER_SIZE;
+    for (batch_entry& e : entries) {
+      put_le64(&encoded[pos], e.size);
+      put_le32(&encoded[pos + 8], e.mode);
+      put_le16(&encoded[pos + 12], e.path.size());
+      memcpy(&encoded[pos + BATCH_ENTRY_SIZE], e.path.data(), e.path.size());
+      pos += BATCH_ENTRY_SIZE + e.path.size();
+      e.offset = total;
+      total += e.size;
+    }
+  }
+
+  /**
+   * safe tells whether a path from the manifest stays inside the tree: it
+   * is relative and has no empty, . or .. component
+   */
+  static bool safe(const std::string& path) {
+    size_t start = 0, end;
+    std::string part;
+
+    if (path.empty() || path.size() >= PATH_MAX ||
+        path.find('\0') != std::string::npos)
+      return false;
+    do {
+      end = path.find('/', start);
+      part = path.substr(start, end == std::string::npos ? end : end - start);
+      if (part.empty() || part == "." || part == "..")
+        return false;
+      start = end + 1;
+    } while (end != std::string::npos);
+    return true;
+  }
+
+  /**
+   * copy writes bytes of the stream from offset to out, in the kernel when
+   * it can
+   */
+  static bool copy(int fd, unsigned long long offset, int out,
+                   unsigned long long bytes) {
+    std::vector<char> buf;
+    loff_t from = offset;
+    ssize_t n;
+
+    while (bytes > 0) {
+      n = copy_file_range(fd, &from, out, NULL, bytes, 0);
+      if (n <= 0)
+        break;
+      bytes -= n;
+    }
+    // copy_file_range is not there, or not across these file systems
+    while (bytes > 0) {
+      buf.resize(BATCH_COPY_SIZE);
+      n = pread(fd, buf.data(),
+                std::min(bytes, (unsigned long long)BATCH_COPY_SIZE), from);
+      if (n <= 0 || write(out, buf.data(), n) != n) {
+        if (n == 0)
+          errno = EIO;
+        return false;
+      }
+      from += n;
+      bytes -= n;
+    }
+    return true;
+  }
+
+  static ssize_t read_stream(void* cookie, char* buf, size_t size) {
+    stream* st = (stream*)cookie;
+    batch_manifest* m = st->manifest;
+    std::vector<batch_entry>::iterator it;
+    unsigned long long want;
+    size_t done = 0, got, i;
+
+    while (done < size && st->pos < m->total) {
+      if (st->pos < m->encoded.size()) {
+        want = std::min((unsigned long long)size - done,
+                        m->encoded.size() - st->pos);
+        memcpy(buf + done, &m->encoded[st->pos], want);
+        done += want;
+        st->pos += want;
+        continue;
+      }
+
+      // the last entry that starts at or before pos holds it, the empty
+      // ones before it start at the same place
+      it = std::upper_bound(m->entries.begin(), m->entries.end(), st->pos,
+                            [](unsigned long long pos, const batch_entry& e) {
+                              return pos < e.offset;
+                            });
+      i = it - m->entries.begin() - 1;
+      const batch_entry& e = m->entries[i];
+      if (i != st->index) {
+        if (st->file)
+          fclose(st->file);
+        st->file = fopen((m->root + "/" + e.path).c_str(), "rb");
+        st->index = i;
+        if (st->file &&
+            fseeko(st->file, (off_t)(st->pos - e.offset), SEEK_SET) < 0) {
+          fclose(st->file);
+          st->file = NULL;
+        }
+      }
+
+      want = std::min((unsigned long long)size - done,
+                      e.offset + e.size - st->pos);
+      got = st->file ? fread(buf + done, 1, want, st->file) : 0;
+      if (got < want)
+        memset(buf + done + got, 0, want - got);
+      done += want;
+      st->pos += want;
+    }
+    return done;
+  }
+
+  static int seek_stream(void* cookie, off64_t* offset, int whence) {
+    stream* st = (stream*)cookie;
+    long long pos = *offset;
+
+    if (whence == SEEK_CUR)
+      pos += st->pos;
+    else if (whence == SEEK_END)
+      pos += st->manifest->total;
+    if (pos < 0)
+      return -1;
+    // the entry to read from is found again on the next read
+    if (st->file)
+      fclose(st->file);
+    st->file = NULL;
+    st->index = st->manifest->entries.size();
+    st->pos = *offset = pos;
+    return 0;
+  }
+
+  static int close_stream(void* cookie) {
+    stream* st = (stream*)cookie;
+
+    if (st->file)
+      fclose(st->file);
+    delete st;
+    return 0;
+  }
+
+  std::string root;
+};
+
+#endif  // MP2_BATCH_HPP
@@ -0,0 +1,217 @@
+#ifndef MP2_BBR_HPP
+#define MP2_BBR_HPP
+
+#include <stdio.h>
+
+#include <algorithm>
+
+#include "congestion.hpp"
+
+// Gain of STARTUP, 2 / ln 2, doubles the delivery rate every round
+#define BBR_HIGH_GAIN 2.885
+// Window gain outside of STARTUP, leaves room for delayed and stretched ACKs
+#define BBR_CWND_GAIN 2
+// Rounds the bottleneck bandwidth is remembered for
+#define BBR_BW_ROUNDS 10
+// Rounds without 25% growth before STARTUP decides the pipe is full
+#define BBR_FULL_BW_ROUNDS 3
+// How long a minimum RTT sample stays valid, in microseconds
+#define BBR_MIN_RTT_USEC 10000000
+// How long PROBE_RTT holds the window at its minimum, in microseconds
+#define BBR_PROBE_RTT_USEC 200000
+// Smallest window, in packets
+#define BBR_MIN_CWND 4
+
+/**
+ * bbr is a delay-based controller after BBR v1
+ *
+ * It ignores losses and instead models the path: the bottleneck bandwidth
+ * is the highest delivery rate of the last BBR_BW_ROUNDS rounds, and the
+ * propagation delay is the lowest RTT of the last 10 s. The window is a
+ * multiple of their product.
+ *
+ * - STARTUP: pace at 2.885 * bw until bw stops growing by 25% a round
+ * - DRAIN: pace below bw until the queue STARTUP built is gone
+ * - PROBE_BW: cycle the pacing gain through 1.25, 0.75, then 1 for six
+ *   rounds, to find more bandwidth and give back the queue that made
+ * - PROBE_RTT: when min_rtt is stale, hold the window at 4 packets for
+ *   200 ms so that the queue empties and the delay can be measured again
+ *
+ * A round is one min_rtt, with one delivery rate sample per round. A
+ * retransmission timeout keeps the model, the window and the pacing rate
+ * it gives are where recovery starts from.
+ */
+class bbr : public congestion_control {
+ public:
+  /**
+   * @param initial the window in packets until the path is measured, at
+   *        least BBR_MIN_CWND
+   */
+  bbr(double initial = BBR_MIN_CWND)
+      : initial(std::max(initial, (double)BBR_MIN_CWND)), mode(STARTUP),
+        bw(0), min_rtt(0), min_rtt_stamp(0), delivered(0), round_start(0),
+        round_delivered(0), rounds(0), full_bw(0), full_bw_rounds(0),
+        cycle(0), probe_rtt_start(0), in_flight(0), timeouts(0) {
+    std::fill(bw_samples, bw_samples + BBR_BW_ROUNDS, 0.0);
+  }
+
+  const char* name() { return "bbr"; }
+
+  void on_ack(const ack_sample& ack) { update(ack); }
+
+  void on_dupack(const ack_sample& ack) { update(ack); }
+
+  // losses are not a congestion signal
+  void on_loss(const ack_sample& ack) { (void)ack; }
+
+  void on_timeout(uint64_t now) {
+    // a timeout says nothing about the bandwidth of the path, the max
+    // filter keeps what the last rounds measured until newer rounds age it
+    // out, only the round in progress is measured again
+    (void)now;
+    round_start = 0;
+    in_flight = 0;
+    timeouts++;
+    // only the start of the transfer gets the initial window
+    initial = BBR_MIN_CWND;
+  }
+
+  bool in_slow_start() { return mode == STARTUP; }
+
+  double cwnd() {
+    if (mode == PROBE_RTT)
+      return BBR_MIN_CWND;
+    if (bw == 0 || min_rtt == 0)
+      return initial;
+
+    double gain = mode == STARTUP ? BBR_HIGH_GAIN
+                  : mode == DRAIN ? 1
+                                  : BBR_CWND_GAIN;
+    return std::max(gain * bdp(), (double)BBR_MIN_CWND);
+  }
+
+  double pacing_rate() { return pacing_gain() * bw; }
+
+  void print_stats() {
+    fprintf(stderr,
+            "bbr: bw %.0f pkt/s, min_rtt %u us, cwnd %.1f, %lu rounds, "
+            "%lu timeouts\n",
+            bw, min_rtt, cwnd(), rounds, timeouts);
+  }
+
+ private:
+  enum bbr_mode { STARTUP, DRAIN, PROBE_BW, PROBE_RTT };
+
+  /**
+   * update feeds one ACK into the model
+   */
+  void update(const ack_sample& ack) {
+    delivered += ack.delivered;
+    in_flight = ack.in_flight;
+
+    if (ack.rtt > 0 &&
+        (min_rtt == 0 || ack.rtt <= min_rtt ||
+         ack.now - min_rtt_stamp > BBR_MIN_RTT_USEC)) {
+      min_rtt = ack.rtt;
+      min_rtt_stamp = ack.now;
+    }
+
+    uint32_t round = min_rtt ? min_rtt : ack.srtt;
+    if (round_start == 0) {
+      round_start = ack.now;
+      round_delivered = delivered;
+    } else if (round > 0 && ack.now - round_start >= round) {
+      end_round(ack.now);
+    }
+
+    check_probe_rtt(ack.now);
+  }
+
+  /**
+   * end_round takes the delivery rate sample of the round that just ended
+   * and moves the state machine
+   */
+  void end_round(uint64_t now) {
+    double rate = (delivered - round_delivered) * 1e6 / (now - round_start);
+
+    bw_samples[rounds % BBR_BW_ROUNDS] = rate;
+    bw = *std::max_element(bw_samples, bw_samples + BBR_BW_ROUNDS);
+    rounds++;
+    round_start = now;
+    round_delivered = delivered;
+
+    switch (mode) {
+      case STARTUP:
+        if (bw >= full_bw * 1.25) {
+          full_bw = bw;
+          full_bw_rounds = 0;
+        } else if (++full_bw_rounds >= BBR_FULL_BW_ROUNDS) {
+          mode = DRAIN;
+        }
+        break;
+      case DRAIN:
+        if (in_flight <= bdp()) {
+          mode = PROBE_BW;
+          cycle = 2;
+        }
+        break;
+      case PROBE_BW:
+        cycle = (cycle + 1) % 8;
+        break;
+      case PROBE_RTT:
+        break;
+    }
+  }
+
+  /**
+   * check_probe_rtt enters PROBE_RTT when min_rtt is stale and leaves it
+   * once the window has been small for long enough
+   */
+  void check_probe_rtt(uint64_t now) {
+    if (mode != PROBE_RTT && min_rtt_stamp != 0 &&
+        now - min_rtt_stamp > BBR_MIN_RTT_USEC) {
+      mode = PROBE_RTT;
+      probe_rtt_start = now;
+    } else if (mode == PROBE_RTT &&
+               now - probe_rtt_start > BBR_PROBE_RTT_USEC) {
+      min_rtt_stamp = now;
+      mode = full_bw_rounds >= BBR_FULL_BW_ROUNDS ? PROBE_BW : STARTUP;
+      cycle = 2;
+    }
+  }
+
+  double pacing_gain() {
+    switch (mode) {
+      case STARTUP:
+        return BBR_HIGH_GAIN;
+      case DRAIN:
+        return 1 / BBR_HIGH_GAIN;
+      case PROBE_BW:
+        return cycle == 0 ? 1.25 : cycle == 1 ? 0.75 : 1;
+      default:
+        return 1;
+    }
+  }
+
+  /**
+   * bdp is the bandwidth delay product in packets
+   */
+  double bdp() { return bw * min_rtt / 1e6; }
+
+  double initial;
+  bbr_mode mode;
+  double bw;
+  double bw_samples[BBR_BW_ROUNDS];
+  uint32_t min_rtt;
+  uint64_t min_rtt_stamp;
+  unsigned long delivered;
+  uint64_t round_start;
+  unsigned long round_delivered, rounds;
+  double full_bw;
+  unsigned long full_bw_rounds;
+  int cycle;
+  uint64_t probe_rtt_start;
+  unsigned long in_flight, timeouts;
+};
+
+#endif  // MP2_BBR_HPP
@@ -0,0 +1,105 @@
+#ifndef MP2_CONGESTION_HPP
+#define MP2_CONGESTION_HPP
+
+#include <stdint.h>
+
+// Default Slow Start Threshold
+#define DEFAULT_SS_THRESH 64
+// Lowest Slow Start Threshold, a smaller one would leave a window below one
+// packet after fast recovery
+#define MIN_SS_THRESH 2
+// Default Congestion Window Size, the initial window of a transfer unless
+// the sender asks for another in the handshake
+#define DEFAULT_CWND 1
+// Most packets one ACK may grow the window by in slow start, L of RFC 3465.
+// The receiver acknowledges every second packet, two keeps slow start
+// doubling per RTT without letting a stretch ACK release a burst
+#define ABC_LIMIT 2
+
+/**
+ * ack_sample is what the sender learned from one ACK
+ */
+struct ack_sample {
+  // packets newly covered by the cumulative ACK. Windows grow by what the
+  // ACKs cover, not by how many arrive (RFC 3465), so that delayed ACKs do
+  // not slow the growth down
+  unsigned long acked;
+  // packets newly known to be received, cumulatively or by SACK
+  unsigned long delivered;
+  // packets sent and neither acked nor SACKed, after this ACK
+  unsigned long in_flight;
+  // round trip time measured by this ACK in microseconds, 0 if it could
+  // not be sampled (Karn's rule)
+  uint32_t rtt;
+  // smoothed round trip time in microseconds, 0 before the first sample
+  uint32_t srtt;
+  // monotonic time of the ACK in microseconds
+  uint64_t now;
+  // whether the sender was in fast recovery when the ACK arrived
+  bool in_recovery;
+};
+
+/**
+ * congestion_control decides how many packets the sender may have in
+ * flight, and how fast it may send them
+ *
+ * The sender detects losses and retransmits on its own, and only reports
+ * the events below. Every hook is called from the sender's event loop.
+ */
+class congestion_control {
+ public:
+  virtual ~congestion_control() {}
+
+  virtual const char* name() = 0;
+
+  /**
+   * on_ack is called for every ACK that acknowledges new data, including
+   * the partial ACKs of fast recovery
+   */
+  virtual void on_ack(const ack_sample& ack) = 0;
+
+  /**
+   * on_dupack is called for every duplicate ACK, one more packet has left
+   * the network
+   */
+  virtual void on_dupack(const ack_sample& ack) { (void)ack; }
+
+  /**
+   * on_loss is called once when fast retransmit starts a recovery
+   */
+  virtual void on_loss(const ack_sample& ack) = 0;
+
+  /**
+   * on_recovery is called when the ACK for every packet that was in flight
+   * at on_loss() arrives, fast recovery is over
+   */
+  virtual void on_recovery() {}
+
+  /**
+   * on_timeout is called on a retransmission timeout
+   *
+   * @param now monotonic time in microseconds
+   */
+  virtual void on_timeout(uint64_t now) = 0;
+
+  /**
+   * cwnd is the congestion window in packets
+   */
+  virtual double cwnd() = 0;
+
+  /**
+   * in_slow_start tells whether the window grows exponentially, or the
+   * controller is otherwise still probing for the capacity of the path
+   */
+  virtual bool in_slow_start() { return false; }
+
+  /**
+   * pacing_rate is the rate the window should be sent at, in packets per
+   * second, or 0 to let the sender derive it from cwnd() and the RTT
+   */
+  virtual double pacing_rate() { return 0; }
+
+  virtual void print_stats() = 0;
+};
+
+#endif  // MP2_CONGESTION_HPP
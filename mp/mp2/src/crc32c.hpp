@@ -0,0 +1,408 @@
+#ifndef MP2_CRC32C_HPP
+#define MP2_CRC32C_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32C_X86 1
+#endif
+
+// The Castagnoli polynomial, bit-reflected as the SSE4.2 instruction uses it
+#define CRC32C_POLY 0x82f63b78
+// Bytes each of the three interleaved CRCs of the SSE4.2 kernel covers per
+// round, a multiple of 8. Three rounds cover a full 1444-byte payload but
+// for 4 bytes, what is left goes through one CRC at a time
+#define CRC32C_BLOCK 160
+
+// The kernels run once or twice over every byte sent or received, they are
+// optimised even when the rest of the build is not
+#if defined(__GNUC__) && !defined(__clang__)
+#define CRC32C_OPTIMIZE __attribute__((optimize("O2")))
+#else
+#define CRC32C_OPTIMIZE
+#endif
+
+/**
+ * crc32c_shift_table fills the table of a linear map of the raw register,
+ * one lookup per byte, from the images of its 32 bits
+ */
+static void crc32c_shift_table(uint32_t t[4][256], const uint32_t bit[32]) {
+  uint32_t c;
+
+  for (int k = 0; k < 4; k++)
+    for (int i = 0; i < 256; i++) {
+      c = 0;
+      for (int b = 0; b < 8; b++)
+        if (i >> b & 1)
+          c ^= bit[k * 8 + b];
+      t[k][i] = c;
+    }
+}
+
+/**
+ * CRC32C, the checksum of every datagram and of the whole file.
+ *
+ * crc32c() continues a checksum the way zlib's crc32() does: start from 0,
+ * feed the data in as many pieces as convenient. SSE4.2 computes it 8 bytes
+ * per instruction and is picked at run time along with PCLMULQDQ, other
+ * CPUs use slice-by-8: 8 tables of 256 entries that fold 8 bytes per step.
+ *
+ * The instruction takes 3 cycles but a new one can start every cycle, so
+ * the SSE4.2 kernel runs three CRCs over consecutive blocks side by side.
+ * The register of a block is linear in its bits, moving it past the n bytes
+ * that follow is a carry-less multiplication by x^(8n - 33) and one more
+ * CRC instruction, which adds the other 33. Tables would do it as well, but
+ * between two datagrams the system calls evict them from the cache.
+ */
+struct crc32c_tables {
+  uint32_t t[8][256];
+  // fold[j] moves a register past (j + 1) * CRC32C_BLOCK bytes, see above
+  uint32_t fold[2];
+
+  crc32c_tables() {
+    uint32_t c;
+
+    for (int i = 0; i < 256; i++) {
+      c = i;
+      for (int k = 0; k < 8; k++)
+        c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+      t[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++)
+      for (int j = 1; j < 8; j++)
+        t[j][i] = (t[j - 1][i] >> 8) ^ t[0][t[j - 1][i] & 0xff];
+
+    // x^0 is the top bit, multiplying by x shifts right
+    for (int j = 0; j < 2; j++) {
+      c = 1U << 31;
+      for (int n = 0; n < 8 * (j + 1) * CRC32C_BLOCK - 33; n++)
+        c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+      fold[j] = c;
+    }
+  }
+};
+
+static inline const crc32c_tables& crc32c_table() {
+  static const crc32c_tables tables;
+  return tables;
+}
+
+/**
+ * crc32c_sliced advances the raw register c, without the pre and post
+ * inversion
+ */
+CRC32C_OPTIMIZE static uint32_t crc32c_sliced(uint32_t c, const uint8_t* p,
+                                              size_t n) {
+  const uint32_t(*t)[256] = crc32c_table().t;
+  uint64_t v;
+
+  for (; n >= 8; n -= 8, p += 8) {
+    memcpy(&v, p, 8);
+    v ^= c;
+    c = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff] ^ t[5][(v >> 16) & 0xff] ^
+        t[4][(v >> 24) & 0xff] ^ t[3][(v >> 32) & 0xff] ^
+        t[2][(v >> 40) & 0xff] ^ t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+  }
+  for (; n > 0; n--, p++)
+    c = (c >> 8) ^ t[0][(c ^ *p) & 0xff];
+  return c;
+}
+
+/**
+ * crc32c_sliced_zeroed is crc32c_sliced() of words, with the one at field
+ * taken as 0, four tables fold each word
+ */
+CRC32C_OPTIMIZE static uint32_t crc32c_sliced_zeroed(uint32_t c,
+                                                     const uint8_t* p,
+                                                     size_t n, size_t field) {
+  const uint32_t(*t)[256] = crc32c_table().t;
+  uint32_t w;
+
+  for (size_t i = 0; i < n; i += 4) {
+    memcpy(&w, p + i, 4);
+    w = field == i ? c : w ^ c;
+    c = t[3][w & 0xff] ^ t[2][(w >> 8) & 0xff] ^ t[1][(w >> 16) & 0xff] ^
+        t[0][w >> 24];
+  }
+  return c;
+}
+
+/**
+ * crc32c_shift moves the raw register c past the zero bytes a shift table
+ * stands for
+ */
+static inline uint32_t crc32c_shift(const uint32_t t[4][256], uint32_t c) {
+  return t[0][c & 0xff] ^ t[1][(c >> 8) & 0xff] ^ t[2][(c >> 16) & 0xff] ^
+         t[3][c >> 24];
+}
+
+#ifdef CRC32C_X86
+CRC32C_OPTIMIZE __attribute__((target("sse4.2,pclmul"))) static uint32_t
+crc32c_sse42(uint32_t c, const uint8_t* p, size_t n) {
+  uint32_t w;
+#ifdef __x86_64__
+  const crc32c_tables& tables = crc32c_table();
+  // the fold of the first block in the low half, of the second in the high
+  const __m128i k = _mm_set_epi64x(tables.fold[0], tables.fold[1]);
+  uint64_t a, b, d, v;
+
+  for (; n >= 3 * CRC32C_BLOCK; n -= 3 * CRC32C_BLOCK, p += 3 * CRC32C_BLOCK) {
+    a = c;
+    b = d = 0;
+    for (int i = 0; i < CRC32C_BLOCK; i += 8) {
+      memcpy(&v, p + i, 8);
+      a = _mm_crc32_u64(a, v);
+      memcpy(&v, p + CRC32C_BLOCK + i, 8);
+      b = _mm_crc32_u64(b, v);
+      memcpy(&v, p + 2 * CRC32C_BLOCK + i, 8);
+      d = _mm_crc32_u64(d, v);
+    }
+    v = _mm_cvtsi128_si64(
+        _mm_xor_si128(_mm_clmulepi64_si128(_mm_cvtsi64_si128(a), k, 0x00),
+                      _mm_clmulepi64_si128(_mm_cvtsi64_si128(b), k, 0x10)));
+    c = _mm_crc32_u64(0, v) ^ d;
+  }
+  a = c;
+  for (; n >= 8; n -= 8, p += 8) {
+    memcpy(&v, p, 8);
+    a = _mm_crc32_u64(a, v);
+  }
+  c = (uint32_t)a;
+#endif
+  for (; n >= 4; n -= 4, p += 4) {
+    memcpy(&w, p, 4);
+    c = _mm_crc32_u32(c, w);
+  }
+  for (; n > 0; n--, p++)
+    c = _mm_crc32_u8(c, *p);
+  return c;
+}
+
+/**
+ * crc32c_sse42_zeroed is crc32c_sse42() of words, with the one at field
+ * taken as 0
+ */
+CRC32C_OPTIMIZE __attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42_zeroed(uint32_t c, const uint8_t* p, size_t n, size_t field) {
+  size_t i = 0;
+  uint32_t w;
+#ifdef __x86_64__
+  uint64_t a = c, v;
+
+  for (; i + 8 <= n; i += 8) {
+    memcpy(&v, p + i, 8);
+    if (field == i)
+      v &= 0xffffffff00000000ULL;
+    else if (field == i + 4)
+      v &= 0xffffffffULL;
+    a = _mm_crc32_u64(a, v);
+  }
+  c = (uint32_t)a;
+#endif
+  for (; i < n; i += 4) {
+    memcpy(&w, p + i, 4);
+    c = _mm_crc32_u32(c, field == i ? 0 : w);
+  }
+  return c;
+}
+
+#ifdef __x86_64__
+/**
+ * crc32c_sse42_shift moves the raw register c past the zero bytes of which
+ * fold is x^(8n - 33), the way crc32c_sse42() moves its blocks
+ */
+CRC32C_OPTIMIZE __attribute__((target("sse4.2,pclmul"))) static uint32_t
+crc32c_sse42_shift(uint32_t c, uint32_t fold) {
+  return _mm_crc32_u64(
+      0, _mm_cvtsi128_si64(_mm_clmulepi64_si128(
+             _mm_cvtsi64_si128(c), _mm_cvtsi64_si128(fold), 0x00)));
+}
+#endif
+#endif
+
+typedef uint32_t (*crc32c_kernel)(uint32_t, const uint8_t*, size_t);
+typedef uint32_t (*crc32c_zeroed_kernel)(uint32_t, const uint8_t*, size_t,
+                                         size_t);
+
+/**
+ * crc32c_best_kernel picks the instructions if the CPU has them
+ */
+static inline crc32c_kernel crc32c_best_kernel() {
+#ifdef CRC32C_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul"))
+    return crc32c_sse42;
+#endif
+  return crc32c_sliced;
+}
+
+/**
+ * crc32c_best_zeroed_kernel pairs crc32c_best_kernel() with the kernel of
+ * crc32c_zeroed()
+ */
+static inline crc32c_zeroed_kernel crc32c_best_zeroed_kernel() {
+#ifdef CRC32C_X86
+  if (crc32c_best_kernel() == crc32c_sse42)
+    return crc32c_sse42_zeroed;
+#endif
+  return crc32c_sliced_zeroed;
+}
+
+/**
+ * crc32c continues the checksum crc of earlier data with n more bytes
+ *
+ * @param crc 0 to start, or what the previous call returned
+ */
+static inline uint32_t crc32c(uint32_t crc, const void* data, size_t n) {
+  static const crc32c_kernel kernel = crc32c_best_kernel();
+
+  return ~kernel(~crc, (const uint8_t*)data, n);
+}
+
+/**
+ * crc32c_zeroed continues the checksum crc with n bytes as if the 4 at
+ * offset field were 0, for a short header that carries its own checksum: no
+ * copy of it with the field cleared, and no byte at a time
+ *
+ * @param n a multiple of 4
+ * @param field a multiple of 4 below n
+ */
+static inline uint32_t crc32c_zeroed(uint32_t crc, const void* data,
+                                     size_t n, size_t field) {
+  static const crc32c_zeroed_kernel kernel = crc32c_best_zeroed_kernel();
+
+  return ~kernel(~crc, (const uint8_t*)data, n, field);
+}
+
+/**
+ * crc32c_kernel_name tells which implementation crc32c() uses
+ */
+static inline const char* crc32c_kernel_name() {
+  return crc32c_best_kernel() == crc32c_sliced ? "slice-by-8" : "sse4.2";
+}
+
+/**
+ * crc32c_multmodp multiplies a and b modulo the polynomial, in the
+ * reflected bit order
+ */
+static inline uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+  uint32_t m = 1U << 31, p = 0;
+
+  while (true) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0)
+        break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+/**
+ * crc32c_x8n returns x^(8 * n) modulo the polynomial, by squaring its way
+ * up
+ */
+static inline uint32_t crc32c_x8n(unsigned long long n) {
+  uint32_t p = 1U << 31, x2n = 1U << 30;
+
+  // x2n runs through x^(2^k), starting at x^8 for bytes
+  for (int k = 0; k < 3; k++)
+    x2n = crc32c_multmodp(x2n, x2n);
+  for (; n > 0; n >>= 1) {
+    if (n & 1)
+      p = crc32c_multmodp(x2n, p);
+    x2n = crc32c_multmodp(x2n, x2n);
+  }
+  return p;
+}
+
+/**
+ * crc32c_combine returns the checksum of two pieces of data back to back
+ * from the checksums of each, as zlib's crc32_combine() does: the first
+ * one is multiplied by x^(8 * len2)
+ *
+ * @param len2 the length of the second piece in bytes
+ */
+static inline uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2,
+                                      unsigned long long len2) {
+  return crc32c_multmodp(crc32c_x8n(len2), crc1) ^ crc2;
+}
+
+/**
+ * crc32c_span combines checksums with that of a piece of one length in a
+ * carry-less multiplication, or a few lookups without PCLMULQDQ,
+ * crc32c_combine() works its way up to x^(8 * length) every time. Built
+ * once for the length most pieces have
+ */
+struct crc32c_span {
+  unsigned long long length;
+  uint32_t t[4][256];
+  // x^(8 * length - 33) for crc32c_sse42_shift(), 0 if length is below 5
+  uint32_t fold;
+
+  explicit crc32c_span(unsigned long long length) : length(length) {
+    uint32_t x8n = crc32c_x8n(length), bit[32];
+
+    for (int b = 0; b < 32; b++)
+      bit[b] = crc32c_multmodp(x8n, 1U << b);
+    crc32c_shift_table(t, bit);
+    // x^7 is the 8th bit from the top
+    fold = length < 5 ? 0
+                      : crc32c_multmodp(crc32c_x8n(length - 5), 1U << 24);
+  }
+
+  /**
+   * shift moves the raw register c past length zero bytes
+   */
+  uint32_t shift(uint32_t c) const {
+#if defined(CRC32C_X86) && defined(__x86_64__)
+    static const bool clmul = crc32c_best_kernel() == crc32c_sse42;
+
+    if (clmul && fold != 0)
+      return crc32c_sse42_shift(c, fold);
+#endif
+    return crc32c_shift(t, c);
+  }
+};
+
+/**
+ * crc32c_stream is the checksum of the data seen so far and its length,
+ * which is all it takes to append another stream to it
+ */
+struct crc32c_stream {
+  uint32_t crc = 0;
+  unsigned long long bytes = 0;
+
+  void update(const void* data, size_t n) {
+    crc = crc32c(crc, data, n);
+    bytes += n;
+  }
+
+  void append(const crc32c_stream& next) {
+    crc = crc32c_combine(crc, next.crc, next.bytes);
+    bytes += next.bytes;
+  }
+
+  /**
+   * append adds a piece whose own checksum is known, without going over
+   * its data again
+   *
+   * @param piece crc32c(0, data, length) of the piece
+   * @param span used if the piece has its length
+   */
+  void append(uint32_t piece, unsigned long long length,
+              const crc32c_span& span) {
+    if (length == span.length)
+      crc = span.shift(crc) ^ piece;
+    else
+      crc = crc32c_combine(crc, piece, length);
+    bytes += length;
+  }
+};
+
+#endif  // MP2_CRC32C_HPP
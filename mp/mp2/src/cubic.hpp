@@ -0,0 +1,111 @@
+#ifndef MP2_CUBIC_HPP
+#define MP2_CUBIC_HPP
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "congestion.hpp"
+
+// Scaling constant C of the cubic function, in packets / second^3
+#define CUBIC_C 0.4
+// Multiplicative decrease factor
+#define CUBIC_BETA 0.7
+
+/**
+ * cubic is CUBIC (RFC 9438)
+ *
+ * After a loss the window grows along W(t) = C (t - K)^3 + W_max, where t
+ * is the time since the start of the epoch and K the time it takes to get
+ * back to W_max. Growth is independent of the RTT, so a long fat pipe is
+ * filled again in seconds instead of thousands of RTTs. The window never
+ * grows slower than Reno would with the same decrease factor.
+ */
+class cubic : public congestion_control {
+ public:
+  /**
+   * @param initial the initial window in packets
+   */
+  cubic(double initial = DEFAULT_CWND)
+      : window(initial), ss_thresh(DEFAULT_SS_THRESH), w_max(0),
+        w_est(0), origin(0), k(0), epoch(0), losses(0) {}
+
+  const char* name() { return "cubic"; }
+
+  void on_ack(const ack_sample& ack) {
+    if (ack.in_recovery)
+      return;
+    if (window < ss_thresh) {
+      window += std::min(ack.acked, (unsigned long)ABC_LIMIT);
+      return;
+    }
+
+    if (epoch == 0) {
+      epoch = ack.now;
+      if (window < w_max) {
+        k = std::cbrt((w_max - window) / CUBIC_C);
+        origin = w_max;
+      } else {
+        k = 0;
+        origin = window;
+      }
+      w_est = window;
+    }
+
+    // aim for where the curve will be one RTT from now
+    double t = (ack.now - epoch + ack.srtt) / 1e6;
+    double target = origin + CUBIC_C * std::pow(t - k, 3);
+    target = std::min(std::max(target, window), 1.5 * window);
+
+    // the Reno-friendly estimate, with the increase that matches beta
+    w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * ack.acked / window;
+
+    window += (target - window) / window * ack.acked;
+    window = std::max(window, w_est);
+  }
+
+  void on_loss(const ack_sample& ack) {
+    (void)ack;
+    reduce();
+    window = ss_thresh;
+  }
+
+  void on_recovery() { window = ss_thresh; }
+
+  void on_timeout(uint64_t now) {
+    (void)now;
+    reduce();
+    window = 1;
+  }
+
+  bool in_slow_start() { return window < ss_thresh; }
+
+  double cwnd() { return window; }
+
+  void print_stats() {
+    fprintf(stderr, "cubic: cwnd %.1f, ssthresh %.1f, w_max %.1f, %lu losses\n",
+            window, ss_thresh, w_max, losses);
+  }
+
+ private:
+  /**
+   * reduce remembers where the loss happened and starts a new epoch
+   */
+  void reduce() {
+    // fast convergence, release bandwidth to newer flows
+    if (window < w_max)
+      w_max = window * (1 + CUBIC_BETA) / 2;
+    else
+      w_max = window;
+    ss_thresh = std::max(window * CUBIC_BETA, (double)MIN_SS_THRESH);
+    epoch = 0;
+    losses++;
+  }
+
+  double window, ss_thresh, w_max, w_est, origin, k;
+  uint64_t epoch;
+  unsigned long losses;
+};
+
+#endif  // MP2_CUBIC_HPP
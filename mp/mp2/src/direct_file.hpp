@@ -0,0 +1,150 @@
+#ifndef MP2_DIRECT_FILE_HPP
+#define MP2_DIRECT_FILE_HPP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "crc32c.hpp"
+#include "sack.hpp"
+#include "shared.hpp"
+
+/**
+ * direct_file is the destination of a transfer whose size is known up front
+ *
+ * The file is preallocated and mapped, and every payload is received
+ * straight to its final place at seqno * chunk. Packets that arrive out of
+ * order are already where they belong, so only a bitmap of the received
+ * seqnos is needed to find the cumulative ACK of every flow.
+ */
+class direct_file {
+ public:
+  /**
+   * @param chunk the payload of every packet but the last
+   */
+  direct_file(int fd, unsigned long long bytes, unsigned int chunk)
+      : map(NULL), bytes(bytes), chunk(chunk) {
+    chunks = (bytes + chunk - 1) / chunk;
+    received.assign((chunks + 63) / 64, 0);
+    if (bytes == 0)
+      return;
+
+    // reserve the blocks now so that a full disk is not a SIGBUS later,
+    // only a file system that cannot reserve them gets the sparse file
+    errno = posix_fallocate(fd, 0, bytes);
+    if (errno != 0 && errno != EOPNOTSUPP)
+      return;
+    if (ftruncate(fd, bytes) < 0)
+      return;
+
+    void* m = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m != MAP_FAILED)
+      map = (char*)m;
+  }
+
+  /**
+   * ok tells whether the file could be mapped, an empty one needs not be
+   */
+  bool ok() { return map != NULL || bytes == 0; }
+
+  /**
+   * at returns where the payload of seqno goes
+   *
+   * @param seqno the seqno of the data packet
+   * @param len the payload length announced in its header
+   * @return NULL if the packet is a duplicate or does not fit the file
+   */
+  char* at(unsigned long seqno, unsigned int len) {
+    if (seqno >= chunks || has(seqno) || len != size(seqno))
+      return NULL;
+    return map + (unsigned long long)seqno * chunk;
+  }
+
+  /**
+   * payload returns the payload of seqno if it has been received
+   *
+   * @return NULL otherwise
+   */
+  const char* payload(unsigned long seqno) {
+    if (seqno >= chunks || !has(seqno))
+      return NULL;
+    return map + (unsigned long long)seqno * chunk;
+  }
+
+  /**
+   * mark records that the payload of seqno has been received
+   */
+  void mark(unsigned long seqno) {
+    received[seqno / 64] |= 1ULL << (seqno % 64);
+  }
+
+  /**
+   * hash adds the payloads of [from, to) to a CRC32C, every one of them
+   * must have been received
+   */
+  void hash(crc32c_stream* digest, unsigned long from, unsigned long to) {
+    unsigned long long start = (unsigned long long)from * chunk;
+    unsigned long long end = std::min((unsigned long long)to * chunk, bytes);
+
+    if (start < end)
+      digest->update(map + start, end - start);
+  }
+
+  /**
+   * sync writes what was received so far back to the file and waits for
+   * it to be on disk
+   */
+  bool sync() { return msync(map, bytes, MS_SYNC) == 0; }
+
+  /**
+   * contiguous returns the first seqno in [from, to) that has not been
+   * received, or to, the cumulative ACK of a flow that is at from and has
+   * sent nothing at or above to
+   */
+  unsigned long contiguous(unsigned long from, unsigned long to) {
+    return find_bit(received.data(), received.size() * 64, from,
+                    std::min(to, chunks), false);
+  }
+
+  /**
+   * sack lists the runs of packets received in [from, to)
+   *
+   * @param recent the seqno that triggered the ACK
+   * @param out receives at most SACK_MAX_BLOCKS blocks
+   * @return the number of blocks
+   */
+  int sack(unsigned long from, unsigned long to, unsigned long recent,
+           sack_block* out) {
+    return collect_sack(received.data(), received.size() * 64, from, to,
+                        recent, out);
+  }
+
+  ~direct_file() {
+    if (map)
+      munmap(map, bytes);
+  }
+
+ private:
+  bool has(unsigned long seqno) {
+    return received[seqno / 64] >> (seqno % 64) & 1;
+  }
+
+  unsigned int size(unsigned long seqno) {
+    if (seqno == chunks - 1)
+      return bytes - (unsigned long long)seqno * chunk;
+    return chunk;
+  }
+
+  char* map;
+  unsigned long long bytes;
+  unsigned int chunk;
+  unsigned long chunks;
+  std::vector<uint64_t> received;
+};
+
+#endif  // MP2_DIRECT_FILE_HPP
@@ -0,0 +1,467 @@
+#ifndef MP2_FEC_HPP
+#define MP2_FEC_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "gf256.hpp"
+#include "shared.hpp"
+
+// Codes a parity packet can be made with
+#define FEC_NONE 0
+// one parity packet, the XOR of the group
+#define FEC_XOR 1
+// up to FEC_MAX_PARITY parity packets of a systematic Cauchy Reed-Solomon
+// code, any K of the K + M packets of a group rebuild it
+#define FEC_RS 2
+// Most data packets in a group, and most parity packets per group
+#define FEC_MAX_GROUP 64
+#define FEC_MAX_PARITY 8
+// Groups of a flow whose parity the receiver holds at the same time
+#define FEC_GROUPS 64
+// Adaptive redundancy: a group sent without any retransmission since the
+// previous one counts as quiet, this many quiet groups in a row take one
+// parity packet away, any retransmission adds one
+#define FEC_ADAPT_GROUPS 16
+
+/**
+ * FEC groups and parity packets
+ *
+ * A flow is cut into groups of K consecutive data packets from its first
+ * seqno. Once the last packet of a group has been sent for the first time,
+ * M parity packets follow it. A parity packet is a PACKET_TYPE_PARITY
+ * datagram with the payload of a full packet, whose seqno is the first
+ * seqno of its group and whose timestamp field is a descriptor instead
+ * (see fec_descriptor), it is never acknowledged or retransmitted.
+ *
+ * Only full packets are coded, so a group that holds the short last packet
+ * of the file goes without parity. Parity i of a Reed-Solomon group is
+ * sum_j c(i, j) d_j with the Cauchy coefficients c(i, j) = 1 / ((K + i) ^ j)
+ * in GF(2^8): every square submatrix of a Cauchy matrix is invertible, so
+ * any E parity packets rebuild any E missing data packets.
+ */
+
+/**
+ * fec_descriptor packs the code, K and the index of a parity packet into
+ * the timestamp field of its header, one byte each from the lowest
+ */
+static inline uint32_t fec_descriptor(unsigned int code, unsigned int k,
+                                      unsigned int index) {
+  return code | k << 8 | index << 16;
+}
+
+/**
+ * fec_coefficient is the weight of data packet j in parity packet i of a
+ * Reed-Solomon group of k
+ */
+static inline uint8_t fec_coefficient(unsigned int k, unsigned int i,
+                                      unsigned int j) {
+  return gf256_inv((k + i) ^ j);
+}
+
+/**
+ * fec_encoder makes the parity packets of a flow as its data goes out
+ *
+ * Each data packet is folded into the parity of its group as it is sent
+ * for the first time, so the payloads never need to be kept around. The
+ * finished parity packets are copied to a ring that is large enough for
+ * everything a send batch can hold, they stay valid until it is flushed.
+ */
+class fec_encoder {
+ public:
+  /**
+   * @param code FEC_XOR or FEC_RS
+   * @param k data packets per group
+   * @param m parity packets per group, the initial value if adaptive
+   * @param adaptive whether m follows the retransmissions of the flow
+   * @param first the first seqno of the flow
+   * @param pending parity packets that may be queued but not sent yet
+   * @param chunk the payload of a full packet, and of a parity packet
+   */
+  fec_encoder(int code, unsigned int k, unsigned int m, bool adaptive,
+              unsigned long first, unsigned int pending, unsigned int chunk)
+      : code(code), k(k), m(code == FEC_XOR ? 1 : m), adaptive(adaptive),
+        first(first), chunk(chunk), slots(pending + FEC_MAX_PARITY),
+        next_slot(0), group_m(0), valid(false), quiet(0), last_resent(0),
+        groups(0), coded(0), sent(0) {
+    ring = new uint8_t[(size_t)slots * chunk];
+  }
+
+  /**
+   * add folds a data packet that is sent for the first time into the
+   * parity of its group
+   *
+   * @param resent the retransmissions of the flow so far, what adaptive
+   *        redundancy follows
+   * @return the number of parity packets that are ready to go after it
+   */
+  unsigned int add(unsigned long seqno, const char* data, unsigned int len,
+                   unsigned long resent) {
+    unsigned int pos = (seqno - first) % k, i;
+
+    if (pos == 0) {
+      adapt(resent);
+      group = seqno;
+      group_m = m;
+      valid = group_m > 0;
+      memset(acc, 0, sizeof(acc));
+    }
+    // a short packet or a group that started before a restart is not coded
+    if (!valid || seqno != group + pos || len != chunk) {
+      valid = false;
+      return 0;
+    }
+
+    for (i = 0; i < group_m; i++) {
+      if (code == FEC_XOR)
+        gf256_xor(acc[i], (const uint8_t*)data, chunk);
+      else
+        gf256_muladd(acc[i], (const uint8_t*)data,
+                     fec_coefficient(k, i, pos), chunk);
+    }
+    if (pos + 1 < k)
+      return 0;
+
+    for (i = 0; i < group_m; i++) {
+      out[i] = ring + (size_t)next_slot * chunk;
+      memcpy(out[i], acc[i], chunk);
+      next_slot = (next_slot + 1) % slots;
+    }
+    valid = false;
+    coded++;
+    sent += group_m;
+    return group_m;
+  }
+
+  /**
+   * group_start is the first seqno of the group add() just finished
+   */
+  unsigned long group_start() { return group; }
+
+  /**
+   * parity returns parity packet i of that group
+   */
+  const char* parity(unsigned int i) { return (const char*)out[i]; }
+
+  uint32_t descriptor(unsigned int i) { return fec_descriptor(code, k, i); }
+
+  /**
+   * repair_point is one past the group of seqno while parity is sent, a
+   * hole at seqno may still be rebuilt until the receiver has got that far
+   */
+  unsigned long repair_point(unsigned long seqno) {
+    if (m == 0)
+      return seqno;
+    return first + ((seqno - first) / k + 1) * k;
+  }
+
+  void print_stats() {
+    fprintf(stderr,
+            "fec: %s k=%u, %lu groups, %lu coded, %lu parity packets "
+            "(%.1f%%), m=%u at the end, %s kernel\n",
+            code == FEC_XOR ? "xor" : "rs", k, groups, coded, sent,
+            groups ? 100.0 * sent / (groups * k) : 0, m, gf256_kernel_name());
+  }
+
+  ~fec_encoder() { delete[] ring; }
+
+ private:
+  /**
+   * adapt moves m by one when a group starts, up after retransmissions
+   * and down after FEC_ADAPT_GROUPS groups without any
+   */
+  void adapt(unsigned long resent) {
+    groups++;
+    if (!adaptive)
+      return;
+    if (resent > last_resent) {
+      m = std::min(m + 1, std::min(k, (unsigned int)FEC_MAX_PARITY));
+      quiet = 0;
+    } else if (++quiet == FEC_ADAPT_GROUPS) {
+      m = m > 0 ? m - 1 : 0;
+      quiet = 0;
+    }
+    last_resent = resent;
+  }
+
+  int code;
+  unsigned int k, m;
+  bool adaptive;
+  unsigned long first, group;
+  unsigned int chunk;
+  uint8_t acc[FEC_MAX_PARITY][MAX_PACKET_SIZE];
+  uint8_t* out[FEC_MAX_PARITY];
+  uint8_t* ring;
+  unsigned int slots, next_slot;
+  // the m of the group being coded, and whether it is still coded
+  unsigned int group_m;
+  bool valid;
+  unsigned int quiet;
+  unsigned long last_resent;
+  unsigned long groups, coded, sent;
+};
+
+/**
+ * fec_group is the parity the receiver holds for one group
+ */
+struct fec_group {
+  unsigned long first;
+  bool used;
+  unsigned int code, k;
+  // bit i is set once parity packet i is held
+  uint32_t have;
+  uint8_t parity[FEC_MAX_PARITY][MAX_PACKET_SIZE];
+};
+
+/**
+ * fec_decoder rebuilds the missing data packets of a flow from the parity
+ * packets that arrive
+ *
+ * The parity of the last FEC_GROUPS groups is held, a group is let go
+ * once it is complete. The decoder does not keep any data: rebuild() reads
+ * the payloads the receiver holds through a callback, and treats the ones
+ * it cannot read as missing.
+ */
+class fec_decoder {
+ public:
+  /**
+   * @param id the first seqno of the flow
+   * @param chunk the payload of a full packet, and of a parity packet
+   */
+  fec_decoder(unsigned long id, unsigned int chunk)
+      : id(id), chunk(chunk), k(0), received(0), repaired(0), failed(0) {
+    groups = new fec_group[FEC_GROUPS];
+    for (unsigned int i = 0; i < FEC_GROUPS; i++)
+      groups[i].used = false;
+    for (unsigned int i = 0; i < FEC_MAX_PARITY; i++)
+      rebuilt[i].set_type(PACKET_TYPE_DATA | PACKET_TYPE_RETX);
+  }
+
+  /**
+   * add_parity holds a parity packet until its group can be rebuilt
+   *
+   * @return false if it is malformed or its group is gone already
+   */
+  bool add_parity(const packet* p) {
+    unsigned int code = p->timestamp & 0xff, pk = p->timestamp >> 8 & 0xff;
+    unsigned int index = p->timestamp >> 16 & 0xff;
+    fec_group* g;
+
+    if ((code != FEC_XOR && code != FEC_RS) || pk == 0 ||
+        pk > FEC_MAX_GROUP || index >= FEC_MAX_PARITY ||
+        p->data_sz != chunk || p->seqno < id ||
+        (p->seqno - id) % pk != 0)
+      return false;
+    received++;
+    k = pk;
+
+    g = slot(p->seqno);
+    if (!g->used || g->first != p->seqno) {
+      // a newer group takes the slot, an older one is gone for good
+      if (g->used && g->first > p->seqno)
+        return false;
+      g->used = true;
+      g->first = p->seqno;
+      g->code = code;
+      g->k = pk;
+      g->have = 0;
+    }
+    if (g->have >> index & 1)
+      return false;
+    memcpy(g->parity[index], p->data, chunk);
+    g->have |= 1U << index;
+    return true;
+  }
+
+  /**
+   * pending tells whether parity is held for the group of seqno
+   *
+   * @param first receives the first seqno of the group
+   */
+  bool pending(unsigned long seqno, unsigned long* first) {
+    if (k == 0 || seqno < id)
+      return false;
+    *first = id + (seqno - id) / k * k;
+    fec_group* g = slot(*first);
+    return g->used && g->first == *first;
+  }
+
+  /**
+   * retain is the first seqno whose payload rebuild() may still need once
+   * everything below next has arrived, the start of the group of next
+   */
+  unsigned long retain(unsigned long next) {
+    if (k == 0 || next < id)
+      return next;
+    return id + (next - id) / k * k;
+  }
+
+  /**
+   * rebuild rebuilds the missing packets of a group if enough of it has
+   * arrived, and lets the group go once nothing is missing
+   *
+   * @param first the first seqno of the group
+   * @param payload returns the payload of a seqno, NULL if it is missing
+   * @return the number of packets rebuilt, see packet_at()
+   */
+  template <typename Payload>
+  unsigned int rebuild(unsigned long first, Payload payload) {
+    fec_group* g = slot(first);
+    unsigned int missing[FEC_MAX_PARITY], rows[FEC_MAX_PARITY];
+    const uint8_t* data[FEC_MAX_GROUP];
+    unsigned int e = 0, r = 0, i, j;
+
+    if (!g->used || g->first != first)
+      return 0;
+    for (j = 0; j < g->k; j++) {
+      data[j] = (const uint8_t*)payload(first + j);
+      if (data[j] != NULL)
+        continue;
+      // more holes than parity can ever fill, wait for retransmissions
+      if (e == FEC_MAX_PARITY)
+        return 0;
+      missing[e++] = j;
+    }
+    if (e == 0) {
+      g->used = false;
+      return 0;
+    }
+    for (i = 0; i < FEC_MAX_PARITY && r < e; i++)
+      if (g->have >> i & 1)
+        rows[r++] = i;
+    if (r < e)
+      return 0;
+
+    if (g->code == FEC_XOR) {
+      solve_xor(g, data, missing[0]);
+    } else if (!solve_rs(g, data, missing, rows, e)) {
+      failed++;
+      g->used = false;
+      return 0;
+    }
+
+    for (i = 0; i < e; i++) {
+      rebuilt[i].seqno = first + missing[i];
+      rebuilt[i].data_sz = chunk;
+      rebuilt[i].flow = id;
+    }
+    repaired += e;
+    g->used = false;
+    return e;
+  }
+
+  /**
+   * packet_at returns rebuilt packet i of the last rebuild()
+   */
+  const packet* packet_at(unsigned int i) { return &rebuilt[i]; }
+
+  void print_stats() {
+    fprintf(stderr,
+            "fec: %lu parity packets received, %lu packets rebuilt, %lu "
+            "groups failed\n",
+            received, repaired, failed);
+  }
+
+  ~fec_decoder() { delete[] groups; }
+
+ private:
+  fec_group* slot(unsigned long first) {
+    return &groups[(first - id) / k % FEC_GROUPS];
+  }
+
+  void solve_xor(fec_group* g, const uint8_t** data, unsigned int hole) {
+    uint8_t* out = (uint8_t*)rebuilt[0].data;
+
+    memcpy(out, g->parity[0], chunk);
+    for (unsigned int j = 0; j < g->k; j++)
+      if (j != hole)
+        gf256_xor(out, data[j], chunk);
+  }
+
+  /**
+   * solve_rs takes what the present packets contribute out of e parity
+   * packets, which leaves e equations in the e missing packets, and solves
+   * them with the inverse of their Cauchy submatrix
+   */
+  bool solve_rs(fec_group* g, const uint8_t** data, unsigned int* missing,
+                unsigned int* rows, unsigned int e) {
+    uint8_t a[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    uint8_t inv[FEC_MAX_PARITY][FEC_MAX_PARITY];
+    unsigned int i, j;
+
+    for (i = 0; i < e; i++) {
+      memcpy(syndrome[i], g->parity[rows[i]], chunk);
+      for (j = 0; j < g->k; j++)
+        if (data[j])
+          gf256_muladd(syndrome[i], data[j],
+                       fec_coefficient(g->k, rows[i], j), chunk);
+      for (j = 0; j < e; j++)
+        a[i][j] = fec_coefficient(g->k, rows[i], missing[j]);
+    }
+    if (!invert(a, inv, e))
+      return false;
+
+    for (i = 0; i < e; i++) {
+      uint8_t* out = (uint8_t*)rebuilt[i].data;
+      memset(out, 0, chunk);
+      for (j = 0; j < e; j++)
+        gf256_muladd(out, syndrome[j], inv[i][j], chunk);
+    }
+    return true;
+  }
+
+  /**
+   * invert inverts an n by n matrix by Gauss-Jordan elimination
+   *
+   * @return false if it is singular, which a Cauchy matrix never is
+   */
+  static bool invert(uint8_t a[][FEC_MAX_PARITY],
+                     uint8_t inv[][FEC_MAX_PARITY], unsigned int n) {
+    unsigned int i, j, col, pivot;
+    uint8_t scale;
+
+    for (i = 0; i < n; i++)
+      for (j = 0; j < n; j++)
+        inv[i][j] = i == j;
+
+    for (col = 0; col < n; col++) {
+      for (pivot = col; pivot < n && a[pivot][col] == 0; pivot++)
+        ;
+      if (pivot == n)
+        return false;
+      for (j = 0; j < n; j++) {
+        std::swap(a[col][j], a[pivot][j]);
+        std::swap(inv[col][j], inv[pivot][j]);
+      }
+      scale = gf256_inv(a[col][col]);
+      for (j = 0; j < n; j++) {
+        a[col][j] = gf256_mul(a[col][j], scale);
+        inv[col][j] = gf256_mul(inv[col][j], scale);
+      }
+      for (i = 0; i < n; i++) {
+        if (i == col || a[i][col] == 0)
+          continue;
+        scale = a[i][col];
+        for (j = 0; j < n; j++) {
+          a[i][j] ^= gf256_mul(a[col][j], scale);
+          inv[i][j] ^= gf256_mul(inv[col][j], scale);
+        }
+      }
+    }
+    return true;
+  }
+
+  unsigned long id;
+  unsigned int chunk;
+  // the group size of the flow, from the first parity packet
+  unsigned int k;
+  fec_group* groups;
+  uint8_t syndrome[FEC_MAX_PARITY][MAX_PACKET_SIZE];
+  packet rebuilt[FEC_MAX_PARITY];
+  unsigned long received, repaired, failed;
+};
+
+#endif  // MP2_FEC_HPP
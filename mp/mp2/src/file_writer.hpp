@@ -0,0 +1,255 @@
+#ifndef MP2_FILE_WRITER_HPP
+#define MP2_FILE_WRITER_HPP
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "crc32c.hpp"
+#include "shared.hpp"
+#include "wire.hpp"
+
+// Capacity of the queue between the network thread and the writer.
+// Must be a power of two, and at least as large as the reorder buffer so
+// that in-order data can always be handed off without blocking
+#define WRITER_QUEUE 8192
+// Most buffers gathered into one pwritev
+#define WRITER_IOV 512
+
+/**
+ * file_writer writes in-order payloads to a file on its own thread
+ *
+ * The network thread hands over pointers to payloads through a single
+ * producer, single consumer ring. The writer thread gathers every buffer
+ * that is contiguous in the file into one pwritev, then publishes how far
+ * it got in each flow so that the producer can reuse those buffers. The
+ * network thread never waits for the disk.
+ *
+ * The writer also keeps the CRC32C of what it wrote of each flow, every
+ * flow is pushed in order. Each payload comes with its own CRC32C, which is
+ * appended to that of its flow without reading the payload again.
+ */
+class file_writer {
+ public:
+  /**
+   * @param chunk the payload of every packet but the last
+   */
+  file_writer(int fd, unsigned int chunk)
+      : fd(fd), head(0), tail(0), full(chunk), sleeping(false),
+        closed(false), max_depth(0), total_depth(0), pushes(0) {
+    for (int i = 0; i < MAX_FLOWS; i++)
+      done[i].store(0, std::memory_order_relaxed);
+    thread = std::thread(&file_writer::run, this);
+  }
+
+  /**
+   * push queues the next in-order payload of a flow
+   *
+   * @param flow the index of the flow, below MAX_FLOWS
+   * @param seqno the seqno of the payload, released through written()
+   * @param data the payload, must stay valid until written() passes seqno,
+   *        or NULL if it is already in the file and only needs to be read
+   *        back for the CRC32C of the flow
+   * @param len the number of bytes to write
+   * @param offset where the payload goes in the file
+   * @param crc crc32c(0, data, len), unused if data is NULL
+   */
+  void push(unsigned int flow, unsigned long seqno, const char* data,
+            unsigned int len, unsigned long long offset, uint32_t crc) {
+    unsigned long h = head.load(std::memory_order_relaxed);
+
+    while (h - tail.load(std::memory_order_acquire) == WRITER_QUEUE)
+      std::this_thread::yield();
+
+    entry* e = &queue[h % WRITER_QUEUE];
+    e->flow = flow;
+    e->seqno = seqno;
+    e->data = data;
+    e->len = len;
+    e->offset = offset;
+    e->crc = crc;
+    head.store(h + 1, std::memory_order_seq_cst);
+
+    unsigned long depth = h + 1 - tail.load(std::memory_order_relaxed);
+    total_depth += depth;
+    pushes++;
+    if (depth > max_depth)
+      max_depth = depth;
+
+    if (sleeping.load(std::memory_order_seq_cst)) {
+      std::lock_guard<std::mutex> lock(mutex);
+      wakeup.notify_one();
+    }
+  }
+
+  /**
+   * written is one past the last seqno of flow that is on disk, every
+   * buffer pushed for a lower seqno may be reused
+   */
+  unsigned long written(unsigned int flow) {
+    return done[flow].load(std::memory_order_acquire);
+  }
+
+  /**
+   * digest is the CRC32C of what was written of flow, only once written()
+   * caught up with every push of that flow
+   */
+  crc32c_stream digest(unsigned int flow) { return digests[flow]; }
+
+  /**
+   * close writes whatever is still queued and stops the writer thread
+   */
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+      wakeup.notify_one();
+    }
+    thread.join();
+  }
+
+  void print_stats() {
+    writes.print("pwritev");
+    fprintf(stderr, "writer queue depth: avg %.2f, max %lu\n",
+            pushes ? (double)total_depth / pushes : 0, max_depth);
+  }
+
+  // Number of buffers written by each pwritev
+  batch_stats writes;
+
+ private:
+  struct entry {
+    unsigned int flow;
+    unsigned long seqno;
+    const char* data;
+    unsigned int len;
+    unsigned long long offset;
+    uint32_t crc;
+  };
+
+  void run() {
+    struct iovec iov[WRITER_IOV];
+    unsigned long t, h, n;
+    unsigned long long start;
+    size_t bytes;
+
+    while (true) {
+      t = tail.load(std::memory_order_relaxed);
+      h = head.load(std::memory_order_seq_cst);
+      if (t == h && !wait())
+        return;
+      if (t == h)
+        continue;
+
+      // gather everything that continues the first buffer in the file
+      start = queue[t % WRITER_QUEUE].offset;
+      bytes = 0;
+      for (n = 0; t + n < h && n < WRITER_IOV; n++) {
+        entry* e = &queue[(t + n) % WRITER_QUEUE];
+        if (e->offset != start + bytes || e->data == NULL)
+          break;
+        iov[n].iov_base = (void*)e->data;
+        iov[n].iov_len = e->len;
+        bytes += e->len;
+      }
+
+      if (n == 0) {
+        read_back(&queue[t % WRITER_QUEUE]);
+        n = 1;
+      } else {
+        write_all(iov, n, start, bytes);
+        writes.record(n);
+      }
+
+      for (unsigned long i = 0; i < n; i++) {
+        entry* e = &queue[(t + i) % WRITER_QUEUE];
+        if (e->data)
+          digests[e->flow].append(e->crc, e->len, full);
+        done[e->flow].store(e->seqno + 1, std::memory_order_release);
+      }
+      tail.store(t + n, std::memory_order_release);
+    }
+  }
+
+  /**
+   * write_all writes a gather list completely, retrying short writes
+   */
+  void write_all(struct iovec* iov, int n, unsigned long long start,
+                 size_t bytes) {
+    ssize_t ret;
+
+    while (bytes > 0) {
+      ret = pwritev(fd, iov, n, start);
+      if (ret < 0)
+        diep((char*)"pwritev");
+      start += ret;
+      bytes -= ret;
+      for (; n > 0 && (size_t)ret >= iov->iov_len; iov++, n--)
+        ret -= iov->iov_len;
+      if (n > 0) {
+        iov->iov_base = (char*)iov->iov_base + ret;
+        iov->iov_len -= ret;
+      }
+    }
+  }
+
+  /**
+   * read_back adds what the file already holds at an entry to the CRC32C
+   * of its flow, the end of the file cuts it short
+   */
+  void read_back(const entry* e) {
+    char buf[1 << 16];
+    unsigned long long offset = e->offset, end = e->offset + e->len;
+    ssize_t ret;
+
+    for (; offset < end; offset += ret) {
+      ret = pread(fd, buf,
+                  std::min(end - offset, (unsigned long long)sizeof(buf)),
+                  offset);
+      if (ret < 0)
+        diep((char*)"pread");
+      if (ret == 0)
+        break;
+      digests[e->flow].update(buf, ret);
+    }
+  }
+
+  /**
+   * wait sleeps until the producer pushes something or closes the writer
+   *
+   * @return false if the writer is closed and the queue is drained
+   */
+  bool wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    sleeping.store(true, std::memory_order_seq_cst);
+    while (head.load(std::memory_order_seq_cst) ==
+               tail.load(std::memory_order_relaxed) &&
+           !closed)
+      wakeup.wait(lock);
+    sleeping.store(false, std::memory_order_relaxed);
+    return head.load(std::memory_order_acquire) !=
+           tail.load(std::memory_order_relaxed);
+  }
+
+  int fd;
+  entry queue[WRITER_QUEUE];
+  std::atomic<unsigned long> head, tail;
+  std::atomic<unsigned long> done[MAX_FLOWS];
+  // only touched by the writer thread while a flow has pushes outstanding
+  crc32c_stream digests[MAX_FLOWS];
+  // appends the CRC32C of a full packet
+  const crc32c_span full;
+  std::atomic<bool> sleeping;
+  bool closed;
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  std::thread thread;
+  unsigned long max_depth, total_depth, pushes;
+};
+
+#endif  // MP2_FILE_WRITER_HPP
@@ -0,0 +1,192 @@
+#ifndef MP2_GF256_HPP
+#define MP2_GF256_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GF256_X86 1
+#endif
+
+// Primitive polynomial of the field, x^8 + x^4 + x^3 + x^2 + 1
+#define GF256_POLY 0x11d
+
+/**
+ * Arithmetic in GF(2^8), the field Reed-Solomon codes work in. Addition is
+ * XOR, multiplication goes through log and exp tables.
+ *
+ * gf256_muladd() is the kernel everything else is built on: it adds c times
+ * a whole payload to another one. A product by a constant splits into the
+ * products of the low and the high nibble of each byte, so two 16-entry
+ * tables and a byte shuffle multiply 16 or 32 bytes per instruction. The
+ * SSSE3 and AVX2 versions are picked at run time, the build targets plain
+ * x86-64.
+ */
+struct gf256_tables {
+  uint8_t exp[512];
+  uint8_t log[256];
+
+  gf256_tables() {
+    unsigned int x = 1;
+
+    // exp is doubled so that exp[log a + log b] needs no modulo
+    for (int i = 0; i < 255; i++) {
+      exp[i] = exp[i + 255] = x;
+      log[x] = i;
+      x <<= 1;
+      if (x & 0x100)
+        x ^= GF256_POLY;
+    }
+    exp[510] = exp[511] = exp[0];
+    log[0] = 0;
+  }
+};
+
+static inline const gf256_tables& gf256() {
+  static const gf256_tables tables;
+  return tables;
+}
+
+static inline uint8_t gf256_mul(uint8_t a, uint8_t b) {
+  if (a == 0 || b == 0)
+    return 0;
+  return gf256().exp[gf256().log[a] + gf256().log[b]];
+}
+
+/**
+ * gf256_inv returns the multiplicative inverse of a, which must not be 0
+ */
+static inline uint8_t gf256_inv(uint8_t a) {
+  return gf256().exp[255 - gf256().log[a]];
+}
+
+/**
+ * gf256_nibbles fills the products of c by every low nibble and by every
+ * high nibble
+ */
+static inline void gf256_nibbles(uint8_t c, uint8_t* lo, uint8_t* hi) {
+  for (int x = 0; x < 16; x++) {
+    lo[x] = gf256_mul(c, x);
+    hi[x] = gf256_mul(c, x << 4);
+  }
+}
+
+static void gf256_muladd_scalar(uint8_t* dst, const uint8_t* src, uint8_t c,
+                                size_t n) {
+  uint8_t lo[16], hi[16];
+
+  gf256_nibbles(c, lo, hi);
+  for (size_t i = 0; i < n; i++)
+    dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+}
+
+#ifdef GF256_X86
+__attribute__((target("ssse3"))) static void gf256_muladd_ssse3(
+    uint8_t* dst, const uint8_t* src, uint8_t c, size_t n) {
+  uint8_t lo[16], hi[16];
+  size_t i;
+
+  gf256_nibbles(c, lo, hi);
+  __m128i tlo = _mm_loadu_si128((const __m128i*)lo);
+  __m128i thi = _mm_loadu_si128((const __m128i*)hi);
+  __m128i mask = _mm_set1_epi8(0x0f);
+  for (i = 0; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i l = _mm_shuffle_epi8(tlo, _mm_and_si128(v, mask));
+    __m128i h = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(v, 4),
+                                                    mask));
+    __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+    _mm_storeu_si128((__m128i*)(dst + i),
+                     _mm_xor_si128(d, _mm_xor_si128(l, h)));
+  }
+  gf256_muladd_scalar(dst + i, src + i, c, n - i);
+}
+
+__attribute__((target("avx2"))) static void gf256_muladd_avx2(
+    uint8_t* dst, const uint8_t* src, uint8_t c, size_t n) {
+  uint8_t lo[16], hi[16];
+  size_t i;
+
+  gf256_nibbles(c, lo, hi);
+  __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)lo));
+  __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)hi));
+  __m256i mask = _mm256_set1_epi8(0x0f);
+  for (i = 0; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i l = _mm256_shuffle_epi8(tlo, _mm256_and_si256(v, mask));
+    __m256i h = _mm256_shuffle_epi8(
+        thi, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask));
+    __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+    _mm256_storeu_si256((__m256i*)(dst + i),
+                        _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+  }
+  gf256_muladd_scalar(dst + i, src + i, c, n - i);
+}
+#endif
+
+typedef void (*gf256_kernel)(uint8_t*, const uint8_t*, uint8_t, size_t);
+
+/**
+ * gf256_best_kernel picks the widest multiply the CPU has
+ */
+static inline gf256_kernel gf256_best_kernel() {
+#ifdef GF256_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return gf256_muladd_avx2;
+  if (__builtin_cpu_supports("ssse3"))
+    return gf256_muladd_ssse3;
+#endif
+  return gf256_muladd_scalar;
+}
+
+/**
+ * gf256_xor adds src to dst, n bytes
+ */
+static inline void gf256_xor(uint8_t* dst, const uint8_t* src, size_t n) {
+  uint64_t a, b;
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    memcpy(&a, dst + i, 8);
+    memcpy(&b, src + i, 8);
+    a ^= b;
+    memcpy(dst + i, &a, 8);
+  }
+  for (; i < n; i++)
+    dst[i] ^= src[i];
+}
+
+/**
+ * gf256_muladd adds c times src to dst, n bytes
+ */
+static inline void gf256_muladd(uint8_t* dst, const uint8_t* src, uint8_t c,
+                                size_t n) {
+  static const gf256_kernel kernel = gf256_best_kernel();
+
+  if (c == 0)
+    return;
+  if (c == 1)
+    gf256_xor(dst, src, n);
+  else
+    kernel(dst, src, c, n);
+}
+
+/**
+ * gf256_kernel_name tells which multiply gf256_muladd() uses
+ */
+static inline const char* gf256_kernel_name() {
+  gf256_kernel kernel = gf256_best_kernel();
+
+#ifdef GF256_X86
+  if (kernel == gf256_muladd_avx2)
+    return "avx2";
+  if (kernel == gf256_muladd_ssse3)
+    return "ssse3";
+#endif
+  return kernel == gf256_muladd_scalar ? "scalar" : "?";
+}
+
+#endif  // MP2_GF256_HPP
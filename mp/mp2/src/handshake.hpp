@@ -0,0 +1,90 @@
+#ifndef MP2_HANDSHAKE_HPP
+#define MP2_HANDSHAKE_HPP
+
+#include <stdint.h>
+
+#include "shared.hpp"
+#include "wire.hpp"
+
+// Encoded size of a handshake, the payload of a SYN and of its answer
+#define HANDSHAKE_SIZE 20
+// Rounds of probes, and SYNs, sent before the receiver is taken not to be
+// there
+#define HANDSHAKE_TRIES 5
+// How long each round waits for an answer, the initial RTO of RFC 6298
+#define HANDSHAKE_TIMEOUT_USEC 1000000
+// Features a transfer may use, what the sender asks for and the receiver
+// grants: resume from what the receiver kept (see resume_log.hpp), parity
+// (see fec.hpp), and a directory tree sent as one stream (see batch.hpp)
+#define HANDSHAKE_RESUME 1
+#define HANDSHAKE_FEC 2
+#define HANDSHAKE_BATCH 4
+// Payload that fills an IP MTU, less the IPv4, UDP and wire headers
+#define MTU_PAYLOAD(mtu) ((mtu) - 20 - 8 - WIRE_HEADER_SIZE)
+// Payload sizes the path is probed with, largest first: Ethernet, common
+// tunnels, the IPv6 minimum and the IPv4 minimum
+#define PROBE_SIZES 4
+const unsigned int probe_sizes[PROBE_SIZES] = {
+    MTU_PAYLOAD(1500), MTU_PAYLOAD(1400), MTU_PAYLOAD(1280), MTU_PAYLOAD(576)};
+
+/**
+ * Opening a transfer
+ *
+ * The sender first probes the path: one PACKET_TYPE_PROBE of each size in
+ * probe_sizes, zero padded, the receiver answers every one that arrives
+ * with its size, and the largest that made it is the payload the sender
+ * offers. Probes carry nothing else and the receiver keeps no state for
+ * them.
+ *
+ * Then a PACKET_TYPE_SYN carries the handshake below and its answer the
+ * values the receiver settled on, which both ends use for the whole
+ * transfer. SYNs are answered until the session is forgotten, a lost
+ * answer is made up for by sending the SYN again. Both are sent on the
+ * connection ID of the transfer and flow 0.
+ *
+ *  offset  size  field
+ *  0       2     payload of every data packet but the last one of the
+ *                file, at most the one offered
+ *  2       2     flows the file is split into
+ *  4       4     initial window in packets, at most what the receiver
+ *                can hold for a flow
+ *  8       8     size of the file in bytes
+ *  16      4     HANDSHAKE_* features, those the receiver grants
+ */
+struct handshake {
+  unsigned int payload, flows;
+  uint32_t window;
+  unsigned long long bytes;
+  uint32_t features;
+};
+
+static inline void encode_handshake(const handshake& h, uint8_t* buf) {
+  put_le16(buf, h.payload);
+  put_le16(buf + 2, h.flows);
+  put_le32(buf + 4, h.window);
+  put_le64(buf + 8, h.bytes);
+  put_le32(buf + 16, h.features);
+}
+
+/**
+ * decode_handshake parses the handshake carried by a SYN or its answer
+ *
+ * @return false if it is truncated, or its payload or number of flows is
+ *         out of range
+ */
+static inline bool decode_handshake(const packet* p, handshake* h) {
+  const uint8_t* buf = (const uint8_t*)p->data;
+
+  if (p->data_sz < HANDSHAKE_SIZE)
+    return false;
+  h->payload = get_le16(buf);
+  h->flows = get_le16(buf + 2);
+  h->window = get_le32(buf + 4);
+  h->bytes = get_le64(buf + 8);
+  h->features = get_le32(buf + 16);
+  return h->payload >= probe_sizes[PROBE_SIZES - 1] &&
+         h->payload <= MAX_PACKET_SIZE && h->flows >= 1 &&
+         h->flows <= MAX_FLOWS && h->window >= 1;
+}
+
+#endif  // MP2_HANDSHAKE_HPP
@@ -0,0 +1,103 @@
+#ifndef MP2_PACER_HPP
+#define MP2_PACER_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+
+// How long a burst may last at the current rate, in microseconds. Longer
+// bursts fill shallow buffers, shorter ones cost a wakeup per packet
+#define PACE_BURST_USEC 250
+// Smallest burst, in packets
+#define PACE_MIN_BURST 2
+
+/**
+ * token_bucket releases packets at a given rate
+ *
+ * Tokens accumulate at rate per second, fractions included, up to a burst
+ * of PACE_BURST_USEC worth of packets. Sending a packet takes a token.
+ * When the bucket is empty, next_token() tells exactly when the next one
+ * will be there, so that the caller can sleep until then.
+ */
+class token_bucket {
+ public:
+  token_bucket()
+      : rate(0), burst(PACE_MIN_BURST), tokens(PACE_MIN_BURST), last(0),
+        sent(0), waits(0), first(0) {}
+
+  /**
+   * set_rate changes the rate, tokens earned so far are kept
+   *
+   * @param packets_per_sec the new rate, 0 to stop pacing
+   * @param now monotonic time in microseconds
+   */
+  void set_rate(double packets_per_sec, uint64_t now) {
+    refill(now);
+    rate = packets_per_sec;
+    burst = std::max(rate * PACE_BURST_USEC / 1e6, (double)PACE_MIN_BURST);
+    tokens = std::min(tokens, burst);
+  }
+
+  /**
+   * take takes the token for one packet
+   *
+   * @param now monotonic time in microseconds
+   * @return false if the packet has to wait for next_token()
+   */
+  bool take(uint64_t now) {
+    if (first == 0)
+      first = now;
+    if (rate == 0) {
+      sent++;
+      return true;
+    }
+    refill(now);
+    if (tokens < 1) {
+      waits++;
+      return false;
+    }
+    tokens--;
+    sent++;
+    return true;
+  }
+
+  /**
+   * charge takes the tokens of packets that go out whether or not there
+   * are any, the bucket may go into debt
+   */
+  void charge(unsigned int packets) {
+    tokens -= rate > 0 ? packets : 0;
+    sent += packets;
+  }
+
+  /**
+   * next_token is when the bucket holds a whole token again, in monotonic
+   * microseconds
+   */
+  uint64_t next_token() {
+    if (rate == 0 || tokens >= 1)
+      return last;
+    return last + (uint64_t)((1 - tokens) * 1e6 / rate) + 1;
+  }
+
+  void print_stats(uint64_t now) {
+    fprintf(stderr, "pacing: %lu packets, avg %.0f pkt/s, last rate %.0f "
+            "pkt/s, %lu waits\n",
+            sent, now > first ? sent * 1e6 / (now - first) : 0, rate, waits);
+  }
+
+ private:
+  void refill(uint64_t now) {
+    if (now > last)
+      tokens = std::min(burst, tokens + (now - last) * rate / 1e6);
+    last = std::max(last, now);
+  }
+
+  double rate, burst, tokens;
+  uint64_t last;
+  unsigned long sent, waits;
+  uint64_t first;
+};
+
+#endif  // MP2_PACER_HPP
@@ -0,0 +1,168 @@
+#ifndef PROXY_HPP
+#define PROXY_HPP
+
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+
+#include <map>
+#include <queue>
+#include <random>
+#include <vector>
+
+#include "rtt.hpp"
+#include "shared.hpp"
+
+// Largest datagram the proxy relays
+#define PROXY_DATAGRAM 65536
+// Extra delay of a reordered datagram unless -O is given, in microseconds
+#define PROXY_REORDER_USEC 10000
+// Queue of the bottleneck unless -q is given, in bytes
+#define PROXY_QUEUE_BYTES 100000
+
+// Datagrams from the sender towards the receiver, and the ACKs back
+#define TO_RECEIVER 0
+#define TO_SENDER 1
+
+/**
+ * impairment is what happens to the datagrams of one direction
+ */
+struct impairment {
+  // Bernoulli loss probability
+  double loss = 0;
+  // Gilbert-Elliott loss: chance to go from the good to the bad state and
+  // back per datagram, and the loss probability in each state. Off while
+  // ge_p is 0
+  double ge_p = 0, ge_r = 0, ge_good = 0, ge_bad = 1;
+  // one way delay and the jitter around it, in microseconds
+  uint64_t delay = 0, jitter = 0;
+  // chance that a datagram is held back by reorder_delay, so that the ones
+  // behind it overtake it
+  double reorder = 0;
+  uint64_t reorder_delay = PROXY_REORDER_USEC;
+  // chance that a datagram is delivered twice
+  double duplicate = 0;
+  // chance that a bit of a datagram is flipped on the way
+  double corrupt = 0;
+  // bottleneck rate in bytes per second (0 for none) and its drop-tail
+  // queue in bytes
+  double rate = 0;
+  unsigned long queue = PROXY_QUEUE_BYTES;
+};
+
+/**
+ * link_state is the state of one direction
+ */
+struct link_state {
+  // Gilbert-Elliott state
+  bool bad = false;
+  // when the bottleneck is done with everything queued so far
+  uint64_t busy_until = 0;
+  unsigned long received = 0, lost = 0, overflowed = 0, duplicated = 0,
+                reordered = 0, corrupted = 0, delivered = 0;
+};
+
+/**
+ * client is a sender socket seen by the proxy, it gets its own socket
+ * towards the receiver so that every reply finds its way back
+ */
+struct client {
+  struct sockaddr_in addr;
+  int upstream;
+};
+
+/**
+ * pending is a datagram waiting for its delivery time
+ */
+struct pending {
+  uint64_t when;
+  // arrival order, keeps datagrams due at the same time in order
+  unsigned long order;
+  int fd;
+  struct sockaddr_in to;
+  std::vector<char> data;
+};
+
+/**
+ * PendingComparator puts the earliest delivery on top of a priority queue
+ */
+struct PendingComparator {
+  bool operator()(const pending* a, const pending* b) const {
+    if (a->when != b->when)
+      return a->when > b->when;
+    return a->order > b->order;
+  }
+};
+
+// Socket the senders talk to, and where the receiver is
+int s;
+struct sockaddr_in si_me, si_receiver;
+
+// Impairments of each direction, and their state
+impairment impair[2];
+link_state links[2];
+
+// Senders by address, and the same ones by upstream socket
+std::map<uint64_t, client*> clients;
+std::map<int, client*> upstreams;
+
+std::priority_queue<pending*, std::vector<pending*>, PendingComparator>
+    schedule;
+unsigned long arrivals = 0;
+
+std::mt19937_64 rng;
+volatile sig_atomic_t stopping = 0;
+
+/**
+ * setup_socket binds the socket the senders talk to and resolves the
+ * receiver
+ */
+void setup_socket(unsigned short int port, const char* host,
+                  unsigned short int receiver_port);
+
+/**
+ * find_client returns the client that sends from addr, and opens its
+ * upstream socket the first time
+ */
+client* find_client(const struct sockaddr_in* addr);
+
+/**
+ * chance draws true with probability p
+ */
+bool chance(double p);
+
+/**
+ * lose decides whether the next datagram of a direction is lost, and moves
+ * the Gilbert-Elliott chain
+ */
+bool lose(int dir);
+
+/**
+ * relay applies the impairments of a direction to one datagram and
+ * schedules what survives
+ *
+ * @param dir TO_RECEIVER or TO_SENDER
+ * @param fd the socket to deliver from
+ * @param to where to deliver
+ * @param data the datagram
+ * @param len its size
+ * @param now monotonic time in microseconds
+ */
+void relay(int dir, int fd, const struct sockaddr_in* to, const char* data,
+           size_t len, uint64_t now);
+
+/**
+ * deliver sends every datagram that is due
+ *
+ * @return when the next one is due, 0 if none is left
+ */
+uint64_t deliver(uint64_t now);
+
+/**
+ * run relays datagrams until SIGINT or SIGTERM
+ */
+void run();
+
+void print_stats();
+
+#endif
@@ -0,0 +1,342 @@
+/*
+ * File:   proxy_main.cpp
+ *
+ * A UDP proxy that emulates a lossy link between reliable_sender and
+ * reliable_receiver, for benchmarking on one machine.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "proxy.hpp"
+
+void setup_socket(unsigned short int port, const char* host,
+                  unsigned short int receiver_port) {
+  struct addrinfo hints, *res;
+
+  if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+    diep((char*)"socket");
+
+  memset((char*)&si_me, 0, sizeof(si_me));
+  si_me.sin_family = AF_INET;
+  si_me.sin_port = htons(port);
+  si_me.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(s, (struct sockaddr*)&si_me, sizeof(si_me)) == -1)
+    diep((char*)"bind");
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+    fprintf(stderr, "cannot resolve %s\n", host);
+    exit(1);
+  }
+  memcpy(&si_receiver, res->ai_addr, sizeof(si_receiver));
+  si_receiver.sin_port = htons(receiver_port);
+  freeaddrinfo(res);
+}
+
+client* find_client(const struct sockaddr_in* addr) {
+  uint64_t key = (uint64_t)addr->sin_addr.s_addr << 16 | addr->sin_port;
+  std::map<uint64_t, client*>::iterator it = clients.find(key);
+  struct sockaddr_in any;
+
+  if (it != clients.end())
+    return it->second;
+
+  client* c = new client;
+  memcpy(&c->addr, addr, sizeof(c->addr));
+  if ((c->upstream = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+    diep((char*)"socket");
+  memset(&any, 0, sizeof(any));
+  any.sin_family = AF_INET;
+  if (bind(c->upstream, (struct sockaddr*)&any, sizeof(any)) == -1)
+    diep((char*)"bind");
+
+  clients[key] = c;
+  upstreams[c->upstream] = c;
+  return c;
+}
+
+bool chance(double p) {
+  return p > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < p;
+}
+
+bool lose(int dir) {
+  impairment* im = &impair[dir];
+  link_state* l = &links[dir];
+
+  if (im->ge_p == 0)
+    return chance(im->loss);
+
+  // move the chain first, then lose with the probability of the new state
+  if (l->bad ? chance(im->ge_r) : chance(im->ge_p))
+    l->bad = !l->bad;
+  return chance(l->bad ? im->ge_bad : im->ge_good);
+}
+
+void relay(int dir, int fd, const struct sockaddr_in* to, const char* data,
+           size_t len, uint64_t now) {
+  impairment* im = &impair[dir];
+  link_state* l = &links[dir];
+  uint64_t when;
+  int64_t jitter;
+  int copies = 1;
+
+  l->received++;
+  if (lose(dir)) {
+    l->lost++;
+    return;
+  }
+  if (chance(im->duplicate)) {
+    l->duplicated++;
+    copies++;
+  }
+
+  for (; copies > 0; copies--) {
+    when = now;
+
+    // the bottleneck serializes datagrams, and drops what does not fit in
+    // its queue
+    if (im->rate > 0) {
+      uint64_t start = std::max(now, l->busy_until);
+      if ((start - now) * im->rate / 1e6 + len > im->queue) {
+        l->overflowed++;
+        continue;
+      }
+      l->busy_until = start + (uint64_t)(len * 1e6 / im->rate);
+      when = l->busy_until;
+    }
+
+    when += im->delay;
+    if (im->jitter > 0) {
+      jitter = std::uniform_int_distribution<int64_t>(
+          -(int64_t)im->jitter, im->jitter)(rng);
+      when = jitter < 0 && (uint64_t)-jitter > when - now ? now
+                                                          : when + jitter;
+    }
+    if (chance(im->reorder)) {
+      l->reordered++;
+      when += im->reorder_delay;
+    }
+
+    pending* p = new pending;
+    p->when = when;
+    p->order = arrivals++;
+    p->fd = fd;
+    memcpy(&p->to, to, sizeof(p->to));
+    p->data.assign(data, data + len);
+    if (len > 0 && chance(im->corrupt)) {
+      l->corrupted++;
+      size_t bit = std::uniform_int_distribution<size_t>(0, len * 8 - 1)(rng);
+      p->data[bit / 8] ^= 1 << (bit % 8);
+    }
+    schedule.push(p);
+  }
+}
+
+uint64_t deliver(uint64_t now) {
+  pending* p;
+
+  while (!schedule.empty()) {
+    p = schedule.top();
+    if (p->when > now)
+      return p->when;
+    schedule.pop();
+    if (sendto(p->fd, p->data.data(), p->data.size(), 0,
+               (struct sockaddr*)&p->to, sizeof(p->to)) >= 0)
+      links[p->fd == s ? TO_SENDER : TO_RECEIVER].delivered++;
+    delete p;
+  }
+  return 0;
+}
+
+static void stop(int sig) {
+  (void)sig;
+  stopping = 1;
+}
+
+void run() {
+  static char buf[PROXY_DATAGRAM];
+  std::vector<struct pollfd> fds;
+  std::map<int, client*>::iterator it;
+  struct sockaddr_in from;
+  struct timespec timeout;
+  socklen_t fromlen;
+  ssize_t bytes;
+  uint64_t now, next;
+  size_t i;
+  client* c;
+
+  while (!stopping) {
+    now = monotonic_usec();
+    next = deliver(now);
+
+    fds.clear();
+    fds.push_back({s, POLLIN, 0});
+    for (it = upstreams.begin(); it != upstreams.end(); ++it)
+      fds.push_back({it->first, POLLIN, 0});
+
+    // sleep until a datagram arrives or the next one is due
+    if (next > 0) {
+      next -= now;
+      timeout.tv_sec = next / 1000000;
+      timeout.tv_nsec = next % 1000000 * 1000;
+    }
+    if (ppoll(fds.data(), fds.size(), next > 0 ? &timeout : NULL, NULL) < 0) {
+      if (errno == EINTR)
+        continue;
+      diep((char*)"ppoll");
+    }
+
+    now = monotonic_usec();
+    for (i = 0; i < fds.size(); i++) {
+      if (!(fds[i].revents & POLLIN))
+        continue;
+      // drain the socket, every datagram gets the arrival time of the batch
+      while (true) {
+        fromlen = sizeof(from);
+        bytes = recvfrom(fds[i].fd, buf, sizeof(buf), MSG_DONTWAIT,
+                         (struct sockaddr*)&from, &fromlen);
+        if (bytes < 0)
+          break;
+        if (fds[i].fd == s) {
+          c = find_client(&from);
+          relay(TO_RECEIVER, c->upstream, &si_receiver, buf, bytes, now);
+        } else {
+          c = upstreams[fds[i].fd];
+          relay(TO_SENDER, s, &c->addr, buf, bytes, now);
+        }
+      }
+    }
+  }
+}
+
+void print_stats() {
+  const char* names[2] = {"to receiver", "to sender"};
+
+  for (int dir = 0; dir < 2; dir++) {
+    link_state* l = &links[dir];
+    fprintf(stderr,
+            "%s: %lu received, %lu lost, %lu overflowed, %lu duplicated, "
+            "%lu reordered, %lu corrupted, %lu delivered\n",
+            names[dir], l->received, l->lost, l->overflowed, l->duplicated,
+            l->reordered, l->corrupted, l->delivered);
+  }
+}
+
+/**
+ * parse_gilbert reads p,r[,bad[,good]] into an impairment
+ *
+ * @return false if fewer than two numbers are given
+ */
+static bool parse_gilbert(const char* arg, impairment* im) {
+  int n = sscanf(arg, "%lf,%lf,%lf,%lf", &im->ge_p, &im->ge_r, &im->ge_bad,
+                 &im->ge_good);
+  return n >= 2 && im->ge_p > 0;
+}
+
+int main(int argc, char** argv) {
+  unsigned long seed = 1;
+  bool both = true;
+  impairment im;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "l:g:d:j:o:O:u:x:b:q:s:1")) != -1) {
+    switch (opt) {
+      case 'l':
+        im.loss = atof(optarg);
+        break;
+      case 'g':
+        if (!parse_gilbert(optarg, &im))
+          argc = 0;
+        break;
+      case 'd':
+        im.delay = atof(optarg) * 1000;
+        break;
+      case 'j':
+        im.jitter = atof(optarg) * 1000;
+        break;
+      case 'o':
+        im.reorder = atof(optarg);
+        break;
+      case 'O':
+        im.reorder_delay = atof(optarg) * 1000;
+        break;
+      case 'u':
+        im.duplicate = atof(optarg);
+        break;
+      case 'x':
+        im.corrupt = atof(optarg);
+        break;
+      case 'b':
+        im.rate = atof(optarg) * 1e6 / 8;
+        break;
+      case 'q':
+        im.queue = atol(optarg);
+        break;
+      case 's':
+        seed = strtoul(optarg, NULL, 10);
+        break;
+      case '1':
+        both = false;
+        break;
+      default:
+        argc = 0;
+    }
+  }
+
+  if (argc - optind != 3) {
+    fprintf(stderr,
+            "usage: %s [options] listen_port receiver_host receiver_port\n\n"
+            "  -l p        lose datagrams with probability p\n"
+            "  -g p,r[,bad[,good]]\n"
+            "              Gilbert-Elliott loss instead: p and r are the "
+            "chances to\n"
+            "              enter and leave the bad state, bad and good the "
+            "loss\n"
+            "              probability in each (default 1 and 0)\n"
+            "  -d ms       one way delay\n"
+            "  -j ms       jitter, uniform around the delay\n"
+            "  -o p        hold datagrams back with probability p so that "
+            "others\n"
+            "              overtake them\n"
+            "  -O ms       how long they are held back (default %d)\n"
+            "  -u p        duplicate datagrams with probability p\n"
+            "  -x p        flip a bit of datagrams with probability p\n"
+            "  -b mbps     bottleneck rate\n"
+            "  -q bytes    drop-tail queue of the bottleneck (default %d)\n"
+            "  -s seed     seed of the random generator (default 1)\n"
+            "  -1          impair only the direction to the receiver, not the "
+            "ACKs\n\n",
+            argv[0], PROXY_REORDER_USEC / 1000, PROXY_QUEUE_BYTES);
+    exit(1);
+  }
+  argv += optind;
+
+  impair[TO_RECEIVER] = im;
+  if (both)
+    impair[TO_SENDER] = im;
+  rng.seed(seed);
+
+  setup_socket((unsigned short int)atoi(argv[0]), argv[1],
+               (unsigned short int)atoi(argv[2]));
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  run();
+  print_stats();
+  return 0;
+}
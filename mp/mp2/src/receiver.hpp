@@ -0,0 +1,414 @@
+#ifndef RECEIVER_HPP
+#define RECEIVER_HPP
+
+#include <netinet/in.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "ack_policy.hpp"
+#include "batch.hpp"
+#include "direct_file.hpp"
+#include "fec.hpp"
+#include "file_writer.hpp"
+#include "handshake.hpp"
+#include "reorder_buffer.hpp"
+#include "resume_log.hpp"
+#include "rtt.hpp"
+#include "wire.hpp"
+
+// Requested size of the socket receive buffer, capped by net.core.rmem_max
+#define RECV_SOCKET_BUFFER (4 << 20)
+// A flow whose receive window opened by this fraction of its reorder buffer
+// since it was last advertised gets a window update, its sender may be
+// waiting for it. Checked this often while the window is less than that
+// open
+#define WINDOW_UPDATE_FRACTION 2
+#define WINDOW_UPDATE_USEC 1000
+// Most worker threads of the daemon
+#define MAX_WORKERS 64
+// A session nothing was heard from for this long is given up, with -R its
+// progress stays on disk for the sender to resume
+#define SESSION_IDLE_USEC 60000000
+// A finished session is remembered this long, so that late FINs are still
+// answered and late data does not start the file over
+#define SESSION_LINGER_USEC 10000000
+// Longest a daemon worker sleeps while it has sessions, so that idle ones
+// are noticed
+#define SESSION_POLL_USEC 1000000
+
+// Steering by a BPF program, older headers do not know about it yet
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+// Receive straight into a mapping of the file, -z
+bool use_mmap = false;
+// Take coalesced datagrams from the kernel (UDP GRO) when it can
+bool use_offload = true;
+// Hold back the ACKs of in-order data, -a acknowledges every packet
+bool delay_acks = true;
+// Keep track of which packets are on disk so that an interrupted transfer
+// can be resumed, -R
+bool keep_progress = false;
+// With -d, serve transfers into this directory until killed, each session
+// in a file named after its connection ID. Otherwise receive one transfer
+// into destination and exit
+const char* output_dir = NULL;
+const char* destination = NULL;
+// Worker threads of the daemon, each with its own SO_REUSEPORT socket
+unsigned int workers = 1;
+// Set when the one transfer does not hash to what the sender has, the
+// exit status tells
+bool damaged = false;
+
+struct session;
+
+/**
+ * flow_state is what the receiver keeps for each flow of a transfer
+ *
+ * A flow is known by the first seqno of its range, and acknowledges its
+ * own packets only: next is its cumulative ACK and highest is one past the
+ * highest seqno it received.
+ */
+struct flow_state {
+  unsigned long id, next, highest;
+  // the transfer the flow is part of
+  session* sess;
+  // held out of order in buffered mode, NULL in direct mode
+  reorder_buffer* window;
+  struct sockaddr_in peer;
+  socklen_t peer_len;
+  bool finished;
+  // when the flow is acknowledged, see ack_policy.hpp
+  ack_policy policy;
+  // one past the highest seqno the last ACK let the sender send
+  unsigned long advertised;
+  // rebuilds losses from parity, NULL until the first parity packet
+  fec_decoder* fec;
+  // in buffered mode, one past the last seqno pushed to the writer and
+  // one past the last seqno recorded in progress
+  unsigned long pushed, saved;
+  // the sender was told that every packet progress has below this is
+  // kept, and does not send them
+  unsigned long kept_until;
+  // the CRC32C of the flow, in direct mode of the packets below hashed as
+  // they come in order, in buffered mode taken from the writer at the FIN
+  crc32c_stream digest;
+  unsigned long hashed;
+};
+
+/**
+ * session is one transfer, every flow of one sender, known by the
+ * connection ID the sender picked and written to its own file
+ *
+ * Sessions belong to the worker whose socket their datagrams are steered
+ * to, nothing in them is shared between threads.
+ */
+struct session {
+  uint32_t id;
+  char path[4096];
+  // where a batch is unpacked once its stream is in path, see batch.hpp
+  char tree[4096];
+  // what the SYN of the sender settled, payload is 0 if the destination
+  // could not be opened and the SYN is not answered
+  handshake agreed;
+  // the destination, mapped in direct mode, written by its own thread in
+  // buffered mode
+  int outfile;
+  direct_file* file;
+  file_writer* writer;
+  // which packets are on disk with -R, NULL otherwise, and how many were
+  // received since it was last saved and when that was
+  resume_log* progress;
+  unsigned long unsaved;
+  uint64_t saved_at;
+  flow_state flows[MAX_FLOWS];
+  unsigned int nflows;
+  // flows announced by the first FIN, how many of them are done and how
+  // many do not hash to what their sender has
+  unsigned int expected_flows, finished_flows, damaged_flows;
+  // flows with a delayed ACK pending
+  unsigned int delayed;
+  // when the last datagram arrived, and when every flow was done, 0 while
+  // the transfer is running
+  uint64_t heard_at, closed_at;
+};
+
+// Every worker runs on its own thread with its own socket and its own copy
+// of everything below
+
+thread_local int s;
+// The sessions of this worker, by connection ID
+thread_local std::unordered_map<uint32_t, session*> sessions;
+// Sessions whose every flow sent its FIN, closed once their ACKs are out
+thread_local std::vector<session*> finished;
+// Set once the one transfer is received, never with -d
+thread_local bool stop = false;
+// SACK blocks of the ACKs queued in a batch, one slot per ACK
+thread_local uint8_t
+    sack_buf[WIRE_BATCH][ACK_WINDOW_SIZE + SACK_MAX_BLOCKS * SACK_BLOCK_SIZE];
+
+/**
+ * find_session returns the session of a connection ID
+ *
+ * @return NULL if no SYN opened it
+ */
+session* find_session(uint32_t id);
+
+/**
+ * open_session creates the destination of a new session, preallocated to
+ * the size the sender announced, and loads its progress with -R. What the
+ * sender offered is lowered to what the receiver can do
+ *
+ * @param offer the handshake of the SYN
+ * @return the session, already closed if its destination can not be
+ *         created so that its datagrams are ignored
+ */
+session* open_session(uint32_t id, const handshake& offer);
+
+/**
+ * flow_packets is the most packets a flow of the session has, the sender
+ * splits the file evenly
+ */
+unsigned long flow_packets(session* sess);
+
+/**
+ * answer_handshake answers the probes and SYNs that open a transfer, a
+ * probe with its size and a SYN with what its session settled, opening
+ * the session the first time
+ *
+ * @return false if p is neither, it is then taken as part of a session
+ */
+bool answer_handshake(const packet* p, const struct sockaddr* peer,
+                      socklen_t peer_len);
+
+/**
+ * close_session finishes a session whose every flow sent its FIN: the file
+ * is made durable, its progress removed and each FIN answered once more,
+ * and a batch is unpacked. The session is kept until SESSION_LINGER_USEC
+ * after that
+ */
+void close_session(session* sess);
+
+/**
+ * unpack_batch recreates the tree of a batch from its stream, which is
+ * removed once it is unpacked
+ *
+ * @return false if the stream is damaged or the tree cannot be written,
+ *         the stream is left for a look
+ */
+bool unpack_batch(session* sess);
+
+/**
+ * drop_session gives up a session the sender stopped talking to, the file
+ * and its progress are left for a resume
+ */
+void drop_session(session* sess);
+
+/**
+ * expire_sessions forgets finished sessions once they lingered long
+ * enough and drops idle ones
+ *
+ * @param now monotonic time in microseconds
+ */
+void expire_sessions(uint64_t now);
+
+/**
+ * find_flow returns the state of the flow whose range starts at id, and
+ * creates it the first time id is seen
+ *
+ * @return NULL if MAX_FLOWS flows are already known
+ */
+flow_state* find_flow(session* sess, unsigned long id);
+
+/**
+ * finish_flow records the FIN of a flow, once every flow of the transfer
+ * has sent its own the session is queued to be closed
+ *
+ * The first FIN settles the CRC32C of the flow and checks it against the
+ * sender's.
+ *
+ * @param f the flow the FIN belongs to
+ * @param fin the FIN, its payload holds the number of flows and the
+ *        sender's CRC32C of the flow
+ */
+void finish_flow(flow_state* f, const packet* fin);
+
+/**
+ * hash_direct adds the packets a flow in direct mode received in order
+ * since the last time to its CRC32C
+ */
+void hash_direct(flow_state* f);
+
+/**
+ * file_digest combines the CRC32C of every flow into that of the file
+ */
+crc32c_stream file_digest(session* sess);
+
+/**
+ * answer_closed answers a FIN that arrives after its session was closed,
+ * the answer to the first one was lost
+ */
+void answer_closed(session* sess, const packet* p, const struct sockaddr* peer,
+                   socklen_t peer_len);
+
+/**
+ * repair takes a parity packet, or a data packet of a group that parity is
+ * held for, and rebuilds what it can of the group, the rebuilt packets are
+ * stored like received ones
+ *
+ * @param f the flow of the packet
+ * @param p the packet
+ * @return the number of packets rebuilt
+ */
+unsigned int repair(flow_state* f, const packet* p);
+
+/**
+ * answer_resume lists the packets of a flow that an earlier run kept, in
+ * answer to a PACKET_TYPE_RESUME request, and stops expecting them
+ */
+void answer_resume(flow_state* f, const packet* request);
+
+/**
+ * skip_kept moves a flow in buffered mode past the packets at its base
+ * that an earlier run kept, once the writer is done with the slots below
+ *
+ * @return whether the flow moved
+ */
+bool skip_kept(flow_state* f);
+
+/**
+ * save_progress makes the packets received so far durable, first the data
+ * and then the bits of progress that stand for it, once enough arrived
+ * since the last time or that was long enough ago
+ *
+ * @param force save whatever arrived, however little
+ */
+void save_progress(session* sess, bool force);
+
+/**
+ * reclaim_window lets the reorder buffer of a flow reuse the slots that
+ * the writer is done with, and that no FEC group still needs
+ */
+void reclaim_window(flow_state* f);
+
+/**
+ * window_edge is one past the highest seqno a flow can take: in buffered
+ * mode the end of its reorder buffer, which is only freed as fast as the
+ * writer gets the data to disk, in direct mode the end of its range
+ */
+unsigned long window_edge(flow_state* f);
+
+/**
+ * queue_ack queues the ACK of a flow and clears its delayed ACK, the answer
+ * to a FIN carries the CRC32C of the flow instead of the receive window and
+ * SACK blocks
+ *
+ * @param acks the batch the ACK goes out with
+ * @param f the flow
+ * @param type PACKET_TYPE_ACK, with the RETX and FIN flags to echo
+ * @param recent the seqno that triggered the ACK, its run of packets is
+ *        the first SACK block
+ * @param timestamp the timestamp of the packet that triggered the ACK
+ */
+void queue_ack(wire_send_batch* acks, flow_state* f, unsigned int type,
+               unsigned long recent, uint32_t timestamp);
+
+/**
+ * delay_ack counts a packet towards the ACK of its flow, see
+ * ack_policy::on_packet
+ *
+ * @return true if the ACK can wait, false if it is due now
+ */
+bool delay_ack(flow_state* f, bool in_order, bool retransmit,
+               uint32_t timestamp);
+
+/**
+ * send_delayed_acks queues the delayed ACKs that are due in every session
+ *
+ * @param now monotonic time in microseconds
+ */
+void send_delayed_acks(wire_send_batch* acks, uint64_t now);
+
+/**
+ * window_closed tells whether the window a flow in buffered mode last
+ * advertised is less than open enough for the sender to keep sending
+ * until the next ACK
+ */
+bool window_closed(flow_state* f);
+
+/**
+ * send_window_updates queues a window update for every flow whose writer
+ * freed enough of the reorder buffer since its last ACK, so that a sender
+ * the window stopped starts again without waiting for a timeout
+ */
+void send_window_updates(wire_send_batch* acks);
+
+/**
+ * end_burst sends what is queued and does what waits for it: delayed ACKs
+ * that are due, sessions that are finished or expired and progress
+ */
+void end_burst(wire_send_batch* acks);
+
+/**
+ * wait_datagram waits for a datagram, but only until the first delayed
+ * ACK is due, a closed window needs to be checked, or in a daemon until
+ * sessions need to be checked
+ *
+ * @return true if a datagram is ready, false if something else is due
+ */
+bool wait_datagram();
+
+/**
+ * setup_socket binds a receiving socket
+ *
+ * @param myUDPport the UDP port to listen on
+ * @param shared whether other sockets bind the same port (SO_REUSEPORT)
+ * @return the socket
+ */
+int setup_socket(unsigned short int myUDPport, bool shared);
+
+/**
+ * steer_sessions makes the kernel hand every datagram of a session to the
+ * same socket of a SO_REUSEPORT group, by its connection ID
+ *
+ * @param sock any socket of the group, bound in worker order
+ * @param n the number of sockets in the group
+ * @return false if the kernel can not steer, it then spreads by address
+ */
+bool steer_sessions(int sock, unsigned int n);
+
+/**
+ * receive_buffered receives data packets into the reorder buffer of their
+ * flow and hands the in-order ones to the writer thread of their session
+ */
+void receive_buffered();
+
+/**
+ * receive_direct receives every payload straight to its offset in a memory
+ * mapping of the destination of its session
+ *
+ * Each datagram's header is peeked first to learn where its payload goes,
+ * then the datagram is received with a scatter recvmsg into the mapping.
+ */
+void receive_direct();
+
+/**
+ * serve runs one worker on a bound socket, until the one transfer is
+ * received or, in a daemon, forever
+ */
+void serve(int sock);
+
+/**
+ * reliablyReceive receives a file from the sender and writes it to destinationFile
+ */
+void reliablyReceive(unsigned short int myUDPport, char* destinationFile);
+
+/**
+ * serveForever receives every transfer sent to myUDPport into output_dir,
+ * on as many worker threads as asked for
+ */
+void serveForever(unsigned short int myUDPport);
+
+#endif
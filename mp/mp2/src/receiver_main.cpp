@@ -6,7 +6,10 @@
  */
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,18 +18,14 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <linux/filter.h>
+#include <algorithm>
 #include <fstream>
 #include <functional>
 #include <iostream>
-#include <queue>
+#include <thread>
 
-#include "shared.hpp"
-
-struct sockaddr_in si_me, si_other;
-int s;
-socklen_t slen;
-std::priority_queue<packet*, std::vector<packet*>, PacketComparator>
-    packetQueue;
+#include "receiver.hpp"
 
 void* get_in_addr(struct sockaddr* sa) {
   if (sa->sa_family == AF_INET) {
@@ -36,91 +35,956 @@ void* get_in_addr(struct sockaddr* sa) {
   return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-/**
- * reliablyReceive receives a file from the sender and writes it to destinationFile
- */
-void reliablyReceive(unsigned short int myUDPport, char* destinationFile) {
-  packet *snd_packet, recv_packet, *top, *curr;
-  int numBytes, i;
-  unsigned long nextSeq = 0;
-  FILE* outfile;
-  bool terminate = false;
-
-  slen = sizeof(si_other);
+int setup_socket(unsigned short int myUDPport, bool shared) {
+  struct sockaddr_in si_me;
+  int sock, one = 1;
 
-  if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+  if ((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
     diep((char*)"socket");
+  if (shared &&
+      setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    diep((char*)"SO_REUSEPORT");
 
   memset((char*)&si_me, 0, sizeof(si_me));
   si_me.sin_family = AF_INET;
   si_me.sin_port = htons(myUDPport);
   si_me.sin_addr.s_addr = htonl(INADDR_ANY);
-  if (bind(s, (struct sockaddr*)&si_me, sizeof(si_me)) == -1)
+  if (bind(sock, (struct sockaddr*)&si_me, sizeof(si_me)) == -1)
     diep((char*)"bind");
+
+  // leave room for a full reorder window while the writer has the CPU
+  int rcvbuf = RECV_SOCKET_BUFFER;
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
 #if DEBUG
   printf("Listening on port %d\n", myUDPport);
 #endif
-  /* Now receive data and send acknowledgements */
+  return sock;
+}
 
-  // we skip the handshake because fuck that
+bool steer_sessions(int sock, unsigned int n) {
+  // the program sees the UDP payload, the ID is loaded in network byte
+  // order but any fixed mapping of IDs to sockets does
+  struct sock_filter code[] = {
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, WIRE_SESSION_OFFSET),
+      BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n),
+      BPF_STMT(BPF_RET | BPF_A, 0),
+  };
+  struct sock_fprog prog;
+
+  prog.len = sizeof(code) / sizeof(code[0]);
+  prog.filter = code;
+  return setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                    sizeof(prog)) == 0;
+}
+
+session* find_session(uint32_t id) {
+  std::unordered_map<uint32_t, session*>::iterator it = sessions.find(id);
+
+  if (it != sessions.end())
+    return it->second;
+  return NULL;
+}
+
+session* open_session(uint32_t id, const handshake& offer) {
+  session* sess = new session();
+  unsigned long packets;
+  const char* failed;
+
+  sess->id = id;
+  sess->agreed = offer;
+  sess->agreed.payload = std::min(offer.payload, (unsigned int)MAX_PACKET_SIZE);
+  sess->outfile = -1;
+  sess->heard_at = sess->saved_at = monotonic_usec();
+  if (output_dir)
+    snprintf(sess->path, sizeof(sess->path), "%s/%08x", output_dir, id);
+  else
+    snprintf(sess->path, sizeof(sess->path), "%s", destination);
+  // a batch is received as one stream next to where its tree goes
+  if (offer.features & HANDSHAKE_BATCH) {
+    snprintf(sess->tree, sizeof(sess->tree), "%s", sess->path);
+    errno = ENAMETOOLONG;
+    failed = "batch";
+    if (snprintf(sess->path, sizeof(sess->path), "%s" BATCH_SUFFIX,
+                 sess->tree) >= (int)sizeof(sess->path))
+      goto open_error;
+  }
+
+  // what an earlier run left in the file is only kept if its progress is
+  // known
+  if (keep_progress) {
+    sess->progress =
+        new resume_log(sess->path, offer.bytes, sess->agreed.payload);
+    failed = "resume file";
+    if (!sess->progress->ok())
+      goto open_error;
+    // the seqnos it kept stand for packets of the size of the earlier run
+    sess->agreed.payload = sess->progress->packet_size();
+    if (sess->progress->resumed())
+      fprintf(stderr, "resume: %lu packets kept by an earlier run\n",
+              sess->progress->kept_packets());
+  }
+
+  // a flow never has more packets in flight than it has, in buffered mode
+  // nor more than its reorder buffer holds
+  packets = flow_packets(sess);
+  if (!use_mmap)
+    packets = std::min(packets, (unsigned long)REORDER_SLOTS);
+  sess->agreed.window = std::min((unsigned long)offer.window, packets);
+  sess->agreed.features =
+      offer.features & (HANDSHAKE_FEC | HANDSHAKE_BATCH |
+                        (keep_progress ? HANDSHAKE_RESUME : 0));
 
   //setup file for writing
-  outfile = fopen(destinationFile, "wb");
-  if (outfile == NULL)
-    diep((char*)"fopen");
-
-  snd_packet = new packet();
-  while (!terminate) {
-    numBytes = recvfrom(s, &recv_packet, sizeof(packet), 0,
-                        (struct sockaddr*)&si_other, (socklen_t*)&slen);
-#if DEBUG
-    printf("Receive packet %lu of size (%d)\n", recv_packet.seqno, numBytes);
-#endif
+  sess->outfile = open(sess->path,
+                       O_RDWR | O_CREAT |
+                           (sess->progress && sess->progress->resumed()
+                                ? 0
+                                : O_TRUNC),
+                       0644);
+  failed = "open";
+  if (sess->outfile < 0)
+    goto open_error;
 
+  // with -z receive straight into the file, otherwise buffer, the disk is
+  // written on its own thread so that it never delays an ACK
+  if (use_mmap) {
+    sess->file =
+        new direct_file(sess->outfile, offer.bytes, sess->agreed.payload);
+    failed = "mmap";
+    if (!sess->file->ok())
+      goto open_error;
+  } else {
+    // set the blocks aside now, the file is not fragmented by the flows
+    // writing at their own offsets and a full disk shows up here
+    errno = offer.bytes > 0 ? posix_fallocate(sess->outfile, 0, offer.bytes)
+                            : 0;
+    failed = "posix_fallocate";
+    if (errno != 0 && errno != EOPNOTSUPP)
+      goto open_error;
+    sess->writer = new file_writer(sess->outfile, sess->agreed.payload);
+  }
+  if (output_dir)
+    fprintf(stderr, "session %08x: receiving %llu bytes into %s, %u-byte "
+            "payloads\n", id, offer.bytes, sess->path, sess->agreed.payload);
+  else
+    fprintf(stderr, "handshake: %llu bytes in %u-byte payloads, initial "
+            "window %u\n", offer.bytes, sess->agreed.payload,
+            sess->agreed.window);
+  return sess;
+
+open_error:
+  if (output_dir == NULL)
+    diep((char*)failed);
+  fprintf(stderr, "session %08x: %s %s: %s\n", id, failed, sess->path,
+          strerror(errno));
+  delete sess->file;
+  sess->file = NULL;
+  delete sess->progress;
+  sess->progress = NULL;
+  if (sess->outfile >= 0)
+    close(sess->outfile);
+  sess->outfile = -1;
+  sess->agreed.payload = 0;
+  sess->closed_at = sess->heard_at;
+  return sess;
+}
+
+unsigned long flow_packets(session* sess) {
+  unsigned long long total =
+      (sess->agreed.bytes + sess->agreed.payload - 1) / sess->agreed.payload;
+
+  return std::max(1ULL, (total + sess->agreed.flows - 1) / sess->agreed.flows);
+}
 
-    if (recv_packet.has_type(PACKET_TYPE_DATA)) {
-      curr = new packet();
-      curr->copy(&recv_packet);
-      packetQueue.push(curr);
+bool answer_handshake(const packet* p, const struct sockaddr* peer,
+                      socklen_t peer_len) {
+  uint8_t buf[HANDSHAKE_SIZE];
+  handshake offer;
+  session* sess;
+
+  // a probe is answered with its size and nothing is kept
+  if (p->type == PACKET_TYPE_PROBE) {
+    wire_send(s, PACKET_TYPE_PROBE | PACKET_TYPE_ACK, p->data_sz, NULL, 0,
+              peer, peer_len, p->timestamp, 0, p->session);
+    return true;
+  }
+  if (p->type != PACKET_TYPE_SYN)
+    return false;
+  if (!decode_handshake(p, &offer))
+    return true;
+
+  // without -d the first transfer owns the destination, others are ignored
+  sess = find_session(p->session);
+  if (sess == NULL) {
+    if (output_dir == NULL && !sessions.empty())
+      return true;
+    sess = sessions[p->session] = open_session(p->session, offer);
+  }
+  if (sess->agreed.payload == 0)
+    return true;
+  sess->heard_at = monotonic_usec();
+  encode_handshake(sess->agreed, buf);
+  wire_send(s, PACKET_TYPE_SYN | PACKET_TYPE_ACK, 0, buf, sizeof(buf), peer,
+            peer_len, p->timestamp, 0, sess->id);
+  return true;
+}
+
+void close_session(session* sess) {
+  crc32c_stream digest = file_digest(sess);
+  unsigned int i, f;
+
+  // the writer drains before the file is synced, and the progress goes
+  // once the whole file is durable, never before
+  if (sess->writer) {
+    sess->writer->close();
+    sess->writer->print_stats();
+    delete sess->writer;
+    sess->writer = NULL;
+  }
+  if (sess->progress) {
+    if (sess->file ? !sess->file->sync() : fdatasync(sess->outfile) < 0)
+      diep((char*)"sync");
+    sess->progress->finish();
+    delete sess->progress;
+    sess->progress = NULL;
+  }
+
+  // answer the FIN of every flow once more, in case the first answer was
+  // lost
+  for (f = 0; f < sess->nflows; f++) {
+    flow_state* flow = &sess->flows[f];
+    packet fin_packet(flow->next);
+
+    fin_packet.set_type(PACKET_TYPE_ACK);
+    fin_packet.set_type(PACKET_TYPE_FIN);
+    fin_packet.flow = flow->id;
+    fin_packet.session = sess->id;
+    fin_packet.data_sz = 4;
+    put_le32((uint8_t*)fin_packet.data, flow->digest.crc);
+    for (i = 0; i < 3; i++) {
+      wire_send(s, &fin_packet, (struct sockaddr*)&flow->peer,
+                flow->peer_len);
     }
+  }
 
-    if (recv_packet.has_type(PACKET_TYPE_FIN)) {
-      terminate = true;
+  if (sess->agreed.features & HANDSHAKE_BATCH)
+    unpack_batch(sess);
+  drop_session(sess);
+  sess->closed_at = monotonic_usec();
+  if (output_dir) {
+    fprintf(stderr,
+            "session %08x: %s received, crc32c %08x over %llu bytes%s\n",
+            sess->id, sess->path, digest.crc, digest.bytes,
+            sess->damaged_flows ? ", DAMAGED" : "");
+  } else {
+    fprintf(stderr, "crc32c: %08x over %llu bytes (%s)%s\n", digest.crc,
+            digest.bytes, crc32c_kernel_name(),
+            sess->damaged_flows ? ", DOES NOT MATCH THE SENDER'S" : "");
+    damaged = sess->damaged_flows > 0;
+    stop = true;
+  }
+}
+
+bool unpack_batch(session* sess) {
+  batch_manifest manifest;
+  std::string failed;
+
+  // a damaged stream stays where it is, nothing is unpacked from it
+  if (sess->damaged_flows) {
+    fprintf(stderr, "batch: %s is damaged, not unpacked\n", sess->path);
+    return false;
+  }
+  if (!manifest.decode(sess->outfile, sess->agreed.bytes)) {
+    fprintf(stderr, "batch: %s has no valid manifest\n", sess->path);
+    return false;
+  }
+  if (!manifest.unpack(sess->outfile, sess->tree, &failed)) {
+    fprintf(stderr, "batch: %s: %s\n", failed.c_str(), strerror(errno));
+    return false;
+  }
+  unlink(sess->path);
+  fprintf(stderr, "batch: %lu files and %lu directories unpacked into %s\n",
+          manifest.files, manifest.directories, sess->tree);
+  return true;
+}
+
+void drop_session(session* sess) {
+  unsigned int f;
+
+  if (sess->writer) {
+    sess->writer->close();
+    save_progress(sess, true);
+    delete sess->writer;
+    sess->writer = NULL;
+  } else {
+    save_progress(sess, true);
+  }
+  delete sess->progress;
+  sess->progress = NULL;
+  sess->delayed = 0;
+  for (f = 0; f < sess->nflows; f++) {
+    sess->flows[f].policy.on_ack(0);
+    delete sess->flows[f].window;
+    sess->flows[f].window = NULL;
+    if (sess->flows[f].fec) {
+      sess->flows[f].fec->print_stats();
+      delete sess->flows[f].fec;
+      sess->flows[f].fec = NULL;
     }
-    while (!packetQueue.empty() && packetQueue.top()->seqno <= nextSeq) {
-      top = packetQueue.top();
-      packetQueue.pop();
-      if (top->seqno < nextSeq) {
-        delete top;
+  }
+  delete sess->file;
+  sess->file = NULL;
+  if (sess->outfile >= 0)
+    close(sess->outfile);
+  sess->outfile = -1;
+}
+
+void expire_sessions(uint64_t now) {
+  std::unordered_map<uint32_t, session*>::iterator it;
+  session* sess;
+
+  for (it = sessions.begin(); it != sessions.end();) {
+    sess = it->second;
+    if (sess->closed_at ? now - sess->closed_at < SESSION_LINGER_USEC
+                        : now - sess->heard_at < SESSION_IDLE_USEC) {
+      ++it;
+      continue;
+    }
+    if (sess->closed_at == 0) {
+      fprintf(stderr, "session %08x: nothing heard for %d s, given up\n",
+              sess->id, SESSION_IDLE_USEC / 1000000);
+      drop_session(sess);
+    }
+    delete sess;
+    it = sessions.erase(it);
+  }
+}
+
+flow_state* find_flow(session* sess, unsigned long id) {
+  unsigned int i;
+
+  for (i = 0; i < sess->nflows; i++)
+    if (sess->flows[i].id == id)
+      return &sess->flows[i];
+  if (sess->nflows == MAX_FLOWS)
+    return NULL;
+
+  flow_state* f = &sess->flows[sess->nflows++];
+  f->id = f->next = f->highest = f->saved = f->kept_until = id;
+  f->sess = sess;
+  f->pushed = 0;
+  f->window = sess->file ? NULL : new reorder_buffer(id, flow_packets(sess),
+                                                     sess->agreed.payload);
+  f->peer_len = 0;
+  f->finished = false;
+  f->policy = ack_policy(delay_acks);
+  f->advertised = id;
+  f->fec = NULL;
+  f->digest = crc32c_stream();
+  f->hashed = id;
+  return f;
+}
+
+void finish_flow(flow_state* f, const packet* fin) {
+  session* sess = f->sess;
+
+  if (sess->expected_flows == 0)
+    sess->expected_flows =
+        fin->data_sz >= 2 ? get_le16((uint8_t*)fin->data) : 1;
+  if (f->finished)
+    return;
+  f->finished = true;
+
+  // every packet of the flow was received by now, in buffered mode the
+  // writer may still be hashing the last ones
+  if (sess->file) {
+    hash_direct(f);
+  } else {
+    while (sess->writer->written(f - sess->flows) < f->pushed)
+      std::this_thread::yield();
+    f->digest = sess->writer->digest(f - sess->flows);
+  }
+  if (fin->data_sz >= 6 && get_le32((uint8_t*)fin->data + 2) != f->digest.crc) {
+    fprintf(stderr, "flow %lu: crc32c %08x, the sender has %08x\n", f->id,
+            f->digest.crc, get_le32((uint8_t*)fin->data + 2));
+    sess->damaged_flows++;
+  }
+
+  if (++sess->finished_flows == sess->expected_flows)
+    finished.push_back(sess);
+}
+
+void hash_direct(flow_state* f) {
+  f->sess->file->hash(&f->digest, f->hashed, f->next);
+  f->hashed = std::max(f->hashed, f->next);
+}
+
+crc32c_stream file_digest(session* sess) {
+  flow_state* order[MAX_FLOWS];
+  crc32c_stream digest;
+  unsigned int i;
+
+  // flows are known by the first seqno of their range
+  for (i = 0; i < sess->nflows; i++)
+    order[i] = &sess->flows[i];
+  std::sort(order, order + sess->nflows,
+            [](flow_state* a, flow_state* b) { return a->id < b->id; });
+  for (i = 0; i < sess->nflows; i++)
+    digest.append(order[i]->digest);
+  return digest;
+}
+
+void answer_closed(session* sess, const packet* p, const struct sockaddr* peer,
+                   socklen_t peer_len) {
+  uint8_t crc[4];
+
+  if (!p->has_type(PACKET_TYPE_FIN))
+    return;
+  for (unsigned int i = 0; i < sess->nflows; i++) {
+    if (sess->flows[i].id != p->flow)
+      continue;
+    put_le32(crc, sess->flows[i].digest.crc);
+    wire_send(s, PACKET_TYPE_ACK | PACKET_TYPE_FIN, sess->flows[i].next, crc,
+              sizeof(crc), peer, peer_len, 0, p->flow, sess->id);
+  }
+}
+
+unsigned int repair(flow_state* f, const packet* p) {
+  session* sess = f->sess;
+  direct_file* file = sess->file;
+  unsigned long group;
+  unsigned int n, i;
+  const packet* q;
+  char* dst;
+
+  if (p->has_type(PACKET_TYPE_PARITY)) {
+    if (f->fec == NULL)
+      f->fec = new fec_decoder(f->id, sess->agreed.payload);
+    if (!f->fec->add_parity(p))
+      return 0;
+  }
+  if (f->fec == NULL || !f->fec->pending(p->seqno, &group))
+    return 0;
+
+  n = f->fec->rebuild(group, [&](unsigned long seqno) {
+    return file ? file->payload(seqno) : f->window->payload(seqno);
+  });
+  for (i = 0; i < n; i++) {
+    q = f->fec->packet_at(i);
+    if (file) {
+      if ((dst = file->at(q->seqno, q->data_sz)) == NULL)
         continue;
+      memcpy(dst, q->data, q->data_sz);
+      file->mark(q->seqno);
+      if (sess->progress)
+        sess->progress->mark(q->seqno, q->seqno + 1);
+    } else if (!f->window->insert(q)) {
+      continue;
+    }
+    f->highest = std::max(f->highest, q->seqno + 1);
+    sess->unsaved++;
+  }
+  if (file)
+    f->next = file->contiguous(f->next, f->highest);
+  return n;
+}
+
+void answer_resume(flow_state* f, const packet* request) {
+  session* sess = f->sess;
+  sack_block runs[RESUME_RANGES];
+  uint8_t buf[RESUME_RANGES * 16];
+  unsigned long end = request->seqno, upto, seqno;
+  int n = 0, i;
+
+  if (request->data_sz >= 8)
+    end = get_le64((const uint8_t*)request->data);
+  upto = end;
+  // the answer is a datagram of the transfer, it fits its payload
+  if (sess->progress)
+    n = sess->progress->ranges(request->seqno, end, runs,
+                               std::min(RESUME_RANGES,
+                                        (int)sess->agreed.payload / 16),
+                               &upto);
+  for (i = 0; i < n; i++) {
+    put_le64(buf + i * 16, runs[i].start);
+    put_le64(buf + i * 16 + 8, runs[i].end);
+    if (sess->file)
+      for (seqno = runs[i].start; seqno < runs[i].end; seqno++)
+        sess->file->mark(seqno);
+  }
+
+  // only what the sender was told about is skipped, a flow that never
+  // asked gets everything again
+  f->kept_until = std::max(f->kept_until, upto);
+  if (sess->file)
+    f->next = sess->file->contiguous(f->next, f->kept_until);
+  else
+    while (skip_kept(f))
+      ;
+  f->highest = std::max(f->highest, f->next);
+  wire_send(s, PACKET_TYPE_RESUME | PACKET_TYPE_ACK, upto, buf, n * 16,
+            (struct sockaddr*)&f->peer, f->peer_len, 0, f->id, sess->id);
+}
+
+bool skip_kept(flow_state* f) {
+  session* sess = f->sess;
+  unsigned long to, seqno, n;
+
+  if (sess->progress == NULL || f->next >= f->kept_until ||
+      f->window->contiguous() > 0)
+    return false;
+  to = std::min(sess->progress->next_missing(f->next), f->kept_until);
+  if (to == f->next)
+    return false;
+
+  // the slots of the skipped seqnos alias those of the data the writer may
+  // still be reading
+  while (sess->writer->written(f - sess->flows) < f->pushed)
+    std::this_thread::yield();
+  // what was kept still counts towards the CRC32C of the flow, the writer
+  // reads it back in its turn
+  for (seqno = f->next; seqno < to; seqno += n) {
+    n = std::min(to - seqno, (unsigned long)(UINT_MAX / sess->agreed.payload));
+    sess->writer->push(f - sess->flows, seqno + n - 1, NULL,
+                       n * sess->agreed.payload,
+                       (unsigned long long)seqno * sess->agreed.payload, 0);
+  }
+  f->pushed = to;
+  f->window->reclaim(f->next);
+  f->window->skip(to);
+  f->next = to;
+  f->highest = std::max(f->highest, to);
+  return true;
+}
+
+void save_progress(session* sess, bool force) {
+  uint64_t now;
+  unsigned long w;
+
+  if (sess->progress == NULL || sess->unsaved == 0)
+    return;
+  now = monotonic_usec();
+  if (!force && sess->unsaved < RESUME_SYNC_PACKETS &&
+      now - sess->saved_at < RESUME_SYNC_USEC)
+    return;
+
+  // in buffered mode only what the writer is done with counts, every flow
+  // is written in order
+  if (sess->file) {
+    if (!sess->file->sync())
+      diep((char*)"msync");
+  } else {
+    for (unsigned int i = 0; i < sess->nflows; i++) {
+      flow_state* f = &sess->flows[i];
+      w = sess->writer->written(i);
+      if (w > f->saved) {
+        sess->progress->mark(f->saved, w);
+        f->saved = w;
       }
+    }
+    if (fdatasync(sess->outfile) < 0)
+      diep((char*)"fdatasync");
+  }
+  if (!sess->progress->save())
+    diep((char*)"resume file");
+  sess->unsaved = 0;
+  sess->saved_at = now;
+}
+
+void reclaim_window(flow_state* f) {
+  unsigned long written = f->sess->writer->written(f - f->sess->flows);
+
+  if (f->fec)
+    written = std::min(written, f->fec->retain(f->next));
+  f->window->reclaim(written);
+}
+
+unsigned long window_edge(flow_state* f) {
+  if (f->window)
+    return f->window->limit();
+  return f->id + flow_packets(f->sess);
+}
+
+void queue_ack(wire_send_batch* acks, flow_state* f, unsigned int type,
+               unsigned long recent, uint32_t timestamp) {
+  sack_block sack[SACK_MAX_BLOCKS];
+  uint8_t* buf = sack_buf[acks->size()];
+  unsigned int len;
+  int blocks;
+
+  if (f->policy.pending())
+    f->sess->delayed--;
+  timestamp = f->policy.on_ack(timestamp);
+
+  if (type & PACKET_TYPE_FIN) {
+    put_le32(buf, f->digest.crc);
+    len = 4;
+  } else {
+    if (f->sess->file)
+      blocks = f->sess->file->sack(f->next, f->highest, recent, sack);
+    else
+      blocks = f->window->sack(recent, sack);
+    f->advertised = std::max(f->advertised, window_edge(f));
+    len = encode_sack(sack, blocks, f->next, f->advertised - f->next, buf);
+  }
+  acks->add(type, f->next, buf, len, (struct sockaddr*)&f->peer, f->peer_len,
+            timestamp, f->id, f->sess->id);
+}
+
+bool delay_ack(flow_state* f, bool in_order, bool retransmit,
+               uint32_t timestamp) {
+  bool pending = f->policy.pending();
+  bool wait = f->policy.on_packet(in_order, retransmit, timestamp,
+                                  f->sess->heard_at);
 
+  // the session counts its flows with a delayed ACK pending
+  if (!pending && f->policy.pending())
+    f->sess->delayed++;
+  return wait;
+}
+
+void send_delayed_acks(wire_send_batch* acks, uint64_t now) {
+  for (auto& it : sessions) {
+    session* sess = it.second;
+    for (unsigned int i = 0; i < sess->nflows && sess->delayed > 0; i++) {
+      flow_state* f = &sess->flows[i];
+      if (f->policy.pending() && f->policy.due() <= now)
+        queue_ack(acks, f, PACKET_TYPE_ACK, f->next - 1, 0);
+    }
+  }
+}
+
+bool window_closed(flow_state* f) {
+  return f->window && !f->finished &&
+         f->advertised - f->next <
+             f->window->capacity() / WINDOW_UPDATE_FRACTION;
+}
+
+void send_window_updates(wire_send_batch* acks) {
+  for (auto& it : sessions) {
+    session* sess = it.second;
+    if (sess->closed_at || sess->writer == NULL)
+      continue;
+    for (unsigned int i = 0; i < sess->nflows; i++) {
+      flow_state* f = &sess->flows[i];
+      if (!window_closed(f) || f->peer_len == 0)
+        continue;
+      reclaim_window(f);
+      if (window_edge(f) - f->advertised <
+          f->window->capacity() / WINDOW_UPDATE_FRACTION)
+        continue;
+      // a pending delayed ACK carries the window as well
+      queue_ack(acks, f,
+                PACKET_TYPE_ACK |
+                    (f->policy.pending() ? 0 : PACKET_TYPE_PROBE),
+                f->next - 1, 0);
+    }
+  }
+}
+
+void end_burst(wire_send_batch* acks) {
+  uint64_t now = monotonic_usec();
+
+  send_window_updates(acks);
+  send_delayed_acks(acks, now);
+  acks->flush();
+  for (session* sess : finished)
+    close_session(sess);
+  finished.clear();
+  for (auto& it : sessions)
+    if (it.second->closed_at == 0)
+      save_progress(it.second, false);
+  if (output_dir)
+    expire_sessions(now);
+}
+
+bool wait_datagram() {
+  struct pollfd pfd;
+  struct timespec timeout;
+  uint64_t now = monotonic_usec(), due = 0;
+  unsigned int i;
+
+  for (auto& it : sessions) {
+    session* sess = it.second;
+    for (i = 0; i < sess->nflows && sess->delayed > 0; i++)
+      if (sess->flows[i].policy.pending() &&
+          (due == 0 || sess->flows[i].policy.due() < due))
+        due = sess->flows[i].policy.due();
+    for (i = 0; i < sess->nflows && sess->closed_at == 0; i++)
+      if (window_closed(&sess->flows[i]) &&
+          (due == 0 || due > now + WINDOW_UPDATE_USEC))
+        due = now + WINDOW_UPDATE_USEC;
+  }
+  if (output_dir && !sessions.empty() &&
+      (due == 0 || due > now + SESSION_POLL_USEC))
+    due = now + SESSION_POLL_USEC;
+
+  if (due == 0)
+    return true;
+  if (due <= now)
+    return false;
+  timeout.tv_sec = (due - now) / 1000000;
+  timeout.tv_nsec = (due - now) % 1000000 * 1000;
+  pfd.fd = s;
+  pfd.events = POLLIN;
+  return ppoll(&pfd, 1, &timeout, NULL) > 0;
+}
+
+void receive_buffered() {
+  packet* recv_packet;
+  session* sess;
+  flow_state* f;
+  int numPackets, j, type;
+  unsigned int repaired;
+  unsigned long ready;
+  uint64_t now;
+  bool in_order;
+
+  // drain bursts of datagrams with one recvmmsg, then answer all of them
+  // with one sendmmsg
+  wire_recv_batch burst;
+  wire_send_batch acks(s);
+  if (use_offload)
+    burst.enable_gro(s);
+
+  while (!stop) {
+    if (!wait_datagram()) {
+      end_burst(&acks);
+      continue;
+    }
+    numPackets = burst.recv(s);
+    if (numPackets <= 0)
+      continue;
+
+    now = monotonic_usec();
+    for (j = 0; j < numPackets; j++) {
+      recv_packet = burst.get(j);
+      if (recv_packet == NULL ||
+          answer_handshake(recv_packet, burst.peer(j), burst.peer_len(j)))
+        continue;
+      sess = find_session(recv_packet->session);
+      if (sess == NULL)
+        continue;
+      sess->heard_at = now;
+      if (sess->closed_at) {
+        answer_closed(sess, recv_packet, burst.peer(j), burst.peer_len(j));
+        continue;
+      }
+      f = find_flow(sess, recv_packet->flow);
+      if (f == NULL)
+        continue;
 #if DEBUG
-      printf("Write seqno %lu packet\n", top->seqno);
+      printf("Receive packet %lu of size (%u) on flow %lu\n",
+             recv_packet->seqno, recv_packet->data_sz, f->id);
 #endif
+      memcpy(&f->peer, burst.peer(j), sizeof(f->peer));
+      f->peer_len = burst.peer_len(j);
+      if (recv_packet->has_type(PACKET_TYPE_RESUME)) {
+        answer_resume(f, recv_packet);
+        continue;
+      }
 
-      fwrite(top->data, sizeof(char), top->data_sz, outfile);
-      //prepare for next packet
-      delete top;
-      nextSeq++;
-    }
+      // only data that continues the flow may wait for its ACK
+      in_order =
+          ack_policy::continues(recv_packet->seqno, f->next, f->highest);
+
+      // duplicates and packets too far ahead of the window are dropped
+      type = PACKET_TYPE_ACK | (recv_packet->type & PACKET_TYPE_RETX);
+      if (recv_packet->has_type(PACKET_TYPE_DATA)) {
+        if (f->window->insert(recv_packet)) {
+          f->highest = std::max(f->highest, recv_packet->seqno + 1);
+          sess->unsaved++;
+        } else
+          in_order = false;
+      } else {
+        in_order = false;
+      }
+
+      // parity, or data that completes a group parity is held for, may
+      // rebuild what was lost, its ACK must not be taken for an RTT sample
+      repaired = repair(f, recv_packet);
+      if (repaired > 0) {
+        type |= PACKET_TYPE_RETX;
+        in_order = false;
+      }
+
+      if (recv_packet->has_type(PACKET_TYPE_FIN)) {
+        type |= PACKET_TYPE_FIN;
+        finish_flow(f, recv_packet);
+      }
+
+      // every flow lands at its own offset in the file
+      reclaim_window(f);
+      do {
+        ready = f->window->contiguous();
+        for (; ready > 0; ready--, f->next++) {
+#if DEBUG
+          printf("Write seqno %lu packet\n", f->next);
+#endif
+          sess->writer->push(f - sess->flows, f->next,
+                             f->window->data(f->next),
+                             f->window->size(f->next),
+                             (unsigned long long)f->next *
+                                 sess->agreed.payload,
+                             f->window->crc(f->next));
+          f->pushed = f->next + 1;
+        }
+        f->window->advance(f->next - f->window->base());
+      } while (skip_kept(f));
 
 #if DEBUG
-    printf("Ask for next seq %lu\n\n", nextSeq);
+      printf("Ask for next seq %lu\n\n", f->next);
 #endif
-    snd_packet->seqno = nextSeq;
-    snd_packet->set_type(PACKET_TYPE_ACK);
-    //send the acknowledgement
-    sendto(s, snd_packet, sizeof(packet), 0, (struct sockaddr*)&si_other, slen);
+      // parity that rebuilt nothing changes nothing the sender can see
+      if (recv_packet->has_type(PACKET_TYPE_PARITY) && repaired == 0)
+        continue;
+
+      //queue the acknowledgement, along with what is held out of order
+      //and echo the timestamp of the packet it answers
+      if (delay_ack(f, in_order, type & PACKET_TYPE_RETX,
+                    recv_packet->timestamp))
+        continue;
+      queue_ack(&acks, f, type, recv_packet->seqno, recv_packet->timestamp);
+    }
+
+    end_burst(&acks);
   }
 
-  snd_packet->set_type(PACKET_TYPE_FIN);
-  for (i = 0; i < 3; i++) {
-    sendto(s, snd_packet, sizeof(packet), 0, (struct sockaddr*)&si_other, slen);
+  burst.stats.print("recvmmsg");
+  if (burst.segments.calls)
+    burst.segments.print("gro");
+  if (burst.corrupt)
+    fprintf(stderr, "checksum: %lu damaged datagrams dropped\n",
+            burst.corrupt);
+  acks.stats.print("ack sendmmsg");
+}
+
+void receive_direct() {
+  packet header, recv_packet;
+  session* sess;
+  flow_state* f;
+  struct sockaddr_in from;
+  int type;
+  unsigned int repaired;
+  unsigned long corrupt = 0;
+  socklen_t from_len;
+  ssize_t bytes, peeked;
+  char* dst;
+  bool in_order;
+
+  // UDP_GRO stays off, the header of each datagram is peeked on its own
+  wire_send_batch acks(s);
+
+  while (!stop) {
+    if (acks.size() == 0 && !wait_datagram()) {
+      end_burst(&acks);
+      continue;
+    }
+
+    // ACKs are flushed once the socket has been drained
+    bytes = peeked = wire_peek(s, &header, acks.size() ? MSG_DONTWAIT : 0);
+    if (bytes < 0) {
+      end_burst(&acks);
+      continue;
+    }
+
+    // duplicates and anything that does not belong in the file are
+    // received into the packet's own buffer and dropped
+    dst = NULL;
+    sess = bytes > 0 ? find_session(header.session) : NULL;
+    if (sess && sess->closed_at == 0 && header.has_type(PACKET_TYPE_DATA))
+      dst = sess->file->at(header.seqno, header.data_sz);
+
+    from_len = sizeof(from);
+    bytes = wire_recv_into(s, &recv_packet, dst ? dst : recv_packet.data,
+                           dst ? header.data_sz : MAX_PACKET_SIZE,
+                           (struct sockaddr*)&from, &from_len, 0);
+    // a header that parsed once only fails its checksum the second time
+    if (bytes == 0 && peeked > 0)
+      corrupt++;
+    if (bytes > 0 && answer_handshake(&recv_packet, (struct sockaddr*)&from,
+                                      from_len))
+      continue;
+    if (bytes <= 0 || sess == NULL || recv_packet.session != sess->id)
+      continue;
+    sess->heard_at = monotonic_usec();
+    if (sess->closed_at) {
+      answer_closed(sess, &recv_packet, (struct sockaddr*)&from, from_len);
+      continue;
+    }
+    f = find_flow(sess, recv_packet.flow);
+    if (f == NULL)
+      continue;
+#if DEBUG
+    printf("Receive packet %lu of size (%u) on flow %lu\n", recv_packet.seqno,
+           recv_packet.data_sz, f->id);
+#endif
+    memcpy(&f->peer, &from, sizeof(f->peer));
+    f->peer_len = from_len;
+    if (recv_packet.has_type(PACKET_TYPE_RESUME)) {
+      answer_resume(f, &recv_packet);
+      continue;
+    }
+
+    in_order = false;
+    if (dst && recv_packet.seqno == header.seqno) {
+      in_order =
+          ack_policy::continues(recv_packet.seqno, f->next, f->highest);
+      sess->file->mark(recv_packet.seqno);
+      if (sess->progress) {
+        sess->progress->mark(recv_packet.seqno, recv_packet.seqno + 1);
+        sess->unsaved++;
+        save_progress(sess, false);
+      }
+      f->highest = std::max(f->highest, recv_packet.seqno + 1);
+      f->next = sess->file->contiguous(f->next, f->highest);
+    }
+
+    type = PACKET_TYPE_ACK | (recv_packet.type & PACKET_TYPE_RETX);
+    repaired = repair(f, &recv_packet);
+    hash_direct(f);
+    if (repaired > 0) {
+      type |= PACKET_TYPE_RETX;
+      in_order = false;
+    } else if (recv_packet.has_type(PACKET_TYPE_PARITY)) {
+      continue;
+    }
+
+    if (recv_packet.has_type(PACKET_TYPE_FIN)) {
+      type |= PACKET_TYPE_FIN;
+      in_order = false;
+      finish_flow(f, &recv_packet);
+    }
+
+    if (delay_ack(f, in_order, type & PACKET_TYPE_RETX,
+                  recv_packet.timestamp))
+      continue;
+    queue_ack(&acks, f, type, recv_packet.seqno, recv_packet.timestamp);
   }
 
-  delete snd_packet;
-  fclose(outfile);
+  end_burst(&acks);
+  acks.stats.print("ack sendmmsg");
+  if (corrupt)
+    fprintf(stderr, "checksum: %lu damaged datagrams dropped\n", corrupt);
+}
+
+void serve(int sock) {
+  s = sock;
+  if (use_mmap)
+    receive_direct();
+  else
+    receive_buffered();
+
+  for (auto& it : sessions)
+    delete it.second;
+  sessions.clear();
+}
+
+void reliablyReceive(unsigned short int myUDPport, char* destinationFile) {
+  destination = destinationFile;
+  /* Now receive data and send acknowledgements, the sender opens the
+     transfer with a handshake (see handshake.hpp) */
+  serve(setup_socket(myUDPport, false));
   close(s);
 #if DEBUG
   printf("%s received.\n", destinationFile);
@@ -128,18 +992,96 @@ void reliablyReceive(unsigned short int myUDPport, char* destinationFile) {
   return;
 }
 
+void serveForever(unsigned short int myUDPport) {
+  std::thread threads[MAX_WORKERS];
+  int socks[MAX_WORKERS];
+  unsigned int i;
+
+  // every worker has its own socket on the port, in the order the kernel
+  // numbers them for the steering program
+  for (i = 0; i < workers; i++)
+    socks[i] = setup_socket(myUDPport, workers > 1);
+  if (workers > 1 && !steer_sessions(socks[0], workers)) {
+    // spread by address, the flows of a session would be split
+    perror("SO_ATTACH_REUSEPORT_CBPF");
+    fprintf(stderr, "sessions can not be steered, serving on one worker\n");
+    for (i = 1; i < workers; i++)
+      close(socks[i]);
+    workers = 1;
+  }
+  fprintf(stderr, "serving port %u into %s on %u worker%s\n", myUDPport,
+          output_dir, workers, workers > 1 ? "s" : "");
+
+  for (i = 0; i < workers; i++)
+    threads[i] = std::thread(serve, socks[i]);
+  for (i = 0; i < workers; i++)
+    threads[i].join();
+}
+
 /*
  *
  */
 int main(int argc, char** argv) {
   unsigned short int udpPort;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "zGaKRd:w:")) != -1) {
+    switch (opt) {
+      case 'z':
+        use_mmap = true;
+        break;
+      case 'G':
+        use_offload = false;
+        break;
+      case 'a':
+        delay_acks = false;
+        break;
+      case 'K':
+        wire_checksums = false;
+        break;
+      case 'R':
+        keep_progress = true;
+        break;
+      case 'd':
+        output_dir = optarg;
+        break;
+      case 'w':
+        workers = atoi(optarg);
+        if (workers < 1 || workers > MAX_WORKERS)
+          argc = 0;
+        break;
+      default:
+        argc = 0;
+    }
+  }
 
-  if (argc != 3) {
-    fprintf(stderr, "usage: %s UDP_port filename_to_write\n\n", argv[0]);
+  if (argc - optind != (output_dir ? 1 : 2)) {
+    fprintf(stderr,
+            "usage: %s [-z] [-G] [-a] [-K] [-R] UDP_port "
+            "filename_to_write\n"
+            "       %s -d directory [-w workers] [-z] [-G] [-a] [-K] [-R] "
+            "UDP_port\n\n"
+            "  -z  receive straight into a mapping of the file\n"
+            "  -G  receive one datagram at a time, without UDP GRO\n"
+            "  -a  acknowledge every packet, no delayed ACKs\n"
+            "  -K  leave the CRC32C out of every ACK, the file is still "
+            "checked\n"
+            "  -R  keep the progress in filename_to_write.part, and resume "
+            "from it\n"
+            "  -d  serve every sender until killed, each transfer into "
+            "directory/ID where\n"
+            "      ID is its connection ID in hex\n"
+            "  -w  worker threads, each on its own socket (at most %d)\n\n",
+            argv[0], argv[0], MAX_WORKERS);
     exit(1);
   }
+  argv += optind;
 
-  udpPort = (unsigned short int)atoi(argv[1]);
+  udpPort = (unsigned short int)atoi(argv[0]);
 
-  reliablyReceive(udpPort, argv[2]);
+  if (output_dir)
+    serveForever(udpPort);
+  else
+    reliablyReceive(udpPort, argv[1]);
+  return damaged ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,72 @@
+#ifndef MP2_RENO_HPP
+#define MP2_RENO_HPP
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "congestion.hpp"
+
+/**
+ * reno is NewReno (RFC 5681, RFC 6582)
+ *
+ * - Slow Start: on new ack, cwnd + acked packets (at most ABC_LIMIT),
+ *   until cwnd reaches ssthresh
+ * - Congestion Avoidance: on new ack, cwnd + 1 / cwnd per acked packet
+ * - Fast Recovery: ssthresh = cwnd / 2 and cwnd = ssthresh + 3, every dup
+ *   ack inflates cwnd by one, and cwnd deflates back to ssthresh when the
+ *   recovery is over
+ * - Timeout: ssthresh = cwnd / 2 and cwnd = 1
+ */
+class reno : public congestion_control {
+ public:
+  /**
+   * @param initial the initial window in packets
+   */
+  reno(double initial = DEFAULT_CWND)
+      : window(initial), ss_thresh(DEFAULT_SS_THRESH) {}
+
+  const char* name() { return "reno"; }
+
+  void on_ack(const ack_sample& ack) {
+    if (ack.in_recovery)
+      return;
+    if (window < ss_thresh)
+      window += std::min(ack.acked, (unsigned long)ABC_LIMIT);
+    else
+      window += ack.acked / std::floor(window);
+  }
+
+  void on_dupack(const ack_sample& ack) {
+    if (ack.in_recovery)
+      window++;
+  }
+
+  void on_loss(const ack_sample& ack) {
+    (void)ack;
+    ss_thresh = std::max(window / 2, (double)MIN_SS_THRESH);
+    window = ss_thresh + 3;
+  }
+
+  void on_recovery() { window = ss_thresh; }
+
+  void on_timeout(uint64_t now) {
+    (void)now;
+    ss_thresh = std::max(window / 2, (double)MIN_SS_THRESH);
+    window = 1;
+  }
+
+  bool in_slow_start() { return window < ss_thresh; }
+
+  double cwnd() { return window; }
+
+  void print_stats() {
+    fprintf(stderr, "reno: cwnd %.1f, ssthresh %.1f\n", window, ss_thresh);
+  }
+
+ private:
+  double window, ss_thresh;
+};
+
+#endif  // MP2_RENO_HPP
@@ -0,0 +1,195 @@
+#ifndef MP2_REORDER_BUFFER_HPP
+#define MP2_REORDER_BUFFER_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "crc32c.hpp"
+#include "sack.hpp"
+#include "shared.hpp"
+
+// Most packets the receiver can hold past the next expected seqno, fewer
+// for a flow that has fewer. Must be a power of two so that seqno % slots
+// is a mask
+#define REORDER_SLOTS 8192
+// Fewest, one word of the bitmap
+#define REORDER_MIN_SLOTS 64
+
+/**
+ * reorder_buffer holds out of order packets until the gap in front of them
+ * is filled
+ *
+ * Packet seqno is stored in slot seqno % slots of a slab that is allocated
+ * once, and an occupancy bitmap tells which slots hold data.
+ * Inserting is a copy into the slot, finding the in-order run at the front
+ * is a scan of the bitmap one 64-bit word at a time.
+ *
+ * Slots that were advanced past may still be referenced by whoever consumes
+ * the in-order data, so they are only reused after reclaim().
+ *
+ * The CRC32C of every payload is kept along with it, for the checksum of
+ * the whole file.
+ */
+class reorder_buffer {
+ public:
+  /**
+   * @param first the first seqno expected
+   * @param packets how many packets the flow has, the buffer never holds
+   *        more than that
+   * @param chunk the largest payload of a packet
+   */
+  reorder_buffer(unsigned long first, unsigned long packets,
+                 unsigned int chunk)
+      : next(first), tail(first), highest(first), chunk(chunk) {
+    for (slots = REORDER_MIN_SLOTS; slots < packets && slots < REORDER_SLOTS;)
+      slots *= 2;
+    slab = new char[(size_t)slots * chunk];
+    sizes = new unsigned short[slots];
+    crcs = new uint32_t[slots];
+    bitmap = new uint64_t[slots / 64]();
+  }
+
+  /**
+   * insert copies a data packet into its slot
+   *
+   * @param p the received packet, its CRC32C is computed unless the
+   *        datagram's checksum already did
+   * @return false if the packet is a duplicate, too far ahead to be held
+   *         or larger than a slot
+   */
+  bool insert(const packet* p) {
+    if (p->seqno < next || p->seqno >= tail + slots || p->data_sz > chunk)
+      return false;
+
+    unsigned long i = p->seqno % slots;
+    if (test(i))
+      return false;
+
+    memcpy(slab + i * chunk, p->data, p->data_sz);
+    sizes[i] = p->data_sz;
+    crcs[i] = p->has_crc ? p->crc : crc32c(0, p->data, p->data_sz);
+    bitmap[i / 64] |= 1ULL << (i % 64);
+    highest = std::max(highest, p->seqno + 1);
+    return true;
+  }
+
+  /**
+   * contiguous counts the packets that are ready in order from base()
+   */
+  unsigned long contiguous() {
+    return find_bit(bitmap, slots, next, tail + slots, false) - next;
+  }
+
+  /**
+   * sack lists the runs of packets held above base()
+   *
+   * @param recent the seqno that triggered the ACK
+   * @param out receives at most SACK_MAX_BLOCKS blocks
+   * @return the number of blocks
+   */
+  int sack(unsigned long recent, sack_block* out) {
+    return collect_sack(bitmap, slots, next, highest, recent, out);
+  }
+
+  /**
+   * data returns the payload of a seqno that is held in the buffer
+   */
+  const char* data(unsigned long seqno) {
+    return slab + (seqno % slots) * chunk;
+  }
+
+  /**
+   * payload returns the payload of seqno while it can still be read: it
+   * was received and its slot has not been reclaimed
+   *
+   * @return NULL otherwise
+   */
+  const char* payload(unsigned long seqno) {
+    if (seqno < tail || seqno >= tail + slots ||
+        (seqno >= next && !test(seqno % slots)))
+      return NULL;
+    return data(seqno);
+  }
+
+  /**
+   * size returns the payload length of a seqno that is held in the buffer
+   */
+  unsigned int size(unsigned long seqno) {
+    return sizes[seqno % slots];
+  }
+
+  /**
+   * crc returns crc32c(0, data(seqno), size(seqno)) of a seqno that is held
+   * in the buffer
+   */
+  uint32_t crc(unsigned long seqno) { return crcs[seqno % slots]; }
+
+  /**
+   * advance frees the first n in-order packets and moves the base past them
+   */
+  void advance(unsigned long n) {
+    for (; n > 0; n--, next++) {
+      unsigned long i = next % slots;
+      bitmap[i / 64] &= ~(1ULL << (i % 64));
+    }
+  }
+
+  /**
+   * skip moves the base to seqno without delivering anything in between,
+   * which must not be held anyway. Every slot below base() has to be
+   * reclaimed first
+   */
+  void skip(unsigned long seqno) {
+    for (; next < seqno && next < tail + slots; next++) {
+      unsigned long i = next % slots;
+      bitmap[i / 64] &= ~(1ULL << (i % 64));
+    }
+    next = tail = std::max(next, seqno);
+    highest = std::max(highest, next);
+  }
+
+  /**
+   * reclaim lets the slots of every seqno below seqno be reused
+   *
+   * @param seqno the first seqno whose data is still in use, at most base()
+   */
+  void reclaim(unsigned long seqno) { tail = std::max(tail, seqno); }
+
+  /**
+   * base is the next seqno expected in order
+   */
+  unsigned long base() { return next; }
+
+  /**
+   * limit is one past the highest seqno that can be held, the right edge
+   * of the receive window. Only reclaim() moves it
+   */
+  unsigned long limit() { return tail + slots; }
+
+  /**
+   * capacity is how many packets the buffer holds
+   */
+  unsigned long capacity() { return slots; }
+
+  ~reorder_buffer() {
+    delete[] slab;
+    delete[] sizes;
+    delete[] crcs;
+    delete[] bitmap;
+  }
+
+ private:
+  bool test(unsigned long i) { return bitmap[i / 64] >> (i % 64) & 1; }
+
+  unsigned long next, tail, highest;
+  unsigned long slots;
+  unsigned int chunk;
+  char* slab;
+  unsigned short* sizes;
+  uint32_t* crcs;
+  uint64_t* bitmap;
+};
+
+#endif  // MP2_REORDER_BUFFER_HPP
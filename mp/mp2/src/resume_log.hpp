@@ -0,0 +1,231 @@
+#ifndef MP2_RESUME_LOG_HPP
+#define MP2_RESUME_LOG_HPP
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "sack.hpp"
+#include "shared.hpp"
+
+// Appended to the destination file to name its resume file
+#define RESUME_SUFFIX ".part"
+// First bytes of a resume file
+#define RESUME_MAGIC "MP2RESUM"
+// Version of the resume file, bump whenever resume_header changes
+#define RESUME_VERSION 1
+// The progress is made durable once this many packets arrived since the
+// last time, or this long after it, whichever comes first
+#define RESUME_SYNC_PACKETS 16384
+#define RESUME_SYNC_USEC 1000000
+// Most ranges a reply to PACKET_TYPE_RESUME lists, 16 bytes each, fewer
+// if the payload of the transfer is smaller
+#define RESUME_RANGES (MAX_PACKET_SIZE / 16)
+
+/**
+ * resume_header starts a resume file, the bitmap follows it as 64-bit
+ * words in host byte order, bit seqno % 64 of word seqno / 64 is set once
+ * packet seqno is on disk
+ */
+struct resume_header {
+  char magic[8];
+  uint32_t version;
+  // payload of the transfer it was written for, the seqnos stand for
+  // packets of that size
+  uint32_t packet_size;
+  // size of the transfer, 0 if the receiver did not know it
+  uint64_t bytes;
+};
+
+/**
+ * resume_log is the on-disk record of which packets of a transfer have
+ * reached the destination file, kept next to it so that an interrupted
+ * transfer can pick up where it stopped
+ *
+ * Marking a packet only touches the bitmap in memory. save() writes the
+ * words that changed since the last save and fdatasyncs them, the caller
+ * makes the data those bits stand for durable first, so that a crash can
+ * lose progress but never claim data that is not there.
+ */
+class resume_log {
+ public:
+  /**
+   * opens the resume file of destination, and loads it if it was written
+   * for a transfer of the same size
+   *
+   * @param bytes the size of the transfer
+   * @param packet_size the payload the sender offers, a file written for a
+   *        smaller one is still loaded and the transfer has to use that
+   */
+  resume_log(const char* destination, unsigned long long bytes,
+             unsigned int packet_size)
+      : path(std::string(destination) + RESUME_SUFFIX), loaded(false),
+        kept(0), chunk(packet_size), dirty_lo(ULONG_MAX), dirty_hi(0) {
+    resume_header header;
+    struct stat st;
+
+    if ((fd = open(path.c_str(), O_RDWR | O_CREAT, 0644)) < 0)
+      return;
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, RESUME_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == RESUME_VERSION &&
+        header.packet_size > 0 && header.packet_size <= packet_size &&
+        header.bytes == bytes && fstat(fd, &st) == 0) {
+      words.resize((st.st_size - sizeof(header)) / sizeof(uint64_t));
+      size_t len = words.size() * sizeof(uint64_t);
+      if (pread(fd, words.data(), len, sizeof(header)) == (ssize_t)len) {
+        loaded = true;
+        chunk = header.packet_size;
+        for (size_t i = 0; i < words.size(); i++)
+          kept += __builtin_popcountll(words[i]);
+        return;
+      }
+      words.clear();
+    }
+
+    // anything else starts over
+    memcpy(header.magic, RESUME_MAGIC, sizeof(header.magic));
+    header.version = RESUME_VERSION;
+    header.packet_size = packet_size;
+    header.bytes = bytes;
+    if (ftruncate(fd, 0) < 0 ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        fdatasync(fd) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  bool ok() { return fd >= 0; }
+
+  /**
+   * resumed tells whether the progress of an earlier run was loaded, the
+   * destination must not be truncated then
+   */
+  bool resumed() { return loaded; }
+
+  /**
+   * packet_size is the payload the transfer uses, the one of the earlier
+   * run if it was loaded
+   */
+  unsigned int packet_size() { return chunk; }
+
+  /**
+   * kept_packets is the number of packets an earlier run left on disk
+   */
+  unsigned long kept_packets() { return kept; }
+
+  bool has(unsigned long seqno) {
+    return seqno / 64 < words.size() && words[seqno / 64] >> (seqno % 64) & 1;
+  }
+
+  /**
+   * mark records packets [from, to) as written to the destination
+   */
+  void mark(unsigned long from, unsigned long to) {
+    if (from >= to)
+      return;
+    if ((to + 63) / 64 > words.size())
+      words.resize((to + 63) / 64, 0);
+    for (unsigned long seqno = from; seqno < to; seqno++)
+      words[seqno / 64] |= 1ULL << (seqno % 64);
+    dirty_lo = std::min(dirty_lo, from / 64);
+    dirty_hi = std::max(dirty_hi, (to + 63) / 64);
+  }
+
+  /**
+   * next_missing returns the first seqno at or after seqno that is not on
+   * disk
+   */
+  unsigned long next_missing(unsigned long seqno) {
+    unsigned long size = words.size() * 64;
+
+    if (seqno >= size)
+      return seqno;
+    return find_bit(words.data(), size, seqno, size, false);
+  }
+
+  /**
+   * ranges lists the runs of packets on disk in [from, end), as many as
+   * fit in out
+   *
+   * @param out receives at most max runs
+   * @param upto receives how far the listing got: every run below it is
+   *        listed, end if nothing was left out
+   * @return the number of runs
+   */
+  int ranges(unsigned long from, unsigned long end, sack_block* out, int max,
+             unsigned long* upto) {
+    unsigned long size = std::min(end, (unsigned long)words.size() * 64);
+    int n = 0;
+
+    *upto = end;
+    while (from < size) {
+      from = find_bit(words.data(), words.size() * 64, from, size, true);
+      if (from >= size)
+        break;
+      if (n == max) {
+        *upto = from;
+        break;
+      }
+      out[n].start = from;
+      out[n].end = from =
+          find_bit(words.data(), words.size() * 64, from, size, false);
+      n++;
+    }
+    return n;
+  }
+
+  /**
+   * save makes the bits marked since the last save durable
+   *
+   * @return false if the file could not be written
+   */
+  bool save() {
+    unsigned long lo = dirty_lo, hi = dirty_hi;
+    size_t len = (hi - lo) * sizeof(uint64_t);
+
+    if (lo >= hi)
+      return true;
+    dirty_lo = ULONG_MAX;
+    dirty_hi = 0;
+    // bits only ever get set, so a torn write loses progress at worst
+    return pwrite(fd, words.data() + lo, len,
+                  sizeof(resume_header) + lo * sizeof(uint64_t)) ==
+               (ssize_t)len &&
+           fdatasync(fd) == 0;
+  }
+
+  /**
+   * finish removes the resume file once the transfer is complete
+   */
+  void finish() {
+    close(fd);
+    fd = -1;
+    unlink(path.c_str());
+  }
+
+  ~resume_log() {
+    if (fd >= 0)
+      close(fd);
+  }
+
+ private:
+  std::string path;
+  int fd;
+  bool loaded;
+  unsigned long kept;
+  unsigned int chunk;
+  std::vector<uint64_t> words;
+  // the words marked since the last save
+  unsigned long dirty_lo, dirty_hi;
+};
+
+#endif  // MP2_RESUME_LOG_HPP
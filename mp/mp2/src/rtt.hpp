@@ -0,0 +1,99 @@
+#ifndef MP2_RTT_HPP
+#define MP2_RTT_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+
+// RTO before the first RTT sample, in microseconds (RFC 6298)
+#define RTO_INITIAL_USEC 1000000
+// Default lower bound of the RTO, in microseconds
+#define RTO_MIN_USEC 20000
+// Upper bound of the RTO, also the cap of the exponential backoff
+#define RTO_MAX_USEC 60000000
+// Clock granularity G of RFC 6298
+#define RTO_GRANULARITY_USEC 1000
+
+/**
+ * monotonic_usec returns CLOCK_MONOTONIC in microseconds
+ */
+static inline uint64_t monotonic_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * now_usec returns the monotonic clock truncated to the 32 bits that fit in
+ * the wire timestamp. Differences are correct across the wrap around as
+ * long as they are below 71 minutes.
+ */
+static inline uint32_t now_usec() { return monotonic_usec(); }
+
+/**
+ * rtt_estimator is the Jacobson/Karels estimator of RFC 6298
+ *
+ * Samples come from timestamps echoed by the receiver. Following Karn's
+ * rule, the caller must not feed samples of retransmitted packets. Every
+ * timeout doubles the RTO until the next valid sample.
+ */
+class rtt_estimator {
+ public:
+  rtt_estimator(uint32_t min_rto = RTO_MIN_USEC)
+      : srtt(0), rttvar(0), rto(RTO_INITIAL_USEC), min_rto(min_rto),
+        samples(0), backoffs(0) {}
+
+  /**
+   * sample feeds one round trip time measurement
+   *
+   * @param rtt the measured round trip time in microseconds
+   */
+  void sample(uint32_t rtt) {
+    if (samples == 0) {
+      srtt = rtt;
+      rttvar = rtt / 2;
+    } else {
+      uint32_t err = srtt > rtt ? srtt - rtt : rtt - srtt;
+      rttvar = (3 * (uint64_t)rttvar + err) / 4;
+      srtt = (7 * (uint64_t)srtt + rtt) / 8;
+    }
+    samples++;
+    rto = std::max<uint64_t>(RTO_GRANULARITY_USEC, 4 * (uint64_t)rttvar) +
+          srtt;
+    rto = std::min<uint64_t>(std::max(rto, min_rto), RTO_MAX_USEC);
+  }
+
+  /**
+   * backoff doubles the RTO after a retransmission timeout
+   */
+  void backoff() {
+    rto = std::min<uint64_t>(2 * (uint64_t)rto, RTO_MAX_USEC);
+    backoffs++;
+  }
+
+  /**
+   * timeout is the current retransmission timeout in microseconds
+   */
+  uint32_t timeout() { return rto; }
+
+  /**
+   * smoothed is the smoothed round trip time in microseconds, 0 before the
+   * first sample
+   */
+  uint32_t smoothed() { return srtt; }
+
+  void print_stats() {
+    fprintf(stderr,
+            "rtt: srtt %u us, rttvar %u us, rto %u us, %lu samples, "
+            "%lu backoffs\n",
+            srtt, rttvar, rto, samples, backoffs);
+  }
+
+ private:
+  uint32_t srtt, rttvar, rto, min_rto;
+  unsigned long samples, backoffs;
+};
+
+#endif  // MP2_RTT_HPP
@@ -0,0 +1,165 @@
+#ifndef MP2_SACK_HPP
+#define MP2_SACK_HPP
+
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "shared.hpp"
+#include "wire.hpp"
+
+// Most SACK blocks carried by one ACK
+#define SACK_MAX_BLOCKS 4
+// Encoded size of one block: start and length, both relative 32-bit values
+#define SACK_BLOCK_SIZE 8
+// Encoded size of the receive window that comes before the blocks
+#define ACK_WINDOW_SIZE 4
+
+/**
+ * sack_block is a range [start, end) of seqnos the receiver holds above the
+ * cumulative ACK
+ */
+struct sack_block {
+  unsigned long start, end;
+};
+
+/**
+ * find_bit returns the first seqno in [from, to) whose bit equals value,
+ * or to if there is none
+ *
+ * The bitmap is circular: seqno lives in bit seqno % size, and size must
+ * be a multiple of 64. A bitmap that is at least as large as every seqno
+ * stored in it behaves like a plain one.
+ */
+static inline unsigned long find_bit(const uint64_t* bits, unsigned long size,
+                                     unsigned long from, unsigned long to,
+                                     bool value) {
+  unsigned long i, bit;
+  uint64_t word;
+
+  while (from < to) {
+    i = from % size;
+    bit = i % 64;
+    word = value ? bits[i / 64] : ~bits[i / 64];
+    word >>= bit;
+    if (word)
+      return std::min(to, from + __builtin_ctzll(word));
+    from += 64 - bit;
+  }
+  return to;
+}
+
+/**
+ * run_start returns the first seqno of the run of set bits that ends right
+ * below end, not going lower than low
+ */
+static inline unsigned long run_start(const uint64_t* bits, unsigned long size,
+                                      unsigned long low, unsigned long end) {
+  unsigned long i, bit;
+  uint64_t missing;
+
+  while (end > low) {
+    i = (end - 1) % size;
+    bit = i % 64;
+    // move the bit of end - 1 to the top, the leading ones are the run
+    missing = ~bits[i / 64] << (63 - bit);
+    if (missing)
+      return std::max(low, end - __builtin_clzll(missing));
+    end -= bit + 1;
+  }
+  return low;
+}
+
+/**
+ * collect_sack lists the runs of received seqnos in [from, to)
+ *
+ * As in RFC 2018, the first block is the one holding the most recently
+ * received seqno, the others are the lowest runs, which are the ones the
+ * sender needs to fill the holes in order.
+ *
+ * @param recent the seqno that triggered this ACK
+ * @param out receives at most SACK_MAX_BLOCKS blocks
+ * @return the number of blocks
+ */
+static inline int collect_sack(const uint64_t* bits, unsigned long size,
+                               unsigned long from, unsigned long to,
+                               unsigned long recent, sack_block* out) {
+  unsigned long pos = from, start;
+  int n = 0;
+
+  if (recent >= from && recent < to &&
+      (bits[recent % size / 64] >> (recent % 64) & 1)) {
+    out[0].start = run_start(bits, size, from, recent + 1);
+    out[0].end = find_bit(bits, size, recent, to, false);
+    n = 1;
+  }
+
+  while (n < SACK_MAX_BLOCKS) {
+    start = find_bit(bits, size, pos, to, true);
+    if (start >= to)
+      break;
+    pos = find_bit(bits, size, start, to, false);
+    if (n > 0 && out[0].start == start)
+      continue;
+    out[n].start = start;
+    out[n].end = pos;
+    n++;
+  }
+  return n;
+}
+
+/**
+ * encode_sack serializes the payload of an ACK: the receive window, then
+ * the SACK blocks relative to the cumulative ACK
+ *
+ *  offset  size  field
+ *  0       4     receive window, how many packets from the cumulative ACK
+ *                on the receiver has room for
+ *  4       8n    n SACK blocks, each the start of a run less the ACK and
+ *                the length of the run
+ *
+ * @param window the receive window
+ * @param buf destination, at least ACK_WINDOW_SIZE + SACK_MAX_BLOCKS *
+ *        SACK_BLOCK_SIZE bytes
+ * @return the payload length
+ */
+static inline unsigned int encode_sack(const sack_block* blocks, int n,
+                                       unsigned long ackno, uint32_t window,
+                                       uint8_t* buf) {
+  put_le32(buf, window);
+  buf += ACK_WINDOW_SIZE;
+  for (int i = 0; i < n; i++) {
+    put_le32(buf + i * SACK_BLOCK_SIZE, blocks[i].start - ackno);
+    put_le32(buf + i * SACK_BLOCK_SIZE + 4, blocks[i].end - blocks[i].start);
+  }
+  return ACK_WINDOW_SIZE + n * SACK_BLOCK_SIZE;
+}
+
+/**
+ * decode_sack parses the receive window and the SACK blocks carried by an
+ * ACK
+ *
+ * @param window receives the receive window, left alone if the ACK is too
+ *        short to carry one
+ * @param out receives at most SACK_MAX_BLOCKS blocks
+ * @return the number of blocks
+ */
+static inline int decode_sack(const packet* ack, uint32_t* window,
+                              sack_block* out) {
+  const uint8_t* buf = (const uint8_t*)ack->data;
+  int n;
+
+  if (ack->data_sz < ACK_WINDOW_SIZE)
+    return 0;
+  *window = get_le32(buf);
+  buf += ACK_WINDOW_SIZE;
+  n = std::min((ack->data_sz - ACK_WINDOW_SIZE) / SACK_BLOCK_SIZE,
+               (unsigned)SACK_MAX_BLOCKS);
+  for (int i = 0; i < n; i++) {
+    out[i].start = ack->seqno + get_le32(buf + i * SACK_BLOCK_SIZE);
+    out[i].end = out[i].start + get_le32(buf + i * SACK_BLOCK_SIZE + 4);
+  }
+  return n;
+}
+
+#endif  // MP2_SACK_HPP
@@ -0,0 +1,135 @@
+#ifndef MP2_SCOREBOARD_HPP
+#define MP2_SCOREBOARD_HPP
+
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "sack.hpp"
+
+// Most packets tracked past the window base, this bounds the window.
+// Must be a multiple of 64
+#define SCOREBOARD_SLOTS 65536
+
+/**
+ * scoreboard remembers, for every seqno in flight, whether the receiver
+ * reported it in a SACK block and whether it has been retransmitted during
+ * the current recovery
+ *
+ * Both are circular bitmaps indexed by seqno % SCOREBOARD_SLOTS, so the
+ * holes to retransmit are found a word at a time.
+ */
+class scoreboard {
+ public:
+  scoreboard() : base(0), highest(0), count(0) {
+    sacked = new uint64_t[SCOREBOARD_SLOTS / 64]();
+    resent = new uint64_t[SCOREBOARD_SLOTS / 64]();
+  }
+
+  /**
+   * sack records a block reported by the receiver
+   *
+   * @param block the seqnos held by the receiver, clipped to the window
+   * @param limit one past the highest seqno sent so far
+   */
+  void sack(sack_block block, unsigned long limit) {
+    block.start = std::max(block.start, base);
+    block.end = std::min(block.end, std::min(limit, base + SCOREBOARD_SLOTS));
+    // runs that were already reported are skipped a word at a time
+    for (unsigned long seqno = block.start; seqno < block.end; seqno++) {
+      seqno = find_bit(sacked, SCOREBOARD_SLOTS, seqno, block.end, false);
+      if (seqno == block.end)
+        break;
+      set(sacked, seqno);
+      count++;
+    }
+    if (block.end > block.start)
+      highest = std::max(highest, block.end);
+  }
+
+  /**
+   * start makes seqno the window base of a scoreboard that has not been
+   * used yet
+   */
+  void start(unsigned long seqno) { base = highest = seqno; }
+
+  /**
+   * advance forgets everything below the new cumulative ACK
+   */
+  void advance(unsigned long ackno) {
+    for (; base < ackno; base++) {
+      if (test(sacked, base))
+        count--;
+      clear(sacked, base);
+      clear(resent, base);
+    }
+    highest = std::max(highest, base);
+  }
+
+  /**
+   * next_hole returns the first seqno at or after from that is below the
+   * highest SACKed seqno and has been neither SACKed nor retransmitted
+   *
+   * @return the hole, or highest_sacked() if there is none
+   */
+  unsigned long next_hole(unsigned long from) {
+    from = std::max(from, base);
+    while (from < highest) {
+      from = find_bit(sacked, SCOREBOARD_SLOTS, from, highest, false);
+      if (from < highest && !test(resent, from))
+        return from;
+      from++;
+    }
+    return highest;
+  }
+
+  /**
+   * mark_resent records that a hole has been retransmitted
+   */
+  void mark_resent(unsigned long seqno) { set(resent, seqno); }
+
+  /**
+   * new_recovery lets every hole be retransmitted once more
+   */
+  void new_recovery() {
+    std::fill(resent, resent + SCOREBOARD_SLOTS / 64, 0);
+  }
+
+  bool is_sacked(unsigned long seqno) { return test(sacked, seqno); }
+
+  bool is_resent(unsigned long seqno) { return test(resent, seqno); }
+
+  /**
+   * sacked_count is the number of SACKed seqnos above the window base
+   */
+  unsigned long sacked_count() { return count; }
+
+  /**
+   * highest_sacked is one past the highest SACKed seqno
+   */
+  unsigned long highest_sacked() { return highest; }
+
+  ~scoreboard() {
+    delete[] sacked;
+    delete[] resent;
+  }
+
+ private:
+  bool test(uint64_t* bits, unsigned long seqno) {
+    return bits[seqno % SCOREBOARD_SLOTS / 64] >> (seqno % 64) & 1;
+  }
+
+  void set(uint64_t* bits, unsigned long seqno) {
+    bits[seqno % SCOREBOARD_SLOTS / 64] |= 1ULL << (seqno % 64);
+  }
+
+  void clear(uint64_t* bits, unsigned long seqno) {
+    bits[seqno % SCOREBOARD_SLOTS / 64] &= ~(1ULL << (seqno % 64));
+  }
+
+  unsigned long base, highest, count;
+  uint64_t* sacked;
+  uint64_t* resent;
+};
+
+#endif  // MP2_SCOREBOARD_HPP
@@ -0,0 +1,235 @@
+#ifndef MP2_SEND_BUFFER_HPP
+#define MP2_SEND_BUFFER_HPP
+
+#include <limits.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "crc32c.hpp"
+#include "shared.hpp"
+
+// Number of packets the sender keeps in memory, this bounds the window.
+// Must be a power of two so that seqno % SEND_BUFFER_SLOTS is a mask
+#define SEND_BUFFER_SLOTS 4096
+// How many packets past the window are read from the file in advance
+#define SEND_READ_AHEAD 64
+
+/**
+ * send_buffer streams the file through a fixed pool of packets
+ *
+ * Packet seqno lives in slot seqno % SEND_BUFFER_SLOTS. Slots are read from
+ * the file in order and recycled once the window base moves past them, so
+ * memory use is constant no matter how large the transfer is.
+ *
+ * When built on top of a memory mapping instead, no slots are allocated at
+ * all: the payload of seqno is read straight from the mapping at offset
+ * seqno * chunk, both on first transmission and on retransmission.
+ *
+ * A send_buffer may cover only the packets [first, end) of the file, for a
+ * transfer split across several flows, and ranges of those may be skipped
+ * when the receiver already has them.
+ *
+ * The CRC32C of the packets is computed as they are read from the file,
+ * skipped ones included, and from the mapping once it is asked for. Each
+ * packet of the pool keeps its own, which its checksum on the wire starts
+ * from.
+ */
+class send_buffer {
+ public:
+  // packets [first, second)
+  typedef std::pair<unsigned long, unsigned long> range;
+
+  /**
+   * @param fp the file, positioned at packet first
+   * @param bytes the size of the whole transfer
+   * @param chunk the payload of every packet but the last
+   */
+  send_buffer(FILE* fp, unsigned long long bytes, unsigned int chunk,
+              unsigned long first = 0, unsigned long end = ULONG_MAX)
+      : fp(fp), map(NULL), bytes(bytes), chunk(chunk), first(first),
+        base(first), next(first), full(chunk) {
+    slots = new packet[SEND_BUFFER_SLOTS];
+    packets = std::min((bytes + chunk - 1) / chunk, (unsigned long long)end);
+    remaining = std::min(bytes, (unsigned long long)packets * chunk) -
+                (unsigned long long)first * chunk;
+  }
+
+  /**
+   * @param map a read-only mapping of at least bytes bytes, owned by the caller
+   */
+  send_buffer(const char* map, unsigned long long bytes, unsigned int chunk,
+              unsigned long first = 0, unsigned long end = ULONG_MAX)
+      : fp(NULL), slots(NULL), map(map), bytes(bytes), remaining(0),
+        chunk(chunk), first(first), base(first), full(chunk) {
+    packets = std::min((bytes + chunk - 1) / chunk, (unsigned long long)end);
+    next = packets;
+  }
+
+  /**
+   * skip leaves the packets [from, to) out of the transfer, they are only
+   * read from the file for the digest. Ranges are given in order, before
+   * fill() gets to them
+   */
+  void skip(unsigned long from, unsigned long to) {
+    if (from < to && (skipped.empty() || from >= skipped.back().second))
+      skipped.push_back(std::make_pair(from, to));
+  }
+
+  /**
+   * needed returns the first seqno at or after seqno that is not skipped
+   */
+  unsigned long needed(unsigned long seqno) {
+    // the first range that ends after seqno
+    std::vector<range>::iterator it = std::upper_bound(
+        skipped.begin(), skipped.end(), seqno,
+        [](unsigned long s, const range& r) { return s < r.second; });
+    if (it != skipped.end() && it->first <= seqno)
+      return it->second;
+    return seqno;
+  }
+
+  /**
+   * fill reads packets from the file until every seqno below upto is
+   * available, as far as the pool allows
+   *
+   * @param upto one past the last seqno that is needed
+   */
+  void fill(unsigned long upto) {
+    if (map)
+      return;
+
+    upto = std::min(upto, limit());
+    while (next < upto) {
+      if (needed(next) != next) {
+        read_through(std::min(needed(next), packets));
+        upto = std::min(upto, packets);
+        continue;
+      }
+      packet* p = &slots[next % SEND_BUFFER_SLOTS];
+      p->seqno = next;
+      p->clear_type();
+      if (p->populate(fp, std::min(remaining, (unsigned long long)chunk)) <=
+          0) {
+        // the file is shorter than announced, end the transfer here
+        packets = next;
+        break;
+      }
+      remaining -= p->data_sz;
+      p->crc = crc32c(0, p->data, p->data_sz);
+      p->has_crc = true;
+      hash.append(p->crc, p->data_sz, full);
+      next++;
+    }
+  }
+
+  /**
+   * digest returns the CRC32C of every packet of the buffer, whatever
+   * fill() has not read yet is read for it
+   */
+  const crc32c_stream& digest() {
+    if (map == NULL)
+      read_through(packets);
+    else if (hash.bytes == 0)
+      hash.update(map + (unsigned long long)first * chunk,
+                  std::min(bytes, (unsigned long long)packets * chunk) -
+                      (unsigned long long)first * chunk);
+    return hash;
+  }
+
+  /**
+   * release recycles the slots of every seqno below base
+   *
+   * @param base the first seqno that may still be retransmitted
+   */
+  void release(unsigned long base) { this->base = std::max(this->base, base); }
+
+  /**
+   * payload returns the data of a seqno that has been filled and not released
+   */
+  const char* payload(unsigned long seqno) {
+    if (map)
+      return map + seqno * chunk;
+    return slots[seqno % SEND_BUFFER_SLOTS].data;
+  }
+
+  /**
+   * size returns the payload length of a seqno that has been filled
+   */
+  unsigned int size(unsigned long seqno) {
+    if (map)
+      return std::min(bytes - seqno * chunk, (unsigned long long)chunk);
+    return slots[seqno % SEND_BUFFER_SLOTS].data_sz;
+  }
+
+  /**
+   * crc returns the CRC32C of the payload of a seqno that has been filled,
+   * NULL when sending out of a mapping
+   */
+  const uint32_t* crc(unsigned long seqno) {
+    if (map)
+      return NULL;
+    return &slots[seqno % SEND_BUFFER_SLOTS].crc;
+  }
+
+  /**
+   * available tells whether seqno is currently held in the pool
+   */
+  bool available(unsigned long seqno) {
+    return seqno >= base && seqno < next;
+  }
+
+  /**
+   * limit is one past the highest seqno that fits in the pool right now
+   */
+  unsigned long limit() {
+    if (map)
+      return packets;
+    return std::min(packets, base + SEND_BUFFER_SLOTS);
+  }
+
+  /**
+   * total is one past the last seqno of the transfer
+   */
+  unsigned long total() { return packets; }
+
+  ~send_buffer() { delete[] slots; }
+
+ private:
+  /**
+   * read_through reads the packets up to upto only for the digest, they
+   * are not kept
+   */
+  void read_through(unsigned long upto) {
+    char buf[MAX_PACKET_SIZE];
+    size_t n;
+
+    for (; next < upto; next++) {
+      n = fread(buf, 1, std::min(remaining, (unsigned long long)chunk), fp);
+      if (n == 0) {
+        packets = next;
+        break;
+      }
+      remaining -= n;
+      hash.update(buf, n);
+    }
+  }
+
+  FILE* fp;
+  packet* slots;
+  const char* map;
+  unsigned long long bytes, remaining;
+  unsigned int chunk;
+  unsigned long packets;
+  unsigned long first, base, next;
+  crc32c_stream hash;
+  // appends the CRC32C of a full packet
+  const crc32c_span full;
+  // ranges left out by skip(), in order
+  std::vector<range> skipped;
+};
+
+#endif  // MP2_SEND_BUFFER_HPP
@@ -1,98 +1,107 @@
 #ifndef SENDER_HPP
 #define SENDER_HPP
 
-#include <functional>
-#include <queue>
-#include <vector>
-
-#include "shared.hpp"
-
-// Default Slow Start Threshold
-#define DEFAULT_SS_THRESH 64
-// Default Congestion Window Size
-#define DEFAULT_CWND 1
-#define CWND_DECEMAL 1000
-// Default Duplicate Acknowledgement Limit
-#define DUP_ACK_LIMIT 3
-// Default timeout value in seconds
-#define TIMEOUT 0
-#define TIMEOUT_USEC 500000
-
-#define SS 1
-#define CA 2
-#define FR 3
-#define NIGGER 69
+#include <mutex>
+
+#include "batch.hpp"
+#include "congestion.hpp"
+#include "fec.hpp"
+#include "handshake.hpp"
+#include "rtt.hpp"
+#include "send_buffer.hpp"
+#include "sender_flow.hpp"
+#include "telemetry.hpp"
+#include "wire.hpp"
+
+// Datagrams queued before a sendmmsg, room for a few full GSO messages
+#define SEND_BATCH 256
+// Resume requests sent before the receiver is taken not to answer them
+#define RESUME_TRIES 5
+// Copies of every probe, so that a random loss rarely passes for a smaller
+// path MTU
+#define PROBE_COPIES 2
+
+// Send out of a memory mapping of the file instead of a packet pool
+bool use_mmap = false;
+// Ask the receiver which packets it kept from an earlier run, and skip them
+bool resume = false;
+// Connection ID of the transfer, shared by every flow, random unless it is
+// given with -i
+uint32_t session_id = 0;
+bool session_given = false;
+// Let the kernel segment runs of datagrams (UDP GSO) when it can
+bool use_offload = true;
+// Lower bound of the retransmission timeout, in microseconds
+uint32_t min_rto = RTO_MIN_USEC;
+// Highest pacing rate of the whole transfer in Mbit/s of payload as given
+// with -m, and in packets per second once the payload is known, 0 for no
+// cap
+double max_mbps = 0;
+double max_rate = 0;
+// Largest payload offered in the handshake, -p, the path may take less
+unsigned int max_payload = MAX_PACKET_SIZE;
+// Initial window asked for in the handshake, -w
+unsigned int initial_window = DEFAULT_CWND;
+// What the handshake settled on, for every flow, and the round trip time
+// it measured, the first RTT sample of every flow
+handshake agreed;
+uint32_t handshake_rtt = 0;
+// Congestion controller of every flow, picked with -c
+const char* cc_name = "reno";
+// Number of flows the file is split into, picked with -f
+unsigned int flows = 1;
+// Parity sent with -e: FEC_NONE, FEC_XOR or FEC_RS, data packets per group,
+// parity packets per group and whether that follows the retransmissions
+int fec_code = FEC_NONE;
+unsigned int fec_k = 0, fec_m = 0;
+bool fec_adaptive = false;
+// Serializes the statistics the flows print at the end
+std::mutex stats_lock;
+// CRC32C of the range of every flow, combined into that of the file once
+// they are done, and whether the receiver disagreed about any of them
+crc32c_stream digests[MAX_FLOWS];
+bool damaged = false;
+// Writes the events of every flow to the file given with -t, if any
+tracer* tracing = NULL;
+// The tree sent when the file is a directory, NULL for a single file
+batch_manifest* manifest = NULL;
+
+// Every flow runs on its own thread with its own socket and its own copy
+// of everything below
 
 // Socket fields
-struct sockaddr_in si_other;
-int s;
-socklen_t slen;
-FILE* fp = NULL;
-
-// Congestion control fields
-unsigned int dup_ack_count = 0;
-unsigned long dup_ack_no = -1;
-unsigned long seq_no = 0;
-// Multiple by 1000 to avoid floating point arithmetic,
-// Divide by 1000 when using the value
-unsigned int cwnd_size = DEFAULT_CWND * CWND_DECEMAL;
-unsigned int ss_thresh = DEFAULT_SS_THRESH;
-unsigned long long int remaining_bytes = 0;
-std::priority_queue<packet*, std::vector<packet*>, PacketComparator> cwnd;
-
-unsigned int get_cwnd_size() {
-  return cwnd_size / CWND_DECEMAL;
-}
-
-void set_cwnd_size(unsigned int size) {
-  cwnd_size = size * CWND_DECEMAL;
-}
-
-void increase_cwnd_size() {
-  // Fast Recovery mode
-  if (dup_ack_count > DUP_ACK_LIMIT) {
-    cwnd_size += CWND_DECEMAL;
-    return;
-  }
-
-  // Slow Start mode
-  if (get_cwnd_size() < ss_thresh * CWND_DECEMAL) {
-    cwnd_size += CWND_DECEMAL;
-  } else {
-    // Congestion Avoidance mode
-    cwnd_size += CWND_DECEMAL / cwnd_size;
-  }
-}
+thread_local struct sockaddr_in si_other;
+thread_local int s;
+thread_local socklen_t slen;
 
-// Statistic fields
-unsigned int total_packets, packets_acked;
+// Transfer state
+// the first seqno of the flow's range, which also identifies the flow
+thread_local unsigned long flow_id;
+thread_local send_buffer* packets;
+thread_local rtt_estimator* rtt;
 
 /**
- * update_cwnd updates the congestion window size based on the ackno
- * 
- * When an ackno is received, the congestion window size is updated based on the ackno
- *
- * - Slow Start:
- *  -# On new ack, cwnd.size() + 1
- *  -# Once the cwnd.size() size reaches ss_thresh, goto Congestion Avoidance
- *  -# On dup ack, the duplicate ack count is incremented
- *  -# Once the dup_ack_count reaches DUP_ACK_LIMIT, goto Fast Recovery, transmit the missing packet if allowed
- * 
- * - Congestion Avoidance:
- *  -# On new ack, cwnd.size() + 1 / cwnd.size()
- *  -# On dup ack, the duplicate ack count is incremented
- *  -# Once the dup_ack_count reaches DUP_ACK_LIMIT, goto Fast Recovery, transmit the missing packet if allowed
- *  -# On timeout, ss_thresh is set to cwnd.size() / 2 and cwnd.resize(1)
- * 
- * - Fast Recovery:
- *  -# On new ack, cwnd.resize(ss_thresh)
- *  -# On dup ack, cwnd.size() + 1
- *  -# Transmit the missing packet if allowed
- * 
- * @param ackno the ackno to update the cwnd.size() size
- * @return true if need to retransmit the missing packet
+ * socket_link sends the datagrams of a flow to the receiver in batches,
+ * on the flow's socket, and tells the time by the monotonic clock
  */
-bool update_cwnd(unsigned int ackno);
+class socket_link : public sender_link {
+ public:
+  socket_link(wire_send_batch* batch) : batch(batch) {}
+
+  uint64_t now() { return monotonic_usec(); }
+
+  void send(unsigned int type, unsigned long seqno, const void* data,
+            unsigned int length, uint32_t timestamp,
+            const uint32_t* payload_crc) {
+    batch->add(type, seqno, data, length, (struct sockaddr*)&si_other, slen,
+               timestamp, flow_id, session_id, payload_crc);
+  }
+
+  int flush() { return batch->flush(); }
+
+ private:
+  wire_send_batch* batch;
+};
 
 /**
  * setup_socket sets up the socket for the sender
@@ -102,13 +111,102 @@ bool update_cwnd(unsigned int ackno);
  */
 void setup_socket(char* hostname, unsigned short int hostUDPport);
 
+/**
+ * map_file maps the first bytes of a regular file read-only
+ *
+ * @param file the file to map
+ * @param bytes the number of bytes to map, clamped to the size of the file
+ * @return the mapping, or NULL if the file cannot be mapped
+ */
+const char* map_file(FILE* file, unsigned long long* bytes);
+
+/**
+ * open_source opens what is sent: the file, or the stream of the batch
+ * when it is a directory
+ *
+ * @return NULL if the file cannot be opened
+ */
+FILE* open_source(const char* filename);
+
+/**
+ * probe_path finds the largest payload that gets to the receiver and back,
+ * see handshake.hpp
+ *
+ * @param rtt receives the round trip time of the first answer
+ * @return the payload, at most max_payload, or 0 if nothing was answered
+ */
+unsigned int probe_path(uint32_t* rtt);
+
+/**
+ * open_transfer probes the path and sends the SYN of the transfer, the
+ * receiver's answer is left in agreed
+ *
+ * @param bytes the size of the file
+ * @return false if the receiver did not answer
+ */
+bool open_transfer(unsigned long long bytes);
+
+/**
+ * ask_resume asks the receiver which packets of the flow [first, end) it
+ * kept from an earlier run, and leaves them out of the send buffer
+ *
+ * @return the number of packets left out
+ */
+unsigned long ask_resume(unsigned long first, unsigned long end);
+
+/**
+ * wait_ack waits for the next packet from the receiver
+ *
+ * @param p receives the packet
+ * @param timeout_usec how long to wait at most
+ * @return the datagram size, 0 if it was malformed, or -1 with errno set to
+ *         EAGAIN on timeout
+ */
+int wait_ack(packet* p, uint32_t timeout_usec);
+
+/**
+ * set_timer arms a timerfd at an absolute monotonic time
+ *
+ * @param fd the timerfd
+ * @param when the time in microseconds, 0 disarms the timer
+ * @param armed the time the timer is set to, the syscall is skipped when
+ *        it does not change
+ */
+void set_timer(int fd, uint64_t when, uint64_t* armed);
+
 /** 
  * finish_transfer sends the FIN packet to the receiver to signal the end of the transfer
+ *
+ * The FIN carries the CRC32C of the flow, the receiver answers with the
+ * one it computed over what it wrote.
+ *
+ * @param seqno the seqno of the FIN, one past the last data packet
+ * @param timeout_usec how long to wait for the receiver's FIN after each try
+ * @param crc the CRC32C of the flow
+ * @param theirs receives the receiver's CRC32C of the flow
+ * @return whether the receiver answered with its CRC32C
+ */
+bool finish_transfer(unsigned long seqno, uint32_t timeout_usec, uint32_t crc,
+                     uint32_t* theirs);
+
+/**
+ * transfer_flow sends the packets [first, end) of the file as one flow,
+ * with its own socket and congestion state
+ *
+ * @param index the flow's slot in digests
+ * @param map the mapping of the file, or NULL to read it through a pool
+ * @param bytes the size of the whole transfer
  */
-void finish_transfer();
+void transfer_flow(unsigned int index, char* hostname,
+                   unsigned short int hostUDPport, char* filename,
+                   const char* map, unsigned long long bytes,
+                   unsigned long first, unsigned long end);
 
 /**
  * reliablyTransfer transfer the first bytesToTransfer bytes of filename to the receiver at hostname: hostUDPport, even if the network drops or reorders some of your packets.
+ *
+ * The transfer is opened with a handshake, then the file is split into
+ * `flows` contiguous ranges, each sent by transfer_flow on its own thread.
  * 
  * @param hostname the hostname of the receiver
  * @param hostUDPport the UDP port of the receiver
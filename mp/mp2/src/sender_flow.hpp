@@ -0,0 +1,528 @@
+#ifndef MP2_SENDER_FLOW_HPP
+#define MP2_SENDER_FLOW_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <queue>
+#include <vector>
+
+#include "bbr.hpp"
+#include "congestion.hpp"
+#include "cubic.hpp"
+#include "fec.hpp"
+#include "pacer.hpp"
+#include "reno.hpp"
+#include "rtt.hpp"
+#include "sack.hpp"
+#include "scoreboard.hpp"
+#include "send_buffer.hpp"
+#include "telemetry.hpp"
+#include "timer_wheel.hpp"
+
+// Default Duplicate Acknowledgement Limit
+#define DUP_ACK_LIMIT 3
+// Pacing rate relative to cwnd / SRTT, the headroom lets the window grow
+#define PACE_GAIN 1.25
+
+/**
+ * make_congestion_control creates the controller called name
+ *
+ * @param name reno, cubic or bbr
+ * @param initial the initial window in packets
+ * @return the controller, or NULL if there is none by that name
+ */
+static inline congestion_control* make_congestion_control(
+    const char* name, double initial = DEFAULT_CWND) {
+  if (strcmp(name, "reno") == 0)
+    return new reno(initial);
+  if (strcmp(name, "cubic") == 0)
+    return new cubic(initial);
+  if (strcmp(name, "bbr") == 0)
+    return new bbr(initial);
+  return NULL;
+}
+
+/**
+ * sender_link is where the datagrams of a sender_flow go and where its
+ * time comes from: a socket and the monotonic clock in reliable_sender, a
+ * simulated path and virtual time in transfer_sim
+ */
+class sender_link {
+ public:
+  virtual ~sender_link() {}
+
+  /**
+   * now is the current time in microseconds
+   */
+  virtual uint64_t now() = 0;
+
+  /**
+   * send queues one datagram of the flow, see wire_send
+   *
+   * @param payload_crc the CRC32C of the payload if it is known
+   */
+  virtual void send(unsigned int type, unsigned long seqno, const void* data,
+                    unsigned int length, uint32_t timestamp,
+                    const uint32_t* payload_crc) = 0;
+
+  /**
+   * flush sends what is queued
+   *
+   * @return < 0 on failure
+   */
+  virtual int flush() = 0;
+};
+
+/**
+ * sender_flow is the sending side of one flow without its sockets: the
+ * window, loss detection and recovery, retransmission deadlines and
+ * pacing, driven by ACKs and the time
+ *
+ * The owner feeds it every ACK of the flow through on_ack(), calls
+ * on_timer() once rto_deadline() passes and send_window() after either,
+ * or when pace_deadline() passes. The flow is done once every packet of
+ * packets is acknowledged.
+ */
+class sender_flow {
+ public:
+  /**
+   * @param link where the datagrams go
+   * @param packets the packets of the flow, owned by the caller
+   * @param cc the congestion controller, owned by the caller
+   * @param rtt the RTT estimator, owned by the caller
+   * @param fec the parity encoder, NULL without FEC, owned by the caller
+   * @param payload the payload of a full packet, and of a parity packet
+   * @param max_rate highest pacing rate of the flow in packets per second,
+   *        0 for no cap
+   * @param first the first seqno of the flow that is sent
+   */
+  sender_flow(sender_link* link, send_buffer* packets, congestion_control* cc,
+              rtt_estimator* rtt, fec_encoder* fec, unsigned int payload,
+              double max_rate, unsigned long first)
+      : ring(NULL), link(link), packets(packets), cc(cc), rtt(rtt), fec(fec),
+        payload(payload), max_rate(max_rate), paced(false), dupAck(0),
+        cw_base(first), last_ack(first), recovering(false), next_send(first),
+        high_sent(first), recover(first), rwnd_edge(0), rto_recovery(false),
+        traced_cwnd(0) {
+    // every key the wheel holds is a seqno of the flow
+    timers = new timer_wheel(
+        std::max(1UL, std::min((unsigned long)SCOREBOARD_SLOTS,
+                               packets->total() - first)),
+        link->now());
+    board.start(first);
+    summary.start(link->now());
+    update_state();
+  }
+
+  /**
+   * done tells whether every packet of the flow was acknowledged
+   */
+  bool done() { return cw_base >= packets->total(); }
+
+  /**
+   * acked is the cumulative ACK of the flow, every seqno below it is
+   * acknowledged
+   */
+  unsigned long acked() { return cw_base; }
+
+  /**
+   * send_window sends whatever the window and the pacer allow, queued
+   * retransmissions first and then new data, and arms their retransmission
+   * deadlines
+   *
+   * @return < 0 if the link failed to send
+   */
+  int send_window() {
+    uint64_t now = link->now();
+    uint64_t deadline = now + rtt->timeout();
+    double cw = cc->cwnd();
+    //what is in flight is capped by both cwnd and the receiver's window
+    double edge = cw_base + cw;
+
+    if (rwnd_edge > 0 && rwnd_edge < edge)
+      edge = rwnd_edge;
+
+    pacer.set_rate(pacing_rate(), now);
+    packets->release(cw_base);
+    packets->fill(cw_base + cw + SEND_READ_AHEAD);
+    paced = false;
+
+    //special resends, they go first as the receiver is waiting for them,
+    //unless a SACK covered them since they were queued
+    while(!specialResends.empty()) {
+      unsigned long si = specialResends.front();
+      if (packets->available(si) && !board.is_sacked(si)) {
+        if ((paced = !pacer.take(now)))
+          break;
+        queue_data(si, true);
+        timers->arm(si, deadline);
+      }
+      specialResends.pop();
+    }
+
+    //make any transmissions that are necessary, the newly opened part of
+    //the window goes out in as few sendmmsg calls as the pacer allows
+    //packets the receiver already holds are skipped, and so is everything
+    //below cw_base
+    for (next_send = packets->needed(std::max(next_send, cw_base));
+         !paced && next_send < edge && next_send < packets->limit() &&
+         next_send < cw_base + SCOREBOARD_SLOTS;
+         next_send = packets->needed(next_send + 1)) {
+      if (board.is_sacked(next_send))
+        continue;
+      if ((paced = !pacer.take(now)))
+        break;
+      queue_data(next_send, next_send < high_sent);
+      timers->arm(next_send, deadline);
+      if (fec && next_send >= high_sent)
+        queue_parity(next_send);
+    }
+    high_sent = std::max(high_sent, next_send);
+    if (!paced && next_send >= edge && edge < cw_base + cw &&
+        next_send < packets->limit())
+      summary.on_window_limited();
+
+    return link->flush();
+  }
+
+  /**
+   * on_ack updates the scoreboard and the RTT estimate from one ACK,
+   * detects losses and reports all of it to the congestion controller
+   *
+   * @param incomingPkt the ACK
+   */
+  void on_ack(const packet* incomingPkt) {
+    sack_block sack[SACK_MAX_BLOCKS];
+    ack_sample sample;
+    unsigned long delivered = cw_base + board.sacked_count();
+    //a window update answers no packet, it is neither a sample nor a dup
+    bool update = incomingPkt->has_type(PACKET_TYPE_PROBE);
+    uint32_t window = 0;
+
+    //Karn's rule: ACKs triggered by retransmissions are not sampled
+    sample.rtt = 0;
+    if (!incomingPkt->has_type(PACKET_TYPE_RETX) && !update) {
+      sample.rtt = (uint32_t)link->now() - incomingPkt->timestamp;
+      rtt->sample(sample.rtt);
+      trace(TRACE_RTT, incomingPkt->seqno, sample.rtt);
+    }
+
+    bool newAck = incomingPkt->seqno > last_ack;
+    bool dup = incomingPkt->seqno == last_ack && !update;
+    uint64_t ackedPkts = newAck ? incomingPkt->seqno - last_ack : 0;
+
+    last_ack = last_ack > incomingPkt->seqno ? last_ack : incomingPkt->seqno;
+    //acknowledged packets no longer need a retransmission deadline
+    for (; cw_base < last_ack; cw_base++)
+      timers->cancel(cw_base);
+    //after a timeout the ACK may jump past the packets being sent again
+    next_send = std::max(next_send, cw_base);
+
+    //update the scoreboard with what the receiver holds above cw_base
+    board.advance(cw_base);
+    int blocks = decode_sack(incomingPkt, &window, sack);
+    for (int i = 0; i < blocks; i++)
+      board.sack(sack[i], high_sent);
+    //the receiver never takes back room it advertised, a late ACK carries
+    //an older edge
+    if (incomingPkt->seqno + window > rwnd_edge) {
+      rwnd_edge = incomingPkt->seqno + window;
+      trace(TRACE_RWND, incomingPkt->seqno, window);
+    }
+
+    sample.acked = ackedPkts;
+    sample.delivered = cw_base + board.sacked_count() - delivered;
+    //the ACK may cover more than was sent this run, after a resume
+    sample.in_flight = std::max(
+        0L, (long)high_sent - (long)cw_base - (long)board.sacked_count());
+    sample.srtt = rtt->smoothed();
+    sample.now = link->now();
+    sample.in_recovery = recovering;
+
+    if (newAck) {
+      dupAck = 0;
+      rto_recovery = false;
+      trace(TRACE_ACK, last_ack, sample.in_flight);
+      cc->on_ack(sample);
+      if (recovering && cw_base >= recover) {
+        recovering = false;
+        cc->on_recovery();
+      }
+      //partial ack, more holes are left below recover
+      else if (recovering && !repairable(cw_base)) {
+        board.mark_resent(cw_base);
+        specialResends.push(cw_base);
+      }
+    }
+    else if (dup) {
+      dupAck++;
+      trace(TRACE_DUPACK, last_ack, dupAck);
+      cc->on_dupack(sample);
+      //with FEC, a hole is only taken for lost once the receiver got past
+      //the parity of its group and still reports it
+      if (!recovering && dupAck >= DUP_ACK_LIMIT && !repairable(cw_base)) {
+        cc->on_loss(sample);
+        //retry cw_base, then the holes the SACK blocks point at
+        board.new_recovery();
+        board.mark_resent(cw_base);
+        specialResends.push(cw_base);
+        recover = high_sent;
+        recovering = true;
+      }
+    }
+
+    //every ack in recovery retransmits the next holes, as many as the
+    //packets that left the network allow
+    if (recovering) {
+      long pipe = sample.in_flight;
+      queue_holes(cw_base, std::max(1L, (long)cc->cwnd() - pipe));
+    }
+
+    update_state();
+  }
+
+  /**
+   * on_timer handles the retransmission deadlines that passed
+   *
+   * A deadline of a hole during fast recovery only retransmits that hole,
+   * any other deadline is a retransmission timeout.
+   */
+  void on_timer() {
+    bool rto = false;
+
+    expired.clear();
+    timers->expire(link->now(), &expired);
+    for (size_t i = 0; i < expired.size(); i++) {
+      unsigned long seqno = expired[i];
+      //SACKed packets are not cancelled, they are skipped here
+      if (seqno < cw_base || board.is_sacked(seqno))
+        continue;
+      //during recovery, a hole that packets after it got past and that
+      //has not been retransmitted yet is lost, it is resent without a
+      //timeout
+      if (recovering && seqno < board.highest_sacked() &&
+          !board.is_resent(seqno)) {
+        board.mark_resent(seqno);
+        specialResends.push(seqno);
+        continue;
+      }
+      rto = true;
+    }
+    if (rto)
+      on_timeout();
+  }
+
+  /**
+   * rto_deadline is the first retransmission deadline
+   *
+   * @return false if nothing is in flight
+   */
+  bool rto_deadline(uint64_t* when) { return timers->next_expiry(when); }
+
+  /**
+   * pace_deadline is when the pacer lets the part of the window it held
+   * back in the last send_window() go, 0 if it held nothing back
+   */
+  uint64_t pace_deadline() { return paced ? pacer.next_token() : 0; }
+
+  /**
+   * finish stops the clock of the summary once every packet is
+   * acknowledged
+   */
+  void finish() { summary.finish(link->now()); }
+
+  /**
+   * print_stats prints what the estimators, the pacer and the parity
+   * encoder counted
+   */
+  void print_stats() {
+    rtt->print_stats();
+    cc->print_stats();
+    pacer.print_stats(link->now());
+    if (fec)
+      fec->print_stats();
+  }
+
+  ~sender_flow() { delete timers; }
+
+  // Events of this flow, NULL when the transfer is not traced
+  trace_ring* ring;
+  transfer_summary summary;
+
+ private:
+  /**
+   * trace records an event of this flow if the transfer is traced, see
+   * trace_type for the meaning of seqno and value
+   */
+  void trace(uint32_t type, uint64_t seqno, double value) {
+    if (ring)
+      ring->record(type, seqno, value);
+  }
+
+  /**
+   * queue_data queues the data packet seqno for the next send, stamped
+   * with the current time
+   *
+   * @param retransmit whether seqno has been sent before
+   */
+  void queue_data(unsigned long seqno, bool retransmit) {
+    link->send(PACKET_TYPE_DATA | (retransmit ? PACKET_TYPE_RETX : 0), seqno,
+               packets->payload(seqno), packets->size(seqno),
+               (uint32_t)link->now(), packets->crc(seqno));
+    summary.on_send(retransmit);
+    trace(retransmit ? TRACE_RETRANSMIT : TRACE_SEND, seqno, 0);
+  }
+
+  /**
+   * queue_parity folds a data packet that was just queued for the first
+   * time into its FEC group, and queues the parity behind it once the
+   * group is complete
+   */
+  void queue_parity(unsigned long seqno) {
+    unsigned int n = fec->add(seqno, packets->payload(seqno),
+                              packets->size(seqno), summary.retransmitted());
+
+    // parity is paced like data, but it goes out with the packet that
+    // completes its group even if that leaves the bucket in debt
+    pacer.charge(n);
+    for (unsigned int i = 0; i < n; i++)
+      link->send(PACKET_TYPE_PARITY, fec->group_start(), fec->parity(i),
+                 payload, fec->descriptor(i), NULL);
+  }
+
+  /**
+   * repairable tells whether the parity of the group of seqno may still
+   * rebuild it: the parity is out or the window lets it go out, and the
+   * receiver has not reported DUP_ACK_LIMIT packets past it yet
+   */
+  bool repairable(unsigned long seqno) {
+    unsigned long end;
+
+    if (fec == NULL || (end = fec->repair_point(seqno)) == seqno)
+      return false;
+    //parity that the window keeps from going out cannot rebuild anything
+    if (high_sent < end && end > cw_base + cc->cwnd())
+      return false;
+    return board.highest_sacked() <
+           std::min(end + DUP_ACK_LIMIT, packets->total());
+  }
+
+  /**
+   * queue_holes queues retransmissions for the holes the receiver
+   * reported, each hole at most once per recovery, and none that parity
+   * may still rebuild
+   *
+   * @param from the first seqno to consider
+   * @param budget the most holes to queue
+   * @return the number of holes queued
+   */
+  int queue_holes(unsigned long from, long budget) {
+    unsigned long hole = from;
+    int queued = 0;
+
+    for (; queued < budget; queued++) {
+      hole = board.next_hole(hole);
+      //packets the receiver kept from an earlier run are not holes
+      while (hole < board.highest_sacked() && packets->needed(hole) != hole)
+        hole = board.next_hole(packets->needed(hole));
+      if (hole >= board.highest_sacked() || repairable(hole))
+        break;
+      board.mark_resent(hole);
+      specialResends.push(hole);
+    }
+    return queued;
+  }
+
+  /**
+   * pacing_rate is the rate send_window() spaces packets at, the one the
+   * congestion controller asks for or else PACE_GAIN * cwnd / SRTT, capped
+   * at max_rate
+   *
+   * @return packets per second, 0 to send unpaced
+   */
+  double pacing_rate() {
+    double rate = cc->pacing_rate();
+
+    if (rate == 0 && rtt->smoothed() > 0)
+      rate = PACE_GAIN * cc->cwnd() * 1e6 / rtt->smoothed();
+    if (max_rate > 0 && (rate == 0 || rate > max_rate))
+      rate = max_rate;
+    return rate;
+  }
+
+  /**
+   * on_timeout goes back to cw_base after a retransmission timeout
+   */
+  void on_timeout() {
+    cc->on_timeout(link->now());
+    dupAck = 0;
+    recovering = false;
+    //go back to cw_base, everything that is sent again is armed again
+    next_send = cw_base;
+    board.new_recovery();
+    timers->clear();
+    rtt->backoff();
+    rto_recovery = true;
+    trace(TRACE_TIMEOUT, cw_base, rtt->timeout());
+    update_state();
+  }
+
+  /**
+   * update_state works out the Reno state of the sender after an event,
+   * and keeps the summary and the trace up to date with it and with the
+   * window
+   */
+  void update_state() {
+    int state = rto_recovery ? STATE_RTO
+                : recovering ? STATE_FAST_RECOVERY
+                : cc->in_slow_start() ? STATE_SLOW_START
+                                      : STATE_CONGESTION_AVOIDANCE;
+    double cw = cc->cwnd();
+
+    if (summary.set_state(state, link->now()))
+      trace(TRACE_STATE, cw_base, state);
+    if (cw != traced_cwnd) {
+      traced_cwnd = cw;
+      trace(TRACE_CWND, cw_base, cw);
+    }
+  }
+
+  sender_link* link;
+  send_buffer* packets;
+  congestion_control* cc;
+  rtt_estimator* rtt;
+  fec_encoder* fec;
+  unsigned int payload;
+  double max_rate;
+  // Retransmission deadline of every packet in flight, keyed by seqno
+  timer_wheel* timers;
+  std::vector<unsigned long> expired;
+  // Spaces packets out at the pacing rate
+  token_bucket pacer;
+  // whether the pacer held back part of the window in the last
+  // send_window()
+  bool paced;
+  scoreboard board;
+  std::queue<unsigned long> specialResends;
+  uint32_t dupAck;
+  uint64_t cw_base;
+  uint64_t last_ack;
+  // fast recovery, from the third dup ack until recover is acked
+  bool recovering;
+  uint64_t next_send;
+  // one past the highest seqno ever sent, and its value when fast recovery
+  // started
+  uint64_t high_sent;
+  uint64_t recover;
+  // one past the highest seqno the receiver has room for, from the window
+  // of its ACKs, 0 until the first one
+  uint64_t rwnd_edge;
+  // from a retransmission timeout until new data is acknowledged
+  bool rto_recovery;
+  // last window traced, changes are traced as they happen
+  double traced_cwnd;
+};
+
+#endif  // MP2_SENDER_FLOW_HPP
@@ -13,52 +13,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <cmath>
-#include <chrono>
 
 #include <algorithm>
-#include <iostream>
+#include <random>
+#include <thread>
 
 #include "sender.hpp"
 
-bool update_cwnd(unsigned int ackno) {
-  bool resend = false;
-  packet container = packet(ackno);
-
-  if (ackno == dup_ack_no) {
-    dup_ack_count++;
-
-    // goto Fast Recovery
-    if (dup_ack_count == DUP_ACK_LIMIT) {
-      ss_thresh = get_cwnd_size() / 2;
-      set_cwnd_size(ss_thresh + 3);
-      resend = true;
-    }
-
-    // already in Fast Recovery
-    if (dup_ack_count > DUP_ACK_LIMIT) {
-      increase_cwnd_size();
-      resend = true;
-    }
-  } else {
-    if (!cwnd.empty() && *cwnd.top() == container) {
-      dup_ack_count = 1;
-      dup_ack_no = ackno;
-    } else if (cwnd.empty() || *cwnd.top() < container) {
-      increase_cwnd_size();
-    }
-  }
-
-  return resend;
-}
-
 void setup_socket(char* hostname, unsigned short int hostUDPport) {
-  struct timeval timeout;
   slen = sizeof(si_other);
 
   if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
@@ -69,343 +41,514 @@ void setup_socket(char* hostname, unsigned short int hostUDPport) {
   si_other.sin_port = htons(hostUDPport);
   if (inet_aton(hostname, &si_other.sin_addr) < 0)
     diep((char*)"inet_aton()");
+}
 
-  timeout.tv_sec = TIMEOUT;
-  timeout.tv_usec = TIMEOUT_USEC;
-  if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
-    diep((char*)"setsockopt()");
+int wait_ack(packet* p, uint32_t timeout_usec) {
+  struct pollfd pfd;
+  int bytes;
+
+  // only sleep in poll when nothing is queued yet
+  bytes = wire_recv_into(s, p, p->data, MAX_PACKET_SIZE, NULL, NULL,
+                         MSG_DONTWAIT);
+  if (bytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    return bytes;
+
+  pfd.fd = s;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, (timeout_usec + 999) / 1000) <= 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return wire_recv(s, p, NULL, NULL);
 }
 
-void fillVector(std::vector<packet*> &packets, unsigned long long bytesToSend,
-  FILE* file) {
-  int seqNum = 0;
-  while (bytesToSend > 0) {
-    packet* curr = new packet(seqNum);
-    ssize_t read_bytes = curr->populate(file, std::min(bytesToSend, (unsigned long long) MAX_PACKET_SIZE));
+const char* map_file(FILE* file, unsigned long long* bytes) {
+  struct stat st;
+  void* map;
 
-    if(read_bytes <= 0) {
-      delete curr;
-      break;
-    }
+  if (fstat(fileno(file), &st) < 0 || !S_ISREG(st.st_mode))
+    return NULL;
 
-    bytesToSend -= read_bytes;
-    packets.push_back(curr);
-    seqNum++;
+  *bytes = std::min(*bytes, (unsigned long long)st.st_size);
+  if (*bytes == 0)
+    return NULL;
+
+  map = mmap(NULL, *bytes, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
   }
+  madvise(map, *bytes, MADV_SEQUENTIAL);
+  return (const char*)map;
+}
 
+FILE* open_source(const char* filename) {
+  if (manifest)
+    return manifest->open_stream();
+  return fopen(filename, "rb");
 }
 
-void fill_cwnd() {
-  packet* snd_packet;
-  ssize_t snd_bytes, read_bytes;
-  int packets_sent = 0;
-
-  while (cwnd.size() < get_cwnd_size() && remaining_bytes > 0) {
-    snd_packet = new packet(seq_no);
-    read_bytes = snd_packet->populate(
-        fp, std::min(remaining_bytes, (unsigned long long int)MAX_PACKET_SIZE));
-    if (read_bytes <= 0) {
-      delete snd_packet;
-      break;
+unsigned int probe_path(uint32_t* rtt) {
+  static const char zeros[MAX_PACKET_SIZE] = {0};
+  unsigned int sizes[PROBE_SIZES + 1], n = 0, best = 0, largest, i, c;
+  uint64_t start, deadline, now;
+  uint32_t stamp;
+  int tries, dont = IP_PMTUDISC_DO;
+  packet reply;
+
+  // the largest payload allowed, then every smaller one of probe_sizes
+  sizes[n++] = max_payload;
+  for (i = 0; i < PROBE_SIZES; i++)
+    if (probe_sizes[i] < max_payload)
+      sizes[n++] = probe_sizes[i];
+
+  // a probe that does not fit the path must be dropped, not fragmented,
+  // and one the kernel already knows not to fit is refused with EMSGSIZE
+  if (setsockopt(s, IPPROTO_IP, IP_MTU_DISCOVER, &dont, sizeof(dont)) < 0)
+    perror("IP_MTU_DISCOVER");
+  for (tries = 0; tries < HANDSHAKE_TRIES && best == 0; tries++) {
+    stamp = now_usec();
+    start = monotonic_usec();
+    largest = 0;
+    for (i = 0; i < n; i++)
+      for (c = 0; c < PROBE_COPIES; c++)
+        if (wire_send(s, PACKET_TYPE_PROBE, 0, zeros, sizes[i],
+                      (struct sockaddr*)&si_other, slen, stamp, 0,
+                      session_id) >= 0)
+          largest = std::max(largest, sizes[i]);
+
+    // the largest probes went first, once any answer is in the larger ones
+    // get one more round trip to show up
+    deadline = start + HANDSHAKE_TIMEOUT_USEC;
+    while (best < largest && (now = monotonic_usec()) < deadline) {
+      if (wait_ack(&reply, deadline - now) <= 0 ||
+          reply.type != (PACKET_TYPE_PROBE | PACKET_TYPE_ACK) ||
+          reply.session != session_id || reply.timestamp != stamp ||
+          reply.seqno > largest)
+        continue;
+      if (best == 0) {
+        *rtt = monotonic_usec() - start;
+        deadline = monotonic_usec() +
+                   std::max(*rtt, (uint32_t)RTO_GRANULARITY_USEC);
+      }
+      best = std::max(best, (unsigned int)reply.seqno);
     }
-    remaining_bytes -= read_bytes;
-    snd_bytes = sendto(s, snd_packet, sizeof(packet), 0,
-                       (struct sockaddr*)&si_other, slen);
+  }
+  return best;
+}
 
-    if (snd_bytes < 0)
-      diep((char*)"sendto()");
+bool open_transfer(unsigned long long bytes) {
+  uint8_t buf[HANDSHAKE_SIZE];
+  uint64_t start, deadline, now;
+  uint32_t stamp;
+  handshake offer;
+  packet reply;
+  int tries;
+
+  if ((offer.payload = probe_path(&handshake_rtt)) == 0)
+    return false;
+  // every flow gets at least one packet
+  offer.flows = std::max(
+      1ULL, std::min((unsigned long long)flows,
+                     (bytes + offer.payload - 1) / offer.payload));
+  offer.window = initial_window;
+  offer.bytes = bytes;
+  offer.features = (resume ? HANDSHAKE_RESUME : 0) |
+                   (fec_code != FEC_NONE ? HANDSHAKE_FEC : 0) |
+                   (manifest ? HANDSHAKE_BATCH : 0);
+  encode_handshake(offer, buf);
+
+  for (tries = 0; tries < HANDSHAKE_TRIES; tries++) {
+    stamp = now_usec();
+    start = monotonic_usec();
+    wire_send(s, PACKET_TYPE_SYN, 0, buf, sizeof(buf),
+              (struct sockaddr*)&si_other, slen, stamp, 0, session_id);
+    deadline = start + HANDSHAKE_TIMEOUT_USEC;
+    while ((now = monotonic_usec()) < deadline) {
+      if (wait_ack(&reply, deadline - now) <= 0 ||
+          reply.type != (PACKET_TYPE_SYN | PACKET_TYPE_ACK) ||
+          reply.session != session_id || !decode_handshake(&reply, &agreed))
+        continue;
+      // the receiver only ever lowers what was offered
+      if (agreed.payload > offer.payload || agreed.flows != offer.flows ||
+          agreed.bytes != bytes)
+        continue;
+      agreed.window = std::min(agreed.window, offer.window);
+      agreed.features &= offer.features;
+      if (reply.timestamp == stamp)
+        handshake_rtt = monotonic_usec() - start;
+      return true;
+    }
+  }
+  return false;
+}
+
+unsigned long ask_resume(unsigned long first, unsigned long end) {
+  uint8_t request[8];
+  packet reply;
+  unsigned long from = first, kept = 0, a, b;
+  uint32_t start;
+  int tries = 0, i;
+  bool answered;
+
+  put_le64(request, end);
+  while (from < end) {
+    wire_send(s, PACKET_TYPE_RESUME, from, request, sizeof(request),
+              (struct sockaddr*)&si_other, slen, 0, flow_id, session_id);
+    // a long listing takes several answers, each one picks up where the
+    // last one stopped, and stale answers to a retry are ignored
+    start = now_usec();
+    answered = false;
+    while (!answered && wait_ack(&reply, rtt->timeout()) >= 0 &&
+           now_usec() - start < rtt->timeout())
+      answered = reply.has_type(PACKET_TYPE_RESUME) &&
+                 reply.flow == flow_id && reply.session == session_id &&
+                 reply.seqno > from;
+    if (!answered) {
+      if (++tries == RESUME_TRIES) {
+        fprintf(stderr, "resume: no answer from the receiver\n");
+        break;
+      }
+      continue;
+    }
 
-    packets_sent++;
-    cwnd.push(snd_packet);
-    seq_no++;
+    for (i = 0; i + 16 <= (int)reply.data_sz; i += 16) {
+      a = std::max(get_le64((uint8_t*)reply.data + i), from);
+      b = std::min(get_le64((uint8_t*)reply.data + i + 8), end);
+      if (a < b) {
+        packets->skip(a, b);
+        kept += b - a;
+      }
+    }
+    from = reply.seqno;
   }
-#if DEBUG
-  printf("Sent %d packets with window size %u \n", packets_sent,
-         get_cwnd_size());
-  printf("Next packet should have seqno %lu\n", seq_no);
-#endif
+  return kept;
 }
 
-void finish_transfer() {
+bool finish_transfer(unsigned long seqno, uint32_t timeout_usec, uint32_t crc,
+                     uint32_t* theirs) {
   packet *fin_packet, recv_packet;
-  int i;
+  uint32_t start;
+  bool answered = false;
+  int i, bytes = -1;
 
-  fin_packet = new packet(seq_no);
+  //the FIN tells the receiver how many flows to wait for, and what the
+  //flow should hash to
+  fin_packet = new packet(seqno);
   fin_packet->set_type(PACKET_TYPE_FIN);
+  fin_packet->flow = flow_id;
+  fin_packet->session = session_id;
+  fin_packet->data_sz = 6;
+  put_le16((uint8_t*)fin_packet->data, flows);
+  put_le32((uint8_t*)fin_packet->data + 2, crc);
   for (i = 0; i < 3; i++) {
-    sendto(s, fin_packet, sizeof(packet), 0, (struct sockaddr*)&si_other, slen);
-    if (recv(s, &recv_packet, sizeof(packet), 0) >= 0) {
+    wire_send(s, fin_packet, (struct sockaddr*)&si_other, slen);
+    // late ACKs of the data may still be in flight, wait for the FIN
+    start = now_usec();
+    while ((bytes = wait_ack(&recv_packet, timeout_usec)) >= 0 &&
+           (bytes == 0 || !recv_packet.has_type(PACKET_TYPE_FIN)) &&
+           now_usec() - start < timeout_usec)
+      ;
+    if (bytes > 0 && recv_packet.has_type(PACKET_TYPE_FIN))
       break;
-    }
+  }
+  if (bytes > 0 && recv_packet.has_type(PACKET_TYPE_FIN) &&
+      recv_packet.data_sz >= 4) {
+    *theirs = get_le32((uint8_t*)recv_packet.data);
+    answered = true;
   }
 
   delete fin_packet;
+  return answered;
 }
 
-void reliablyTransfer(char* hostname, unsigned short int hostUDPport,
-                      char* filename, unsigned long long int bytesToTransfer) {
-  ssize_t bytes;
-  packet *snd_packet, recv_packet;
-  int ack_packets;
-
-  setup_socket(hostname, hostUDPport);
-
-  // Open the file
-  FILE* file = fopen(filename, "rb");
-  if (file == NULL)
-    diep((char*)"fopen");
-
-  /* Determine how many bytes to transfer */
-  remaining_bytes = bytesToTransfer;
-  total_packets = (bytesToTransfer + MAX_PACKET_SIZE - 1) / MAX_PACKET_SIZE;
-  packets_acked = 0;
-
-  std::vector<packet*> packets;
-  fillVector(packets, bytesToTransfer, file);
-  printf("Created %lu packets in vector", packets.size());
-
-  //setup congestion window
-  double long cw = 1;
-  double SST = 64;
-  uint32_t dupAck = 0;
-  uint64_t cw_base = 0;
-  uint64_t last_ack = 0;
-  uint8_t state = SS;
-  uint64_t max_sent = 0;
-  std::queue<int> specialResends;
-
-  //get the time
-  auto sent = std::chrono::high_resolution_clock::now();
-
-  while(cw_base < packets.size()) {
-    //make any transmissions that are necessary
-    for(uint64_t i = max_sent; i < cw_base + cw && i < packets.size(); i++) {
-      sendto(s, packets[i], sizeof(packet), 0, (struct sockaddr*)&si_other, slen);
-      std::cout << "Sent packet " << i << std::endl;
-      max_sent = i;
-    }
-
-    //special resends
-    while(!specialResends.empty()) {
-      int si = specialResends.front();
-      specialResends.pop();
-      sendto(s, packets[si], sizeof(packet), 0, (struct sockaddr*)&si_other, slen);
-    }
-
-
-
-    //wait for replies
-    packet incomingPkt;
-    bool timeout = false;
-    int bytes = recv(s, &incomingPkt, sizeof(packet), 0);
-    if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-      printf("Timeout ocurred");
-      timeout = true;
-    }
+void set_timer(int fd, uint64_t when, uint64_t* armed) {
+  struct itimerspec its;
+
+  //the timer is only moved when the time changes
+  if (when == *armed)
+    return;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = when / 1000000;
+  its.it_value.tv_nsec = when % 1000000 * 1000;
+  if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+    diep((char*)"timerfd_settime");
+  *armed = when;
+}
 
-    auto curr = std::chrono::high_resolution_clock::now();
-    auto ms_curr = std::chrono::duration_cast<std::chrono::milliseconds>(curr.time_since_epoch()).count();
-    auto ms_sent = std::chrono::duration_cast<std::chrono::milliseconds>(sent.time_since_epoch()).count();
+void transfer_flow(unsigned int index, char* hostname,
+                   unsigned short int hostUDPport, char* filename,
+                   const char* map, unsigned long long bytes,
+                   unsigned long first, unsigned long end) {
+  struct epoll_event ev, events[3];
+  int epfd, tfd, pfd, n, i, j;
+  uint64_t when, rto_armed = 0, pace_armed = 0, expirations;
+  unsigned long kept = 0;
+  uint32_t theirs = 0;
+  bool readable, fired, finished = false, confirmed;
+  FILE* file = NULL;
+  wire_send_batch* batch;
+  congestion_control* cc;
+  // Parity of the data sent for the first time, NULL without FEC
+  fec_encoder* fec = NULL;
 
-    if((ms_curr - ms_sent) > (TIMEOUT_USEC / 1000)) timeout = true;
+  setup_socket(hostname, hostUDPport);
 
-    if (!timeout && incomingPkt.has_type(PACKET_TYPE_FIN)) {
-      break;
-    }
+  // Either send straight out of the shared mapping of the file, or keep
+  // only the window and a little read-ahead of this range in memory
+  if (map) {
+    packets = new send_buffer(map, bytes, agreed.payload, first, end);
+  } else {
+    file = open_source(filename);
+    if (file == NULL)
+      diep((char*)"fopen");
+    if (fseeko(file, (off_t)first * agreed.payload, SEEK_SET) < 0)
+      diep((char*)"fseeko");
+    packets = new send_buffer(file, bytes, agreed.payload, first, end);
+  }
 
-    if(!timeout) {
-      std::cout << "received packet " << incomingPkt.seqno << "/" << packets.size() << std::endl;
+  flow_id = first;
+  rtt = new rtt_estimator(min_rto);
+  if (handshake_rtt)
+    rtt->sample(handshake_rtt);
+  //leave out what the receiver kept from an earlier run
+  if (resume)
+    kept = ask_resume(first, end);
+  batch = new wire_send_batch(s, SEND_BATCH);
+  if (use_offload)
+    batch->enable_gso();
+  if (fec_code != FEC_NONE)
+    fec = new fec_encoder(fec_code, fec_k, fec_m, fec_adaptive, first,
+                          SEND_BATCH, agreed.payload);
+  cc = make_congestion_control(cc_name, agreed.window);
+  wire_recv_batch acks;
+  socket_link link(batch);
+  sender_flow flow(&link, packets, cc, rtt, fec, agreed.payload,
+                   max_rate / flows, packets->needed(first));
+  if (tracing)
+    flow.ring = tracing->open(flow_id);
+
+  // One loop waits for ACKs, retransmission deadlines and the pacer
+  if ((epfd = epoll_create1(0)) < 0)
+    diep((char*)"epoll_create1");
+  if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0 ||
+      (pfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+    diep((char*)"timerfd_create");
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = s;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev) < 0)
+    diep((char*)"epoll_ctl");
+  ev.data.fd = tfd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev) < 0)
+    diep((char*)"epoll_ctl");
+  ev.data.fd = pfd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, pfd, &ev) < 0)
+    diep((char*)"epoll_ctl");
+
+  while(!flow.done() && !finished) {
+    if (flow.send_window() < 0)
+      diep((char*)"sendmmsg");
+    when = 0;
+    flow.rto_deadline(&when);
+    set_timer(tfd, when, &rto_armed);
+    //wake up for the next token if the pacer held the window back
+    set_timer(pfd, flow.pace_deadline(), &pace_armed);
+
+    //sleep until an ACK arrives, a deadline passes or a token is there
+    n = epoll_wait(epfd, events, 3, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      diep((char*)"epoll_wait");
     }
-
-    bool newAck = incomingPkt.seqno > last_ack;
-    bool dup = incomingPkt.seqno == last_ack;
-
-    last_ack = last_ack > incomingPkt.seqno ? last_ack : incomingPkt.seqno;
-    cw_base = last_ack;
-
-
-    //implement the state machine
-    switch(state) {
-      case SS : {
-        if(timeout) {
-          SST = cw / 2;
-          cw = 1;
-          dupAck = 0;
-          std::cout << "timed out" << std::endl;
-          specialResends.push(cw_base);
-          max_sent = cw_base;
-          //reset timer
-          sent = std::chrono::high_resolution_clock::now();
-        }
-        else if(dup) {
-          dupAck++;
-          printf("dupacks: %d\n", dupAck);
-        }
-        //new ack
-        else if(newAck) {
-          cw += incomingPkt.seqno - last_ack;
-          cw_base = incomingPkt.seqno;
-          last_ack = incomingPkt.seqno;
-          dupAck = 0;
-          sent = std::chrono::high_resolution_clock::now();
-        }
-
-        //state changes
-        if(dupAck == 3) {
-          SST = cw / 2;
-          cw = SST + 3;
-          //retry cw_base
-          specialResends.push(cw_base);
-          //transfer new packet if allowed. //done auto
-          state = FR;
-        }
-        else if(cw >= SST) state = CA;
-        break;
-      }
-      case CA: {
-        if(timeout) {
-          SST = cw / 2;
-          cw = 1;
-          dupAck = 0;
-          state = SS;
-          specialResends.push(cw_base);
-          max_sent = cw_base;
-          //reset timer
-          sent = std::chrono::high_resolution_clock::now();
-        }
-        else if(dup) {
-          dupAck++;
-          printf("dupacks: %d\n", dupAck);
+    readable = fired = false;
+    for (i = 0; i < n; i++) {
+      if (events[i].data.fd == s) {
+        readable = true;
+      } else {
+        if (read(events[i].data.fd, &expirations, sizeof(expirations)) < 0 &&
+            errno != EAGAIN)
+          diep((char*)"read timerfd");
+        if (events[i].data.fd == tfd) {
+          fired = true;
+          rto_armed = 0;
+        } else {
+          pace_armed = 0;
         }
-        else if(newAck) {
-          int ackedPkts = incomingPkt.seqno - last_ack;
-          for(int i = 0; i < ackedPkts; i++) cw = cw + 1.0 / std::floor(cw);
-          dupAck = 0;
-          last_ack = incomingPkt.seqno;
-          cw_base = incomingPkt.seqno;
-          sent = std::chrono::high_resolution_clock::now();
-          //transmit based on cw - done auto
-        }
-        if(dupAck == 3) {
-          SST = cw/2;
-          cw = SST + 3;
-          //retransmit CW_base
-          specialResends.push(cw_base);
-          //transmit new - done auto
-          state = FR;
-        }
-        break;
       }
-      case FR: {
-        if(timeout) {
-          SST = cw / 2;
-          cw = 1;
-          dupAck = 0;
-          specialResends.push(cw_base);
-          max_sent = cw_base;
-          state = SS;
-          sent = std::chrono::high_resolution_clock::now(); //reset timer
-        }
-        else if(dup) cw++;
-        else if(newAck) {
-          cw = SST;
-          dupAck = 0;
-          last_ack = incomingPkt.seqno;
-          cw_base = incomingPkt.seqno;
-          state = CA;
-
-          sent = std::chrono::high_resolution_clock::now();
+    }
+
+    //ACKs go first, they cancel the deadlines of what they acknowledge
+    if (readable && acks.recv(s, MSG_DONTWAIT) > 0) {
+      for (j = 0; j < (int)acks.size(); j++) {
+        packet* incomingPkt = acks.get(j);
+        if (incomingPkt == NULL || incomingPkt->flow != flow_id ||
+            incomingPkt->session != session_id)
+          continue;
+        if (incomingPkt->has_type(PACKET_TYPE_FIN)) {
+          finished = true;
+          break;
         }
+        flow.on_ack(incomingPkt);
       }
-
-      //if congestion window shrank, then we drop the max sent value to the window
-      if(cw_base + cw  <= max_sent) max_sent = cw_base + cw - 1;
-
-      //Print out stats
-      std::cout << "base" << cw_base << " end " << cw + cw_base << std::endl;
-
     }
-
+    if (fired && !finished)
+      flow.on_timer();
   }
 
-  finish_transfer();
-  fclose(fp);
+  flow.finish();
+  digests[index] = packets->digest();
+  confirmed = finish_transfer(packets->total(), rtt->timeout(),
+                              digests[index].crc, &theirs);
+  stats_lock.lock();
+  if (flows > 1)
+    fprintf(stderr, "flow %lu-%lu:\n", first, end);
+  flow.summary.print(
+      std::min(bytes, (unsigned long long)end * agreed.payload) -
+      (unsigned long long)first * agreed.payload);
+  batch->stats.print("sendmmsg");
+  if (batch->segments.calls)
+    batch->segments.print("gso");
+  acks.stats.print("ack recvmmsg");
+  if (acks.corrupt)
+    fprintf(stderr, "checksum: %lu damaged ACKs dropped\n", acks.corrupt);
+  if (!confirmed) {
+    fprintf(stderr, "crc32c: %08x, not confirmed by the receiver\n",
+            digests[index].crc);
+  } else if (theirs != digests[index].crc) {
+    fprintf(stderr, "crc32c: %08x, but the receiver wrote %08x\n",
+            digests[index].crc, theirs);
+    damaged = true;
+  }
+  if (resume)
+    fprintf(stderr, "resume: %lu of %lu packets kept by the receiver\n",
+            kept, end - first);
+  flow.print_stats();
+  stats_lock.unlock();
+  close(pfd);
+  close(tfd);
+  close(epfd);
+  delete cc;
+  delete fec;
+  delete rtt;
+  delete batch;
+  delete packets;
+  if (file)
+    fclose(file);
   close(s);
-
-  return;
-
-
-
-
-
-
+}
 
 
+void reliablyTransfer(char* hostname, unsigned short int hostUDPport,
+                      char* filename, unsigned long long int bytesToTransfer) {
+  std::thread threads[MAX_FLOWS];
+  unsigned long total;
+  unsigned int f;
+  uint64_t start;
+  struct stat st;
+
+  // a directory goes as a batch, its manifest and then every file under
+  // it in one stream
+  if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+    manifest = new batch_manifest();
+    if (!manifest->scan(filename))
+      diep((char*)"batch");
+    bytesToTransfer = manifest->total;
+    use_mmap = false;
+    fprintf(stderr,
+            "batch: %lu files and %lu directories, %llu bytes with the "
+            "manifest\n",
+            manifest->files, manifest->directories, manifest->total);
+    if (manifest->skipped)
+      fprintf(stderr, "batch: %lu entries that are neither files nor "
+              "directories left out\n", manifest->skipped);
+  }
 
-#if DEBUG
-  printf("Finished initial filling, start waiting for acks\n\n");
-#endif
-  while (packets_acked < total_packets || remaining_bytes > 0) {
-    bytes = recv(s, &recv_packet, sizeof(packet), 0);
-    if (bytes < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-#if DEBUG
-        printf("Timeout\n");
-#endif
-        ss_thresh = get_cwnd_size() / 2;
-        set_cwnd_size(1);
-#if DEBUG
-        printf("Retransmitting packet %lu\n", cwnd.top()->seqno);
-#endif
-        sendto(s, cwnd.top(), sizeof(packet), 0, (struct sockaddr*)&si_other,
-               slen);
-        continue;
-      }
-      diep((char*)"recv");
-    }
+  // Open the file
+  FILE* file = open_source(filename);
+  if (file == NULL)
+    diep((char*)"fopen");
 
-    if (recv_packet.has_type(PACKET_TYPE_FIN)) {
-      break;
-    }
+  // the receiver is told the size, and may set aside that much
+  if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode))
+    bytesToTransfer = std::min(bytesToTransfer, (unsigned long long)st.st_size);
+  // the flows share one mapping of the file
+  const char* map = use_mmap ? map_file(file, &bytesToTransfer) : NULL;
 
-    ack_packets = 0;
-    while (!cwnd.empty() && *cwnd.top() < recv_packet) {
-      snd_packet = cwnd.top();
-      ack_packets++;
-      cwnd.pop();
-      delete snd_packet;
-      packets_acked++;
-    }
+  setup_socket(hostname, hostUDPport);
+  if (!open_transfer(bytesToTransfer)) {
+    fprintf(stderr, "handshake: no answer from the receiver\n");
+    exit(1);
+  }
+  close(s);
+  fprintf(stderr,
+          "handshake: %u-byte payloads, initial window %u, rtt %.3f ms\n",
+          agreed.payload, agreed.window, handshake_rtt / 1e3);
+  if (resume && !(agreed.features & HANDSHAKE_RESUME)) {
+    fprintf(stderr, "resume: the receiver does not keep progress\n");
+    resume = false;
+  }
+  if (manifest && !(agreed.features & HANDSHAKE_BATCH)) {
+    fprintf(stderr, "batch: the receiver does not take batches\n");
+    exit(1);
+  }
+  if (fec_code != FEC_NONE && !(agreed.features & HANDSHAKE_FEC)) {
+    fprintf(stderr, "fec: the receiver does not take parity\n");
+    fec_code = FEC_NONE;
+  }
+  if (max_mbps > 0)
+    max_rate = max_mbps * 1e6 / 8 / agreed.payload;
+
+  // every flow gets a range of whole packets
+  total = (bytesToTransfer + agreed.payload - 1) / agreed.payload;
+  flows = agreed.flows;
+  start = monotonic_usec();
+  for (f = 0; f < flows; f++)
+    threads[f] = std::thread(transfer_flow, f, hostname, hostUDPport,
+                             filename, map, bytesToTransfer, total * f / flows,
+                             f + 1 == flows ? total : total * (f + 1) / flows);
+  for (f = 0; f < flows; f++)
+    threads[f].join();
+  // the flows cover the file in order
+  for (f = 1; f < flows; f++)
+    digests[0].append(digests[f]);
+  fprintf(stderr, "crc32c: %08x over %llu bytes (%s)%s\n", digests[0].crc,
+          digests[0].bytes, crc32c_kernel_name(),
+          damaged ? ", THE RECEIVER'S COPY DIFFERS" : "");
+  if (flows > 1) {
+    double secs = (monotonic_usec() - start) / 1e6;
+    fprintf(stderr, "transfer: %llu bytes in %.3f s, goodput %.2f Mbit/s\n",
+            bytesToTransfer, secs, bytesToTransfer * 8 / secs / 1e6);
+  }
 
-#if DEBUG
-    printf("Popped %d packets after receiving ack for %lu\n", ack_packets,
-           recv_packet.seqno);
-    if (cwnd.empty()) {
-      printf("Window is empty\n");
-    } else {
-      printf("Next expected packet is %lu\n", cwnd.top()->seqno);
-    }
-#endif
-
-    if (update_cwnd(recv_packet.seqno)) {
-#if DEBUG
-      printf("Retransmitting packet %lu\n", cwnd.top()->seqno);
-#endif
-      sendto(s, cwnd.top(), sizeof(packet), 0, (struct sockaddr*)&si_other,
-             slen);
-    }
+  if (map)
+    munmap((void*)map, bytesToTransfer);
+  fclose(file);
+  delete manifest;
+  manifest = NULL;
+}
 
-    fill_cwnd();
-#if DEBUG
-    printf("Packet progress (%d/%d) with inflight packets %ld\n\n",
-           packets_acked, total_packets, cwnd.size());
-#endif
+/**
+ * parse_fec reads xor:k, rs:k:m, or rs:k for a Reed-Solomon code whose m
+ * follows the retransmissions
+ *
+ * @return false if the code is unknown or k or m is out of range
+ */
+static bool parse_fec(const char* arg) {
+  int n;
+
+  fec_m = 1;
+  if (sscanf(arg, "xor:%u", &fec_k) == 1) {
+    fec_code = FEC_XOR;
+  } else if ((n = sscanf(arg, "rs:%u:%u", &fec_k, &fec_m)) >= 1) {
+    fec_code = FEC_RS;
+    fec_adaptive = n == 1;
+  } else {
+    return false;
   }
-
-  finish_transfer();
-  fclose(fp);
-  close(s);
-  return;
+  return fec_k >= 1 && fec_k <= FEC_MAX_GROUP && fec_m <= FEC_MAX_PARITY &&
+         fec_m <= fec_k;
 }
 
 /*
@@ -415,18 +558,129 @@ int main(int argc, char** argv) {
 
   unsigned short int udpPort;
   unsigned long long int numBytes;
+  congestion_control* probe;
+  const char* trace_file = NULL;
+  FILE* trace_out;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "zGKRi:r:c:m:p:w:f:t:e:")) != -1) {
+    switch (opt) {
+      case 'z':
+        use_mmap = true;
+        break;
+      case 'G':
+        use_offload = false;
+        break;
+      case 'K':
+        wire_checksums = false;
+        break;
+      case 'R':
+        resume = true;
+        break;
+      case 'i':
+        session_id = strtoul(optarg, NULL, 16);
+        session_given = true;
+        break;
+      case 'r':
+        min_rto = atoi(optarg) * 1000;
+        break;
+      case 'c':
+        cc_name = optarg;
+        break;
+      case 'm':
+        max_mbps = atof(optarg);
+        break;
+      case 'p':
+        max_payload = atoi(optarg);
+        if (max_payload < probe_sizes[PROBE_SIZES - 1] ||
+            max_payload > MAX_PACKET_SIZE)
+          argc = 0;
+        break;
+      case 'w':
+        initial_window = atoi(optarg);
+        if (initial_window < 1)
+          argc = 0;
+        break;
+      case 'f':
+        flows = atoi(optarg);
+        if (flows < 1 || flows > MAX_FLOWS)
+          argc = 0;
+        break;
+      case 't':
+        trace_file = optarg;
+        break;
+      case 'e':
+        if (!parse_fec(optarg))
+          argc = 0;
+        break;
+      default:
+        argc = 0;
+    }
+  }
+  if ((probe = make_congestion_control(cc_name)) == NULL)
+    argc = 0;
+  delete probe;
 
-  if (argc != 5) {
+  if (argc - optind != 4) {
     fprintf(stderr,
-            "usage: %s receiver_hostname receiver_port filename_to_xfer "
-            "bytes_to_xfer\n\n",
-            argv[0]);
+            "usage: %s [-z] [-G] [-K] [-R] [-i session] [-r min_rto_ms] "
+            "[-c reno|cubic|bbr] [-m mbps] [-p payload] [-w packets] "
+            "[-f flows] [-t trace_file] [-e xor:k|rs:k[:m]] "
+            "receiver_hostname receiver_port "
+            "filename_to_xfer bytes_to_xfer\n\n"
+            "  filename_to_xfer may be a directory, it is then sent with "
+            "everything under it\n"
+            "  as one batch and bytes_to_xfer is ignored\n\n"
+            "  -z  send straight out of a memory mapping of the file\n"
+            "  -G  send one datagram at a time, without UDP GSO\n"
+            "  -K  leave the CRC32C out of every datagram, the file is "
+            "still checked\n"
+            "  -R  resume: skip what a receiver started with -R kept from an "
+            "earlier run\n"
+            "  -i  connection ID in hex (default random), a receiver daemon "
+            "only resumes\n"
+            "      a transfer that comes back with the same one\n"
+            "  -r  lower bound of the retransmission timeout (default %d)\n"
+            "  -c  congestion control (default reno)\n"
+            "  -m  cap the sending rate, in Mbit/s of payload\n"
+            "  -p  largest payload per datagram (%u to %u, default the "
+            "largest), the path\n"
+            "      is probed for what it takes\n"
+            "  -w  initial window in packets (default %d), the receiver may "
+            "lower it\n"
+            "  -f  split the file across this many flows, each on its own "
+            "thread (at most %d)\n"
+            "  -t  record sends, ACKs and window changes to a trace file, "
+            "see trace_to_csv\n"
+            "  -e  send parity after every k packets (at most %d) so that "
+            "the receiver\n"
+            "      rebuilds losses without a retransmission: their XOR, or m "
+            "Reed-Solomon\n"
+            "      packets (at most %d), m follows the loss rate if it is "
+            "left out\n\n",
+            argv[0], RTO_MIN_USEC / 1000, probe_sizes[PROBE_SIZES - 1],
+            MAX_PACKET_SIZE, DEFAULT_CWND, MAX_FLOWS, FEC_MAX_GROUP,
+            FEC_MAX_PARITY);
     exit(1);
   }
-  udpPort = (unsigned short int)atoi(argv[2]);
-  numBytes = atoll(argv[4]);
+  argv += optind;
+  udpPort = (unsigned short int)atoi(argv[1]);
+  numBytes = atoll(argv[3]);
+  if (!session_given)
+    session_id = std::random_device()();
+
+  if (trace_file) {
+    if ((trace_out = fopen(trace_file, "wb")) == NULL)
+      diep((char*)"fopen");
+    tracing = new tracer(trace_out);
+  }
 
-  reliablyTransfer(argv[1], udpPort, argv[3], numBytes);
+  reliablyTransfer(argv[0], udpPort, argv[2], numBytes);
+
+  if (tracing) {
+    tracing->close();
+    delete tracing;
+  }
 
-  return (EXIT_SUCCESS);
+  return damaged ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -3,10 +3,14 @@
 
 #include <stdio.h>
 
-// Define the maximum data size, in bytes, that a packet can carry
-// Tweak this value to optimize performance
-#define MAX_PACKET_SIZE 1000
+// Largest UDP payload that fits a 1500-byte Ethernet frame
 #define UDP_MAX 1472
+// Largest payload a datagram can carry, UDP_MAX less the wire header. Every
+// buffer is sized for it, the payload of a transfer is agreed on in the
+// handshake (see handshake.hpp) and may be smaller
+#define MAX_PACKET_SIZE (UDP_MAX - 28)
+// Most flows a transfer can be split into
+#define MAX_FLOWS 64
 #define DEBUG 0
 /**
  * diep prints an error message and exits the program
@@ -19,25 +23,61 @@ void diep(char* s) {
 #define PACKET_TYPE_DATA 1 << 1
 #define PACKET_TYPE_ACK 1 << 2
 #define PACKET_TYPE_FIN 1 << 3
+// Set on retransmitted data, and on the ACKs they trigger
+#define PACKET_TYPE_RETX 1 << 4
+// FEC parity of a group of data packets, see fec.hpp
+#define PACKET_TYPE_PARITY 1 << 5
+// Asks which packets of a flow the receiver kept from an earlier run, see
+// resume_log.hpp. The request's seqno is where the listing starts and its
+// payload the le64 end of the flow. The answer also has PACKET_TYPE_ACK
+// set, its seqno is how far the listing got and its payload le64 pairs
+// [start, end) of kept packets
+#define PACKET_TYPE_RESUME 1 << 6
+// Opens a transfer, see handshake.hpp. The answer also has PACKET_TYPE_ACK
+// set
+#define PACKET_TYPE_SYN 1 << 7
+// Tells whether a payload of its size gets through, the answer also has
+// PACKET_TYPE_ACK set and its seqno is the size that arrived. On the ACK of
+// a flow it marks a window update, which answers no packet
+#define PACKET_TYPE_PROBE 1 << 0
 
+/**
+ * packet is the in-memory representation of a datagram. It is never sent
+ * as-is, see wire.hpp for the serialized format.
+ */
 class packet {
  public:
   unsigned long seqno;
   unsigned int data_sz;
   char data[MAX_PACKET_SIZE];
   unsigned int type;
+  unsigned int timestamp;
+  unsigned int flow;
+  unsigned int session;
+  // CRC32C of data alone if has_crc, a received datagram's checksum starts
+  // with it (see wire.hpp) and the whole-file checksum is made of them
+  unsigned int crc;
+  bool has_crc;
 
   packet() {
     seqno = 0;
     data_sz = 0;
     type = 0;
-    memset(data, 0, MAX_PACKET_SIZE);
+    timestamp = 0;
+    flow = 0;
+    session = 0;
+    crc = 0;
+    has_crc = false;
   }
 
   packet(unsigned long seqno) : seqno(seqno) {
     data_sz = 0;
     type = 0;
-    memset(data, 0, MAX_PACKET_SIZE);
+    timestamp = 0;
+    flow = 0;
+    session = 0;
+    crc = 0;
+    has_crc = false;
   }
 
   /**
@@ -60,13 +100,16 @@ class packet {
     return actual;
 
   populate_error:
-    return err;
+    return -err;
   }
 
   void copy(packet* p) {
     this->seqno = p->seqno;
     this->data_sz = p->data_sz;
     this->type = p->type;
+    this->timestamp = p->timestamp;
+    this->flow = p->flow;
+    this->session = p->session;
     memcpy(this->data, p->data, p->data_sz);
   }
 
@@ -86,7 +129,7 @@ class packet {
 
   void set_type(unsigned int type) { this->type |= type; }
 
-  bool has_type(unsigned int type) { return this->type & type; }
+  bool has_type(unsigned int type) const { return this->type & type; }
 
   ~packet() {}
 };
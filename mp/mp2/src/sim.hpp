@@ -0,0 +1,301 @@
+#ifndef SIM_HPP
+#define SIM_HPP
+
+#include <stdint.h>
+
+#include <queue>
+#include <random>
+#include <vector>
+
+#include "ack_policy.hpp"
+#include "handshake.hpp"
+#include "reorder_buffer.hpp"
+#include "sack.hpp"
+#include "sender_flow.hpp"
+#include "shared.hpp"
+
+// Bytes every flow transfers unless -b is given
+#define SIM_BYTES 1000000
+// Bottleneck rate unless -r is given, in Mbit/s
+#define SIM_RATE_MBPS 100
+// One way delay unless -d is given, in microseconds
+#define SIM_DELAY_USEC 5000
+// Queue of the bottleneck unless -q is given, in bytes
+#define SIM_QUEUE_BYTES 100000
+// Bytes a datagram takes on the path besides its payload: the IPv4, UDP
+// and wire headers
+#define SIM_OVERHEAD (20 + 8 + WIRE_HEADER_SIZE)
+// Virtual time every run starts at, the 32 bits of it that fit in a
+// timestamp must not wrap during a run
+#define SIM_START_USEC 1000000
+// Virtual time a run is given by default, a flow that is not done by then
+// is stuck
+#define SIM_LIMIT_USEC 600000000ULL
+// Goodput shares are compared over intervals this long, a run has
+// converged once Jain's index stays at SIM_FAIR or above from one interval
+// on while every flow is running
+#define SIM_INTERVAL_USEC 100000
+#define SIM_FAIR 0.9
+// RED (Floyd and Jacobson): the average queue, an EWMA of weight
+// RED_WEIGHT, is dropped from with a probability that grows to RED_MAX_P
+// between RED_MIN and RED_MAX of the queue, and always above
+#define RED_WEIGHT 0.002
+#define RED_MIN 0.25
+#define RED_MAX 0.75
+#define RED_MAX_P 0.1
+
+// Queue disciplines of the bottleneck
+#define QUEUE_DROPTAIL 0
+#define QUEUE_RED 1
+
+// Datagrams from the senders towards the receivers, and the ACKs back
+#define TO_RECEIVER 0
+#define TO_SENDER 1
+
+// What happens at an event: a flow starts, a datagram reaches its
+// receiver, an ACK reaches its sender, a deadline of a sender passes, or
+// a delayed ACK of a receiver is due
+#define EVENT_START 0
+#define EVENT_DATA 1
+#define EVENT_ACK 2
+#define EVENT_WAKE 3
+#define EVENT_DELAYED_ACK 4
+
+/**
+ * path is one direction of the simulated link, shared by every flow
+ */
+struct path {
+  // Bernoulli loss probability
+  double loss = 0;
+  // one way delay in microseconds
+  uint64_t delay = SIM_DELAY_USEC;
+  // bottleneck rate in bytes per second (0 for none), its queue in bytes
+  // and how that is managed
+  double rate = 0;
+  unsigned long queue = SIM_QUEUE_BYTES;
+  int discipline = QUEUE_DROPTAIL;
+  // when the bottleneck is done with everything queued so far, and the
+  // average queue RED works from
+  uint64_t busy_until = 0;
+  double average = 0;
+  unsigned long sent = 0, lost = 0, overflowed = 0, early = 0;
+};
+
+/**
+ * event is something that happens at a point of virtual time
+ *
+ * A datagram or an ACK carries what the sender or the receiver looks at,
+ * a wake or a delayed ACK the generation it was scheduled with in seqno,
+ * it is stale once the flow has scheduled another.
+ */
+struct event {
+  uint64_t when;
+  // scheduling order, keeps events due at the same time in order
+  unsigned long order;
+  int kind;
+  unsigned int flow;
+  unsigned long seqno;
+  unsigned int type;
+  uint32_t timestamp;
+  uint32_t window;
+  int blocks;
+  sack_block sack[SACK_MAX_BLOCKS];
+};
+
+/**
+ * EventComparator puts the earliest event on top of a priority queue
+ */
+struct EventComparator {
+  bool operator()(const event& a, const event& b) const {
+    if (a.when != b.when)
+      return a.when > b.when;
+    return a.order > b.order;
+  }
+};
+
+/**
+ * sim_receiver is the receiving end of a flow, as far as its ACKs go: the
+ * received bitmap, the cumulative ACK, the ACK policy of reliable_receiver,
+ * and a reorder buffer of window packets past the cumulative ACK that is
+ * drained at once
+ */
+struct sim_receiver {
+  std::vector<uint64_t> received;
+  // cumulative ACK, one past the highest seqno received, and the edge of
+  // the window advertised so far
+  unsigned long next, highest, advertised;
+  ack_policy policy;
+  // generation of the pending delayed ACK
+  unsigned long generation;
+  unsigned long duplicates;
+  // new packets received in every SIM_INTERVAL_USEC of the run
+  std::vector<unsigned long> intervals;
+};
+
+/**
+ * sim_link sends the datagrams of a flow over the simulated path, at the
+ * virtual time
+ */
+class sim_link : public sender_link {
+ public:
+  sim_link(unsigned int flow) : flow(flow) {}
+
+  uint64_t now();
+
+  void send(unsigned int type, unsigned long seqno, const void* data,
+            unsigned int length, uint32_t timestamp,
+            const uint32_t* payload_crc);
+
+  int flush() { return 0; }
+
+ private:
+  unsigned int flow;
+};
+
+/**
+ * sim_flow is one transfer of the simulation, both of its ends
+ */
+struct sim_flow {
+  sim_link* link;
+  send_buffer* packets;
+  congestion_control* cc;
+  rtt_estimator* rtt;
+  sender_flow* sender;
+  sim_receiver receiver;
+  // virtual time the flow started and was done at, 0 until then
+  uint64_t started, finished;
+  // when the pending wake is due, 0 for none, and its generation
+  uint64_t wake;
+  unsigned long generation;
+  // retransmissions of packets below the cumulative ACK of the sender
+  unsigned long stale;
+};
+
+/**
+ * run_result is what one run measured
+ */
+struct run_result {
+  // virtual time from the first start to the last finish
+  uint64_t elapsed;
+  double utilization, fairness;
+  // virtual time from the last start until the flows converged, -1 if
+  // they never did
+  double converged;
+  bool stuck;
+  unsigned long stale, events;
+};
+
+// Options
+const char* cc_name = "reno";
+unsigned int nflows = 1;
+unsigned long long bytes = SIM_BYTES;
+unsigned int payload = MTU_PAYLOAD(1500);
+unsigned int initial_window = DEFAULT_CWND;
+unsigned long receive_window = REORDER_SLOTS;
+uint64_t stagger = 0;
+uint64_t limit = SIM_LIMIT_USEC;
+uint32_t min_rto = RTO_MIN_USEC;
+bool verbose = false;
+
+// Both directions of the path, and the flows sharing it
+path paths[2];
+std::vector<sim_flow*> sim_flows;
+// The file every flow sends, all zeros
+char* zeros = NULL;
+
+// Virtual time in microseconds, and what is yet to happen
+uint64_t clock_usec;
+std::priority_queue<event, std::vector<event>, EventComparator> schedule;
+unsigned long scheduled = 0;
+
+std::mt19937_64 rng;
+// What the senders decode their ACKs from
+packet ack;
+
+/**
+ * chance draws true with probability p
+ */
+bool chance(double p);
+
+/**
+ * post schedules an event
+ */
+void post(event* e);
+
+/**
+ * cross sends one datagram over a direction of the path
+ *
+ * @param dir TO_RECEIVER or TO_SENDER
+ * @param size its size on the path in bytes
+ * @return when it arrives, 0 if it is lost or dropped by the bottleneck
+ */
+uint64_t cross(int dir, unsigned int size);
+
+/**
+ * send_ack sends the ACK of a flow's receiver
+ *
+ * @param index the flow
+ * @param type PACKET_TYPE_ACK and the flags echoed from the data
+ * @param recent the seqno that triggered the ACK
+ * @param timestamp the timestamp it echoes, unless a delayed ACK was
+ *        pending
+ */
+void send_ack(unsigned int index, unsigned int type, unsigned long recent,
+              uint32_t timestamp);
+
+/**
+ * delay_ack counts a packet towards the ACK of a flow's receiver, and
+ * schedules the delayed ACK it starts, see ack_policy::on_packet
+ *
+ * @return true if the ACK can wait, false if it is due now
+ */
+bool delay_ack(unsigned int index, bool in_order, bool retransmit,
+               uint32_t timestamp);
+
+/**
+ * receive_data hands a datagram to the receiver of its flow
+ */
+void receive_data(const event* e);
+
+/**
+ * receive_ack hands an ACK to the sender of its flow
+ */
+void receive_ack(const event* e);
+
+/**
+ * service lets the sender of a flow send what it may, and schedules its
+ * next wake
+ */
+void service(unsigned int index);
+
+/**
+ * start_flow sets up both ends of a flow
+ */
+void start_flow(unsigned int index);
+
+/**
+ * end_flow frees both ends of a flow
+ */
+void end_flow(sim_flow* f);
+
+/**
+ * jain is Jain's fairness index of n shares, 1 when they are all equal
+ */
+double jain(const double* shares, unsigned int n);
+
+/**
+ * converged finds when the goodput shares of the flows settled, see
+ * SIM_FAIR
+ *
+ * @return seconds from the last start, -1 if they never did
+ */
+double converged();
+
+/**
+ * run simulates the flows once
+ *
+ * @param seed seed of the random generator
+ */
+run_result run(unsigned long seed);
+
+#endif
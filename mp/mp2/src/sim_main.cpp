@@ -0,0 +1,554 @@
+/*
+ * File:   sim_main.cpp
+ *
+ * Runs reliable_sender's flows against a model of reliable_receiver over a
+ * simulated bottleneck, in virtual time, to benchmark congestion control:
+ * goodput, fairness and convergence of competing flows, over as many
+ * seeded runs as asked for.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "sim.hpp"
+
+uint64_t sim_link::now() { return clock_usec; }
+
+void sim_link::send(unsigned int type, unsigned long seqno, const void* data,
+                    unsigned int length, uint32_t timestamp,
+                    const uint32_t* payload_crc) {
+  event e;
+  (void)data;
+  (void)payload_crc;
+
+  // the flows run without FEC, only data crosses the path
+  if (!(type & PACKET_TYPE_DATA))
+    return;
+  // the sender already knows the receiver holds these
+  if (seqno < sim_flows[flow]->sender->acked())
+    sim_flows[flow]->stale++;
+  if ((e.when = cross(TO_RECEIVER, length + SIM_OVERHEAD)) == 0)
+    return;
+  e.kind = EVENT_DATA;
+  e.flow = flow;
+  e.seqno = seqno;
+  e.type = type;
+  e.timestamp = timestamp;
+  post(&e);
+}
+
+bool chance(double p) {
+  return p > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < p;
+}
+
+void post(event* e) {
+  e->order = scheduled++;
+  schedule.push(*e);
+}
+
+uint64_t cross(int dir, unsigned int size) {
+  path* p = &paths[dir];
+  uint64_t start, when = clock_usec;
+  double queued, drop;
+
+  p->sent++;
+  if (chance(p->loss)) {
+    p->lost++;
+    return 0;
+  }
+
+  // the bottleneck serializes datagrams, and drops what does not fit in
+  // its queue, or what RED picks
+  if (p->rate > 0) {
+    start = std::max(clock_usec, p->busy_until);
+    queued = (start - clock_usec) * p->rate / 1e6;
+    if (queued + size > p->queue) {
+      p->overflowed++;
+      return 0;
+    }
+    if (p->discipline == QUEUE_RED) {
+      p->average += RED_WEIGHT * (queued - p->average);
+      drop = (p->average - RED_MIN * p->queue) /
+             ((RED_MAX - RED_MIN) * p->queue) * RED_MAX_P;
+      if (p->average >= RED_MAX * p->queue || chance(drop)) {
+        p->early++;
+        return 0;
+      }
+    }
+    p->busy_until = start + (uint64_t)(size * 1e6 / p->rate);
+    when = p->busy_until;
+  }
+  return when + p->delay;
+}
+
+void send_ack(unsigned int index, unsigned int type, unsigned long recent,
+              uint32_t timestamp) {
+  sim_receiver* r = &sim_flows[index]->receiver;
+  event e;
+
+  timestamp = r->policy.on_ack(timestamp);
+  if ((e.when = cross(TO_SENDER, SIM_OVERHEAD + ACK_WINDOW_SIZE +
+                                     SACK_MAX_BLOCKS * SACK_BLOCK_SIZE)) == 0)
+    return;
+  e.blocks = collect_sack(r->received.data(), r->received.size() * 64,
+                          r->next, r->highest, recent, e.sack);
+  r->advertised = std::max(r->advertised, r->next + receive_window);
+  e.kind = EVENT_ACK;
+  e.flow = index;
+  e.seqno = r->next;
+  e.type = type;
+  e.timestamp = timestamp;
+  e.window = r->advertised - r->next;
+  post(&e);
+}
+
+bool delay_ack(unsigned int index, bool in_order, bool retransmit,
+               uint32_t timestamp) {
+  sim_receiver* r = &sim_flows[index]->receiver;
+  bool pending = r->policy.pending();
+  bool wait = r->policy.on_packet(in_order, retransmit, timestamp, clock_usec);
+  event e;
+
+  if (!pending && r->policy.pending()) {
+    e.when = r->policy.due();
+    e.kind = EVENT_DELAYED_ACK;
+    e.flow = index;
+    e.seqno = ++r->generation;
+    post(&e);
+  }
+  return wait;
+}
+
+void receive_data(const event* e) {
+  sim_receiver* r = &sim_flows[e->flow]->receiver;
+  unsigned long seqno = e->seqno;
+  bool in_order = false;
+
+  if (seqno < sim_flows[e->flow]->packets->total() &&
+      seqno < r->advertised &&
+      !(r->received[seqno / 64] >> (seqno % 64) & 1)) {
+    in_order = ack_policy::continues(seqno, r->next, r->highest);
+    r->received[seqno / 64] |= 1ULL << (seqno % 64);
+    r->highest = std::max(r->highest, seqno + 1);
+    r->next = find_bit(r->received.data(), r->received.size() * 64, r->next,
+                       r->highest, false);
+    r->intervals[(clock_usec - SIM_START_USEC) / SIM_INTERVAL_USEC]++;
+  } else {
+    r->duplicates++;
+  }
+
+  if (delay_ack(e->flow, in_order, e->type & PACKET_TYPE_RETX, e->timestamp))
+    return;
+  send_ack(e->flow, PACKET_TYPE_ACK | (e->type & PACKET_TYPE_RETX), seqno,
+           e->timestamp);
+}
+
+void receive_ack(const event* e) {
+  sim_flow* f = sim_flows[e->flow];
+
+  if (f->finished)
+    return;
+  ack.seqno = e->seqno;
+  ack.type = e->type;
+  ack.timestamp = e->timestamp;
+  ack.data_sz = encode_sack(e->sack, e->blocks, e->seqno, e->window,
+                            (uint8_t*)ack.data);
+  f->sender->on_ack(&ack);
+  service(e->flow);
+}
+
+void service(unsigned int index) {
+  sim_flow* f = sim_flows[index];
+  uint64_t rto = 0, pace;
+  event e;
+
+  if (f->finished)
+    return;
+  if (f->sender->done()) {
+    f->finished = clock_usec;
+    f->sender->finish();
+    return;
+  }
+
+  f->sender->send_window();
+  f->sender->rto_deadline(&rto);
+  pace = f->sender->pace_deadline();
+  if (rto == 0 || (pace > 0 && pace < rto))
+    rto = pace;
+  // the wake is only moved when the time changes, as set_timer does
+  if (rto == f->wake)
+    return;
+  f->wake = rto;
+  f->generation++;
+  if (rto == 0)
+    return;
+  e.when = std::max(rto, clock_usec);
+  e.kind = EVENT_WAKE;
+  e.flow = index;
+  e.seqno = f->generation;
+  post(&e);
+}
+
+void start_flow(unsigned int index) {
+  sim_flow* f = sim_flows[index];
+  unsigned long total;
+
+  f->packets = new send_buffer(zeros, bytes, payload);
+  total = f->packets->total();
+  f->rtt = new rtt_estimator(min_rto);
+  // the handshake would have measured the base RTT
+  f->rtt->sample(paths[TO_RECEIVER].delay + paths[TO_SENDER].delay);
+  f->cc = make_congestion_control(cc_name, initial_window);
+  f->link = new sim_link(index);
+  f->sender = new sender_flow(f->link, f->packets, f->cc, f->rtt, NULL,
+                              payload, 0, 0);
+
+  f->receiver.received.assign((total + 63) / 64 + 1, 0);
+  f->receiver.next = f->receiver.highest = 0;
+  f->receiver.advertised = receive_window;
+  f->receiver.policy = ack_policy();
+  f->receiver.generation = 0;
+  f->receiver.duplicates = 0;
+  f->started = clock_usec;
+  service(index);
+}
+
+void end_flow(sim_flow* f) {
+  delete f->sender;
+  delete f->link;
+  delete f->cc;
+  delete f->rtt;
+  delete f->packets;
+  delete f;
+}
+
+double jain(const double* shares, unsigned int n) {
+  double sum = 0, squares = 0;
+
+  for (unsigned int i = 0; i < n; i++) {
+    sum += shares[i];
+    squares += shares[i] * shares[i];
+  }
+  return squares > 0 ? sum * sum / (n * squares) : 1;
+}
+
+double converged() {
+  uint64_t from = 0, to = UINT64_MAX;
+  unsigned long first, last, i, settled;
+  std::vector<double> shares(nflows);
+
+  // only the intervals every flow ran through are compared
+  for (sim_flow* f : sim_flows) {
+    from = std::max(from, f->started);
+    to = std::min(to, f->finished);
+  }
+  first = (from - SIM_START_USEC + SIM_INTERVAL_USEC - 1) / SIM_INTERVAL_USEC;
+  last = (to - SIM_START_USEC) / SIM_INTERVAL_USEC;
+  if (nflows < 2 || first >= last)
+    return -1;
+
+  settled = last;
+  for (i = last; i > first; i--) {
+    for (unsigned int j = 0; j < nflows; j++)
+      shares[j] = sim_flows[j]->receiver.intervals[i - 1];
+    if (jain(shares.data(), nflows) < SIM_FAIR)
+      break;
+    settled = i - 1;
+  }
+  if (settled == last)
+    return -1;
+  return (settled * SIM_INTERVAL_USEC + SIM_START_USEC - from) / 1e6;
+}
+
+run_result run(unsigned long seed) {
+  run_result result;
+  std::vector<double> goodput(nflows);
+  unsigned long long delivered = 0;
+  uint64_t first = UINT64_MAX, last = 0, rto;
+  event e;
+
+  rng.seed(seed);
+  for (int dir = 0; dir < 2; dir++) {
+    paths[dir].busy_until = 0;
+    paths[dir].average = 0;
+    paths[dir].sent = paths[dir].lost = 0;
+    paths[dir].overflowed = paths[dir].early = 0;
+  }
+  clock_usec = SIM_START_USEC;
+  scheduled = 0;
+  result.events = 0;
+  result.stale = 0;
+  result.stuck = false;
+
+  for (unsigned int i = 0; i < nflows; i++) {
+    sim_flow* f = new sim_flow();
+    f->receiver.intervals.assign(limit / SIM_INTERVAL_USEC + 1, 0);
+    sim_flows.push_back(f);
+    e.when = SIM_START_USEC + i * stagger;
+    e.kind = EVENT_START;
+    e.flow = i;
+    post(&e);
+  }
+
+  while (!schedule.empty()) {
+    e = schedule.top();
+    schedule.pop();
+    if (e.when >= SIM_START_USEC + limit) {
+      result.stuck = true;
+      break;
+    }
+    clock_usec = e.when;
+    result.events++;
+    sim_flow* f = sim_flows[e.flow];
+
+    switch (e.kind) {
+      case EVENT_START:
+        start_flow(e.flow);
+        break;
+      case EVENT_DATA:
+        receive_data(&e);
+        break;
+      case EVENT_ACK:
+        receive_ack(&e);
+        break;
+      case EVENT_WAKE:
+        if (e.seqno != f->generation || f->finished)
+          break;
+        f->wake = 0;
+        if (f->sender->rto_deadline(&rto) && rto <= clock_usec)
+          f->sender->on_timer();
+        service(e.flow);
+        break;
+      case EVENT_DELAYED_ACK:
+        if (e.seqno == f->receiver.generation && f->receiver.policy.pending())
+          send_ack(e.flow, PACKET_TYPE_ACK, f->receiver.next - 1, 0);
+        break;
+    }
+  }
+  while (!schedule.empty())
+    schedule.pop();
+
+  for (unsigned int i = 0; i < nflows; i++) {
+    sim_flow* f = sim_flows[i];
+    if (f->finished == 0) {
+      result.stuck = true;
+      f->finished = clock_usec;
+    }
+    first = std::min(first, f->started);
+    last = std::max(last, f->finished);
+    goodput[i] = bytes * 8.0 / (f->finished - f->started);
+    delivered += bytes;
+    result.stale += f->stale;
+  }
+  result.elapsed = last - first;
+  result.fairness = jain(goodput.data(), nflows);
+  result.converged = converged();
+  result.utilization =
+      paths[TO_RECEIVER].rate > 0
+          ? delivered * 1e6 / paths[TO_RECEIVER].rate / result.elapsed
+          : 0;
+
+  if (verbose) {
+    fprintf(stderr, "seed %lu:\n", seed);
+    for (unsigned int i = 0; i < nflows; i++) {
+      sim_flow* f = sim_flows[i];
+      fprintf(stderr, "flow %u: ", i);
+      f->sender->summary.print(bytes);
+      fprintf(stderr, "receiver: %lu duplicates\n", f->receiver.duplicates);
+      if (f->stale)
+        fprintf(stderr, "sender: %lu retransmissions below the ACK\n",
+                f->stale);
+      f->sender->print_stats();
+    }
+    fprintf(stderr,
+            "path: %lu sent, %lu lost, %lu overflowed, %lu dropped early\n",
+            paths[TO_RECEIVER].sent, paths[TO_RECEIVER].lost,
+            paths[TO_RECEIVER].overflowed, paths[TO_RECEIVER].early);
+  }
+
+  for (sim_flow* f : sim_flows)
+    end_flow(f);
+  sim_flows.clear();
+  return result;
+}
+
+int main(int argc, char** argv) {
+  unsigned long seed = 1, runs = 1, stuck = 0, stale = 0, idle = 0;
+  unsigned long events = 0;
+  double goodput = 0, utilization = 0, fairness = 0, settle = 0, seconds = 0;
+  double min_goodput = 0, min_fairness = 0;
+  unsigned long settled = 0;
+  struct timespec t0, t1;
+  path p;
+  int opt;
+
+  p.rate = SIM_RATE_MBPS * 1e6 / 8;
+  while ((opt = getopt(argc, argv, "c:f:b:r:d:l:q:Q:n:s:p:w:W:S:t:g:j:vh")) !=
+         -1) {
+    switch (opt) {
+      case 'c':
+        cc_name = optarg;
+        break;
+      case 'f':
+        nflows = atoi(optarg);
+        break;
+      case 'b':
+        bytes = strtoull(optarg, NULL, 10);
+        break;
+      case 'r':
+        p.rate = atof(optarg) * 1e6 / 8;
+        break;
+      case 'd':
+        p.delay = atof(optarg) * 1000;
+        break;
+      case 'l':
+        p.loss = atof(optarg);
+        break;
+      case 'q':
+        p.queue = atol(optarg);
+        break;
+      case 'Q':
+        if (strcmp(optarg, "droptail") == 0)
+          p.discipline = QUEUE_DROPTAIL;
+        else if (strcmp(optarg, "red") == 0)
+          p.discipline = QUEUE_RED;
+        else
+          argc = 0;
+        break;
+      case 'n':
+        runs = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        seed = strtoul(optarg, NULL, 10);
+        break;
+      case 'p':
+        payload = atoi(optarg);
+        break;
+      case 'w':
+        initial_window = atoi(optarg);
+        break;
+      case 'W':
+        receive_window = strtoul(optarg, NULL, 10);
+        break;
+      case 'S':
+        stagger = atof(optarg) * 1000;
+        break;
+      case 't':
+        limit = atof(optarg) * 1e6;
+        break;
+      case 'g':
+        min_goodput = atof(optarg);
+        break;
+      case 'j':
+        min_fairness = atof(optarg);
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        argc = 0;
+    }
+  }
+
+  if (argc == 0 || optind != argc || nflows < 1 || bytes == 0 ||
+      payload < 1 || payload > MAX_PACKET_SIZE || initial_window < 1 ||
+      receive_window < 1 || runs < 1 || limit == 0) {
+    fprintf(stderr,
+            "usage: %s [options]\n\n"
+            "  -c cc       congestion control: reno, cubic or bbr "
+            "(default reno)\n"
+            "  -f n        flows sharing the bottleneck (default 1)\n"
+            "  -b bytes    bytes every flow transfers (default %d)\n"
+            "  -r mbps     bottleneck rate, 0 for none (default %d)\n"
+            "  -d ms       one way delay (default %d)\n"
+            "  -l p        lose datagrams with probability p, both ways\n"
+            "  -q bytes    queue of the bottleneck (default %d)\n"
+            "  -Q disc     droptail or red (default droptail)\n"
+            "  -n runs     runs, seeded seed, seed + 1, ... (default 1)\n"
+            "  -s seed     seed of the first run (default 1)\n"
+            "  -p bytes    payload of a packet (default %d)\n"
+            "  -w packets  initial window (default %d)\n"
+            "  -W packets  receive window (default %d)\n"
+            "  -S ms       start flow i at i times this\n"
+            "  -t s        a flow not done after this long is stuck "
+            "(default %d)\n"
+            "  -g mbps     fail if the mean goodput of the runs is below this\n"
+            "  -j index    fail if their mean fairness is below this\n"
+            "  -v          print the statistics of every flow of every run\n\n",
+            argv[0], SIM_BYTES, SIM_RATE_MBPS, SIM_DELAY_USEC / 1000,
+            SIM_QUEUE_BYTES, MTU_PAYLOAD(1500), DEFAULT_CWND, REORDER_SLOTS,
+            (int)(SIM_LIMIT_USEC / 1000000));
+    exit(1);
+  }
+  if (strcmp(cc_name, "reno") && strcmp(cc_name, "cubic") &&
+      strcmp(cc_name, "bbr")) {
+    fprintf(stderr, "unknown congestion control %s\n", cc_name);
+    exit(1);
+  }
+
+  // the ACKs share the delay and the loss, not the bottleneck
+  paths[TO_RECEIVER] = p;
+  p.rate = 0;
+  paths[TO_SENDER] = p;
+  zeros = (char*)calloc(bytes, 1);
+  if (zeros == NULL)
+    diep((char*)"calloc");
+
+  printf("seed,seconds,goodput_mbps,utilization,fairness,converged\n");
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (unsigned long i = 0; i < runs; i++) {
+    run_result r = run(seed + i);
+    printf("%lu,%.6f,%.3f,%.4f,%.4f,%.3f%s%s\n", seed + i, r.elapsed / 1e6,
+           bytes * 8.0 * nflows / r.elapsed, r.utilization, r.fairness,
+           r.converged, r.stuck ? ",stuck" : "", r.stale ? ",stale" : "");
+    goodput += bytes * 8.0 * nflows / r.elapsed;
+    utilization += r.utilization;
+    // a bottleneck the flows never used, only a path without one has no
+    // utilization
+    if (paths[TO_RECEIVER].rate > 0 && r.utilization <= 0)
+      idle++;
+    fairness += r.fairness;
+    if (r.converged >= 0) {
+      settle += r.converged;
+      settled++;
+    }
+    seconds += r.elapsed / 1e6;
+    events += r.events;
+    stuck += r.stuck;
+    stale += r.stale;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  double wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  goodput /= runs;
+  fairness /= runs;
+  fprintf(stderr, "%lu runs of %u %s flows: goodput %.3f Mbit/s", runs,
+          nflows, cc_name, goodput);
+  if (paths[TO_RECEIVER].rate > 0)
+    fprintf(stderr, ", utilization %.4f", utilization / runs);
+  if (nflows > 1)
+    fprintf(stderr, ", fairness %.4f, converged in %lu runs after %.3f s",
+            fairness, settled, settled ? settle / settled : 0);
+  fprintf(stderr, ", %lu stuck, %lu stale retransmissions\n", stuck, stale);
+  fprintf(stderr,
+          "simulated %.3f s in %.3f s: %.0f transfers/s, %.0f events/s\n",
+          seconds, wall, runs * nflows / wall, events / wall);
+  if (idle)
+    fprintf(stderr, "%lu runs left the bottleneck idle\n", idle);
+  if (goodput < min_goodput)
+    fprintf(stderr, "goodput below %.3f Mbit/s\n", min_goodput);
+  if (nflows > 1 && fairness < min_fairness)
+    fprintf(stderr, "fairness below %.4f\n", min_fairness);
+  free(zeros);
+  // a run that got stuck, resent what was acknowledged or never used the
+  // bottleneck is a regression, and so is falling short of -g or -j
+  return stuck || stale || idle || goodput < min_goodput ||
+                 (nflows > 1 && fairness < min_fairness)
+             ? 1
+             : 0;
+}
@@ -0,0 +1,305 @@
+#ifndef MP2_TELEMETRY_HPP
+#define MP2_TELEMETRY_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "rtt.hpp"
+#include "shared.hpp"
+
+// Events a flow can have waiting for the drain thread, a power of two
+#define TRACE_RING (1 << 16)
+// How often the drain thread empties the rings, in microseconds
+#define TRACE_DRAIN_USEC 10000
+// First bytes of a trace file
+#define TRACE_MAGIC "MP2TRACE"
+// Version of the trace file, bump whenever trace_event changes
+#define TRACE_VERSION 1
+
+/**
+ * What a trace_event records, and what its seqno and value mean
+ */
+enum trace_type {
+  // a data packet went out: its seqno
+  TRACE_SEND,
+  // a data packet went out again: its seqno
+  TRACE_RETRANSMIT,
+  // new data was acknowledged: the cumulative ACK, packets in flight
+  TRACE_ACK,
+  // a duplicate ACK: the cumulative ACK, dup ACKs in a row
+  TRACE_DUPACK,
+  // the sender changed state: cw_base, the new sender_state
+  TRACE_STATE,
+  // the congestion window changed: cw_base, the window in packets
+  TRACE_CWND,
+  // an RTT sample: the ACK, the sample in microseconds
+  TRACE_RTT,
+  // a retransmission timeout: cw_base, the RTO after the backoff
+  TRACE_TIMEOUT,
+  // the receiver's window moved: the ACK, the window in packets from it
+  TRACE_RWND,
+  TRACE_TYPES
+};
+
+const char* const trace_names[TRACE_TYPES] = {
+    "send", "retransmit", "ack",     "dupack", "state",
+    "cwnd", "rtt",        "timeout", "rwnd"};
+
+/**
+ * The states of the sender in the sense of Reno. Controllers that have no
+ * slow start threshold are in slow start while they probe for bandwidth.
+ */
+enum sender_state {
+  STATE_SLOW_START,
+  STATE_CONGESTION_AVOIDANCE,
+  STATE_FAST_RECOVERY,
+  // from a retransmission timeout until new data is acknowledged
+  STATE_RTO,
+  STATES
+};
+
+const char* const state_names[STATES] = {
+    "slow start", "congestion avoidance", "fast recovery", "rto"};
+
+/**
+ * trace_event is one record of a trace file, in host byte order
+ */
+struct trace_event {
+  // monotonic time in microseconds
+  uint64_t time;
+  uint64_t seqno;
+  double value;
+  uint32_t flow;
+  uint32_t type;
+};
+
+/**
+ * trace_header starts a trace file, the events follow it back to back
+ */
+struct trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t event_size;
+};
+
+/**
+ * trace_ring holds the events of one flow until the drain thread writes
+ * them out
+ *
+ * A single producer, single consumer ring of preallocated events: record()
+ * is a few stores and never blocks or calls into the kernel. When the
+ * drain thread falls behind, new events are dropped and counted.
+ */
+class trace_ring {
+ public:
+  trace_ring(uint32_t flow) : dropped(0), flow(flow), head(0), tail(0) {
+    events = new trace_event[TRACE_RING];
+  }
+
+  /**
+   * record appends an event, see trace_type for the meaning of the fields
+   */
+  void record(uint32_t type, uint64_t seqno, double value) {
+    unsigned long h = head.load(std::memory_order_relaxed);
+
+    if (h - tail.load(std::memory_order_acquire) == TRACE_RING) {
+      dropped++;
+      return;
+    }
+    trace_event* e = &events[h % TRACE_RING];
+    e->time = monotonic_usec();
+    e->seqno = seqno;
+    e->value = value;
+    e->flow = flow;
+    e->type = type;
+    head.store(h + 1, std::memory_order_release);
+  }
+
+  /**
+   * drain writes every event recorded so far
+   *
+   * @return the number of events written
+   */
+  unsigned long drain(FILE* out) {
+    unsigned long t = tail.load(std::memory_order_relaxed);
+    unsigned long h = head.load(std::memory_order_acquire);
+    unsigned long n, i;
+
+    // at most two runs, before and after the end of the array
+    for (i = t; i < h; i += n) {
+      n = std::min(h - i, TRACE_RING - i % TRACE_RING);
+      fwrite(&events[i % TRACE_RING], sizeof(trace_event), n, out);
+    }
+    tail.store(h, std::memory_order_release);
+    return h - t;
+  }
+
+  ~trace_ring() { delete[] events; }
+
+  // events lost to a full ring, only touched by the producer
+  unsigned long dropped;
+
+ private:
+  uint32_t flow;
+  trace_event* events;
+  std::atomic<unsigned long> head, tail;
+};
+
+/**
+ * tracer owns the trace file and the thread that drains every flow's ring
+ * into it
+ */
+class tracer {
+ public:
+  tracer(FILE* out) : out(out), nrings(0), written(0), closed(false) {
+    trace_header header;
+
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.event_size = sizeof(trace_event);
+    fwrite(&header, sizeof(header), 1, out);
+    thread = std::thread(&tracer::run, this);
+  }
+
+  /**
+   * open creates the ring of a flow, it lives until close()
+   */
+  trace_ring* open(uint32_t flow) {
+    std::lock_guard<std::mutex> guard(lock);
+    return rings[nrings++] = new trace_ring(flow);
+  }
+
+  /**
+   * close writes out what is left once every flow is done, and closes the
+   * file
+   */
+  void close() {
+    unsigned long dropped = 0;
+
+    closed = true;
+    thread.join();
+    drain_all();
+    for (unsigned int i = 0; i < nrings; i++) {
+      dropped += rings[i]->dropped;
+      delete rings[i];
+    }
+    fclose(out);
+    fprintf(stderr, "trace: %lu events, %lu dropped\n", written, dropped);
+  }
+
+ private:
+  void run() {
+    while (!closed.load()) {
+      drain_all();
+      usleep(TRACE_DRAIN_USEC);
+    }
+  }
+
+  void drain_all() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (unsigned int i = 0; i < nrings; i++)
+      written += rings[i]->drain(out);
+  }
+
+  FILE* out;
+  trace_ring* rings[MAX_FLOWS];
+  unsigned int nrings;
+  unsigned long written;
+  std::atomic<bool> closed;
+  std::mutex lock;
+  std::thread thread;
+};
+
+/**
+ * transfer_summary keeps the counters of a flow that are printed at the
+ * end of the transfer, whether it is traced or not
+ */
+class transfer_summary {
+ public:
+  transfer_summary()
+      : state(STATE_SLOW_START), first(0), since(0), last(0), sent(0),
+        resent(0), window_limited(0) {
+    memset(usec, 0, sizeof(usec));
+  }
+
+  void start(uint64_t now) { first = since = last = now; }
+
+  void on_send(bool retransmit) {
+    sent++;
+    if (retransmit)
+      resent++;
+  }
+
+  /**
+   * set_state moves the sender to state
+   *
+   * @return whether the state changed
+   */
+  bool set_state(int new_state, uint64_t now) {
+    if (new_state == state)
+      return false;
+    usec[state] += now - since;
+    since = now;
+    state = new_state;
+    return true;
+  }
+
+  /**
+   * on_window_limited counts a time the receiver's window, not cwnd, kept
+   * the sender from sending
+   */
+  void on_window_limited() { window_limited++; }
+
+  unsigned long retransmitted() { return resent; }
+
+  /**
+   * finish stops the clock once every packet is acknowledged
+   */
+  void finish(uint64_t now) {
+    usec[state] += now - since;
+    since = last = now;
+  }
+
+  /**
+   * elapsed is how long the flow took, in microseconds
+   */
+  uint64_t elapsed() { return last - first; }
+
+  /**
+   * print prints goodput, retransmit ratio and where the time went
+   *
+   * @param bytes the payload the flow delivered
+   */
+  void print(unsigned long long bytes) {
+    double secs = elapsed() / 1e6;
+
+    fprintf(stderr,
+            "summary: %llu bytes in %.3f s, goodput %.2f Mbit/s, %lu sent, "
+            "%lu retransmitted (%.2f%%)\n",
+            bytes, secs, secs > 0 ? bytes * 8 / secs / 1e6 : 0, sent, resent,
+            sent ? 100.0 * resent / sent : 0);
+    fprintf(stderr, "time:");
+    for (int i = 0; i < STATES; i++)
+      fprintf(stderr, "%s %s %.1f%%", i ? "," : "", state_names[i],
+              elapsed() ? 100.0 * usec[i] / elapsed() : 0);
+    fprintf(stderr, "\n");
+    if (window_limited)
+      fprintf(stderr, "rwnd: held the window back %lu times\n",
+              window_limited);
+  }
+
+ private:
+  int state;
+  uint64_t first, since, last;
+  uint64_t usec[STATES];
+  unsigned long sent, resent, window_limited;
+};
+
+#endif  // MP2_TELEMETRY_HPP
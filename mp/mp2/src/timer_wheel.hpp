@@ -0,0 +1,190 @@
+#ifndef MP2_TIMER_WHEEL_HPP
+#define MP2_TIMER_WHEEL_HPP
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "sack.hpp"
+
+// Number of slots of the wheel, must be a multiple of 64
+#define WHEEL_SLOTS 4096
+// Time covered by one slot, in microseconds. Timers fire at most this late
+#define WHEEL_TICK_USEC 1000
+
+/**
+ * timer_wheel keeps one deadline per key, a hashed timing wheel as
+ * described by Varghese and Lauck
+ *
+ * A deadline goes into slot (deadline / tick) % WHEEL_SLOTS, in a doubly
+ * linked list threaded through an entry array indexed by key % capacity,
+ * so arming and cancelling are O(1). Deadlines more than one revolution
+ * away share the slot and are simply skipped until their turn. A bitmap of
+ * non-empty slots finds the next deadline to sleep until a word at a time.
+ */
+class timer_wheel {
+ public:
+  /**
+   * @param capacity how many keys may be armed at once, keys are stored at
+   *        key % capacity
+   * @param now the current time in microseconds
+   */
+  timer_wheel(unsigned long capacity, uint64_t now)
+      : capacity(capacity), current(now / WHEEL_TICK_USEC), count(0) {
+    entries = new entry[capacity];
+    for (unsigned long i = 0; i < capacity; i++) {
+      entries[i].key = 0;
+      entries[i].slot = NONE;
+    }
+    for (int i = 0; i < WHEEL_SLOTS; i++)
+      heads[i] = NONE;
+    for (int i = 0; i < WHEEL_SLOTS / 64; i++)
+      occupied[i] = 0;
+  }
+
+  /**
+   * arm sets the deadline of key, replacing the one it had
+   *
+   * @param deadline absolute time in microseconds, deadlines in the past
+   *        fire on the next expire()
+   */
+  void arm(unsigned long key, uint64_t deadline) {
+    uint32_t i = key % capacity;
+    uint64_t tick = std::max(deadline / WHEEL_TICK_USEC, current);
+
+    unlink(i);
+    entries[i].key = key;
+    entries[i].deadline = deadline;
+    link(i, tick % WHEEL_SLOTS);
+  }
+
+  /**
+   * cancel disarms key, if it is armed
+   */
+  void cancel(unsigned long key) {
+    uint32_t i = key % capacity;
+
+    if (entries[i].key == key)
+      unlink(i);
+  }
+
+  bool armed(unsigned long key) {
+    uint32_t i = key % capacity;
+    return entries[i].slot != NONE && entries[i].key == key;
+  }
+
+  /**
+   * clear disarms every key
+   */
+  void clear() {
+    unsigned long slot;
+
+    while (count > 0) {
+      slot = find_bit(occupied, WHEEL_SLOTS, 0, WHEEL_SLOTS, true);
+      while (heads[slot] != NONE)
+        unlink(heads[slot]);
+    }
+  }
+
+  /**
+   * expire disarms every key whose deadline has passed
+   *
+   * @param now the current time in microseconds
+   * @param fired receives the expired keys, in no particular order
+   * @return the number of expired keys
+   */
+  int expire(uint64_t now, std::vector<unsigned long>* fired) {
+    uint64_t target = now / WHEEL_TICK_USEC;
+    uint64_t steps;
+    uint32_t i, next;
+    int n = 0;
+
+    if (target < current)
+      return 0;
+
+    // a late wakeup never walks the wheel more than once
+    steps = std::min(target - current + 1, (uint64_t)WHEEL_SLOTS);
+    for (; steps > 0; steps--, current++) {
+      for (i = heads[current % WHEEL_SLOTS]; i != NONE; i = next) {
+        next = entries[i].next;
+        if (entries[i].deadline > now)
+          continue;
+        unlink(i);
+        fired->push_back(entries[i].key);
+        n++;
+      }
+    }
+    current = target;
+    return n;
+  }
+
+  /**
+   * next_expiry tells when expire() should run next
+   *
+   * @param when receives the end of the first non-empty slot, every deadline
+   *        in that slot is at or before it
+   * @return false if nothing is armed
+   */
+  bool next_expiry(uint64_t* when) {
+    if (count == 0)
+      return false;
+    *when = (find_bit(occupied, WHEEL_SLOTS, current, current + WHEEL_SLOTS,
+                      true) + 1) * WHEEL_TICK_USEC;
+    return true;
+  }
+
+  /**
+   * size is the number of armed keys
+   */
+  unsigned long size() { return count; }
+
+  ~timer_wheel() { delete[] entries; }
+
+ private:
+  static const uint32_t NONE = UINT32_MAX;
+
+  struct entry {
+    unsigned long key;
+    uint64_t deadline;
+    uint32_t prev, next, slot;
+  };
+
+  void link(uint32_t i, uint32_t slot) {
+    entries[i].slot = slot;
+    entries[i].prev = NONE;
+    entries[i].next = heads[slot];
+    if (heads[slot] != NONE)
+      entries[heads[slot]].prev = i;
+    heads[slot] = i;
+    occupied[slot / 64] |= 1ULL << (slot % 64);
+    count++;
+  }
+
+  void unlink(uint32_t i) {
+    entry* e = &entries[i];
+
+    if (e->slot == NONE)
+      return;
+    if (e->prev != NONE)
+      entries[e->prev].next = e->next;
+    else
+      heads[e->slot] = e->next;
+    if (e->next != NONE)
+      entries[e->next].prev = e->prev;
+    if (heads[e->slot] == NONE)
+      occupied[e->slot / 64] &= ~(1ULL << (e->slot % 64));
+    e->slot = NONE;
+    count--;
+  }
+
+  unsigned long capacity;
+  // the tick whose slot expire() looks at first
+  uint64_t current;
+  unsigned long count;
+  entry* entries;
+  uint32_t heads[WHEEL_SLOTS];
+  uint64_t occupied[WHEEL_SLOTS / 64];
+};
+
+#endif  // MP2_TIMER_WHEEL_HPP
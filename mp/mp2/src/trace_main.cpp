@@ -0,0 +1,88 @@
+/*
+ * File:   trace_main.cpp
+ *
+ * Converts a trace written by reliable_sender -t to CSV for plotting.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "telemetry.hpp"
+
+/**
+ * find_type returns the trace_type called name, or -1
+ */
+static int find_type(const char* name) {
+  for (int i = 0; i < TRACE_TYPES; i++)
+    if (strcmp(trace_names[i], name) == 0)
+      return i;
+  return -1;
+}
+
+int main(int argc, char** argv) {
+  trace_header header;
+  trace_event e;
+  uint64_t first = 0;
+  bool only[TRACE_TYPES], filtered = false;
+  FILE* in;
+  int opt, type;
+
+  memset(only, 0, sizeof(only));
+  while ((opt = getopt(argc, argv, "e:")) != -1) {
+    switch (opt) {
+      case 'e':
+        if ((type = find_type(optarg)) < 0)
+          argc = 0;
+        else
+          only[type] = filtered = true;
+        break;
+      default:
+        argc = 0;
+    }
+  }
+
+  if (argc - optind != 1) {
+    fprintf(stderr,
+            "usage: %s [-e event]... trace_file\n\n"
+            "  -e  only print this event, one of send, retransmit, ack, "
+            "dupack,\n"
+            "      state, cwnd, rtt, timeout, rwnd\n\n"
+            "Prints time_ms,flow,event,seqno,value with the time relative "
+            "to the\nfirst event. The value of a state event is 0 slow "
+            "start, 1 congestion\navoidance, 2 fast recovery, 3 rto.\n",
+            argv[0]);
+    exit(1);
+  }
+
+  if ((in = fopen(argv[optind], "rb")) == NULL)
+    diep((char*)"fopen");
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TRACE_VERSION ||
+      header.event_size != sizeof(trace_event)) {
+    fprintf(stderr, "%s is not a version %d trace\n", argv[optind],
+            TRACE_VERSION);
+    exit(1);
+  }
+
+  // the rings of the flows are drained one after the other, so the file
+  // is only ordered by time within each flow, find the earliest event
+  // before printing anything
+  while (fread(&e, sizeof(e), 1, in) == 1)
+    if (first == 0 || e.time < first)
+      first = e.time;
+  fseek(in, sizeof(header), SEEK_SET);
+
+  printf("time_ms,flow,event,seqno,value\n");
+  while (fread(&e, sizeof(e), 1, in) == 1) {
+    if (e.type >= TRACE_TYPES || (filtered && !only[e.type]))
+      continue;
+    printf("%.3f,%u,%s,%lu,%g\n", (e.time - first) / 1e3, e.flow,
+           trace_names[e.type], (unsigned long)e.seqno, e.value);
+  }
+
+  fclose(in);
+  return 0;
+}
@@ -0,0 +1,770 @@
+#ifndef MP2_WIRE_HPP
+#define MP2_WIRE_HPP
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+
+#include "crc32c.hpp"
+#include "shared.hpp"
+
+// Segmentation offload, older headers do not know about it yet
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// Version of the on-the-wire header, bump whenever the layout changes
+#define WIRE_VERSION 8
+
+/**
+ * Layout of the wire header. Every field is little-endian regardless of the
+ * host byte order, and the header is followed by exactly `length` payload bytes.
+ *
+ *  offset  size  field
+ *  0       1     version
+ *  1       1     type flags (PACKET_TYPE_*)
+ *  2       2     length of the payload
+ *  4       4     checksum, CRC32C of the payload followed by the header
+ *                with this field zeroed, 0 if the sender left it out
+ *  8       8     seqno
+ *  16      4     timestamp in microseconds, echoed back by ACKs, or the
+ *                group descriptor of a parity packet (see fec.hpp)
+ *  20      4     flow, the first seqno of the flow's range (0 for a
+ *                transfer that is not split)
+ *  24      4     session, the connection ID the sender picked for the
+ *                transfer, shared by all of its flows and echoed back
+ */
+#define WIRE_HEADER_SIZE 28
+// Where the checksum is, the CRC32C takes it as 0
+#define WIRE_CHECKSUM_OFFSET 4
+// Where the connection ID is, for steering datagrams before they are parsed
+#define WIRE_SESSION_OFFSET 24
+
+// Checksum every datagram sent, -K leaves it out to measure what it costs.
+// Datagrams that carry one are checked whatever this says
+bool wire_checksums = true;
+
+static inline void put_le16(uint8_t* p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static inline void put_le32(uint8_t* p, uint32_t v) {
+  put_le16(p, v);
+  put_le16(p + 2, v >> 16);
+}
+
+static inline void put_le64(uint8_t* p, uint64_t v) {
+  put_le32(p, v);
+  put_le32(p + 4, v >> 32);
+}
+
+static inline uint16_t get_le16(const uint8_t* p) {
+  return (uint16_t)p[0] | (uint16_t)p[1] << 8;
+}
+
+static inline uint32_t get_le32(const uint8_t* p) {
+  return (uint32_t)get_le16(p) | (uint32_t)get_le16(p + 2) << 16;
+}
+
+static inline uint64_t get_le64(const uint8_t* p) {
+  return (uint64_t)get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+/**
+ * encode_header serializes a header
+ *
+ * @param type the PACKET_TYPE_* flags
+ * @param seqno the sequence number
+ * @param length the number of payload bytes that follow the header
+ * @param timestamp the send time of a data packet, or the echoed one
+ * @param flow the flow the packet belongs to
+ * @param session the connection ID of the transfer
+ * @param buf destination, at least WIRE_HEADER_SIZE bytes
+ */
+static inline void encode_header(unsigned int type, unsigned long seqno,
+                                 unsigned int length, uint32_t timestamp,
+                                 uint32_t flow, uint32_t session,
+                                 uint8_t* buf) {
+  buf[0] = WIRE_VERSION;
+  buf[1] = type;
+  put_le16(buf + 2, length);
+  put_le32(buf + WIRE_CHECKSUM_OFFSET, 0);
+  put_le64(buf + 8, seqno);
+  put_le32(buf + 16, timestamp);
+  put_le32(buf + 20, flow);
+  put_le32(buf + WIRE_SESSION_OFFSET, session);
+}
+
+static inline void encode_header(const packet* p, uint8_t* buf) {
+  encode_header(p->type, p->seqno, p->data_sz, p->timestamp, p->flow,
+                p->session, buf);
+}
+
+/**
+ * decode_header parses a wire header into the packet's header fields
+ *
+ * @param buf the received header bytes
+ * @param len number of bytes received in total, header included
+ * @param p the packet to fill in, data is left untouched
+ * @return false if the datagram is truncated or from another version
+ */
+static inline bool decode_header(const uint8_t* buf, size_t len, packet* p) {
+  if (len < WIRE_HEADER_SIZE || buf[0] != WIRE_VERSION)
+    return false;
+
+  p->type = buf[1];
+  p->data_sz = get_le16(buf + 2);
+  p->seqno = get_le64(buf + 8);
+  p->timestamp = get_le32(buf + 16);
+  p->flow = get_le32(buf + 20);
+  p->session = get_le32(buf + WIRE_SESSION_OFFSET);
+  return p->data_sz == len - WIRE_HEADER_SIZE &&
+         p->data_sz <= MAX_PACKET_SIZE;
+}
+
+/**
+ * wire_checksum computes the checksum field of a datagram, a CRC32C that
+ * comes out as 0 is sent as 0xffffffff since 0 means there is none
+ *
+ * The payload comes first so that its own CRC32C, which the whole-file
+ * checksum is made of, is computed on the way.
+ *
+ * @param hdr the encoded header, its checksum field is not read
+ * @param payload_crc crc32c(0, payload, length)
+ */
+static inline uint32_t wire_checksum(const uint8_t* hdr, uint32_t payload_crc) {
+  uint32_t crc = crc32c_zeroed(payload_crc, hdr, WIRE_HEADER_SIZE,
+                               WIRE_CHECKSUM_OFFSET);
+
+  return crc ? crc : 0xffffffff;
+}
+
+/**
+ * wire_seal fills in the checksum of an encoded header and its payload
+ *
+ * @param payload_crc the CRC32C of the payload if it is known, NULL to
+ *        compute it
+ */
+static inline void wire_seal(uint8_t* hdr, const void* data,
+                             unsigned int length,
+                             const uint32_t* payload_crc = NULL) {
+  if (wire_checksums)
+    put_le32(hdr + WIRE_CHECKSUM_OFFSET,
+             wire_checksum(hdr, payload_crc ? *payload_crc
+                                            : crc32c(0, data, length)));
+}
+
+/**
+ * wire_intact checks a received datagram against its checksum
+ *
+ * @param p the decoded header, receives the CRC32C of the payload if the
+ *        datagram has a checksum
+ * @return false if the datagram was damaged on the way
+ */
+static inline bool wire_intact(const uint8_t* hdr, packet* p,
+                               const void* data) {
+  uint32_t sum = get_le32(hdr + WIRE_CHECKSUM_OFFSET);
+
+  p->has_crc = sum != 0;
+  if (sum == 0)
+    return true;
+  p->crc = crc32c(0, data, p->data_sz);
+  return sum == wire_checksum(hdr, p->crc);
+}
+
+/**
+ * wire_send sends a header followed by a payload that may live anywhere,
+ * e.g. in a memory mapped file
+ *
+ * The header is gathered together with the payload, so the payload is
+ * never copied in userspace.
+ *
+ * @return the return value of sendmsg
+ */
+static inline ssize_t wire_send(int s, unsigned int type, unsigned long seqno,
+                                const void* data, unsigned int length,
+                                const struct sockaddr* to, socklen_t tolen,
+                                uint32_t timestamp = 0, uint32_t flow = 0,
+                                uint32_t session = 0) {
+  uint8_t hdr[WIRE_HEADER_SIZE];
+  struct iovec iov[2];
+  struct msghdr msg;
+
+  encode_header(type, seqno, length, timestamp, flow, session, hdr);
+  wire_seal(hdr, data, length);
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = WIRE_HEADER_SIZE;
+  iov[1].iov_base = (void*)data;
+  iov[1].iov_len = length;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = (void*)to;
+  msg.msg_namelen = tolen;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  return sendmsg(s, &msg, 0);
+}
+
+/**
+ * wire_send sends the header and the first data_sz bytes of a packet
+ */
+static inline ssize_t wire_send(int s, const packet* p,
+                                const struct sockaddr* to, socklen_t tolen) {
+  return wire_send(s, p->type, p->seqno, p->data, p->data_sz, to, tolen,
+                   p->timestamp, p->flow, p->session);
+}
+
+/**
+ * wire_recv_into receives one datagram, scattering the payload into an
+ * arbitrary buffer, e.g. straight into a memory mapped file
+ *
+ * A damaged datagram is dropped like a malformed one, but its payload has
+ * been written to data by then.
+ *
+ * @param p receives the header fields, its data is left untouched
+ * @param data where the payload goes
+ * @param cap the size of data, longer payloads are dropped
+ * @param from if not NULL, filled in with the address of the peer
+ * @param flags passed on to recvmsg
+ * @return the datagram size, 0 if the datagram was malformed and dropped,
+ *         or negative on error (errno is set by recvmsg)
+ */
+static inline ssize_t wire_recv_into(int s, packet* p, char* data,
+                                     unsigned int cap, struct sockaddr* from,
+                                     socklen_t* fromlen, int flags) {
+  uint8_t hdr[WIRE_HEADER_SIZE];
+  struct iovec iov[2];
+  struct msghdr msg;
+  ssize_t bytes;
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = WIRE_HEADER_SIZE;
+  iov[1].iov_base = data;
+  iov[1].iov_len = cap;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = from;
+  msg.msg_namelen = fromlen ? *fromlen : 0;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  bytes = recvmsg(s, &msg, flags);
+  if (bytes < 0)
+    return bytes;
+  if (fromlen)
+    *fromlen = msg.msg_namelen;
+  if ((msg.msg_flags & MSG_TRUNC) || !decode_header(hdr, bytes, p) ||
+      !wire_intact(hdr, p, data))
+    return 0;
+  return bytes;
+}
+
+/**
+ * wire_recv receives one datagram, scattering the payload straight into
+ * the packet's data buffer
+ *
+ * @param from if not NULL, filled in with the address of the peer
+ * @return the datagram size, 0 if the datagram was malformed and dropped,
+ *         or negative on error (errno is set by recvmsg)
+ */
+static inline ssize_t wire_recv(int s, packet* p, struct sockaddr* from,
+                                socklen_t* fromlen) {
+  return wire_recv_into(s, p, p->data, MAX_PACKET_SIZE, from, fromlen, 0);
+}
+
+/**
+ * wire_peek decodes the header of the next datagram without consuming it,
+ * so that the caller can decide where its payload should go. The checksum
+ * is only checked once the whole datagram is received
+ *
+ * @param p receives the header fields
+ * @param flags extra recv flags, e.g. MSG_DONTWAIT
+ * @return the datagram size, 0 if the datagram is malformed (it is still
+ *         queued), or negative on error
+ */
+static inline ssize_t wire_peek(int s, packet* p, int flags) {
+  uint8_t hdr[WIRE_HEADER_SIZE];
+  ssize_t bytes;
+
+  // with MSG_TRUNC the full length of the datagram is returned
+  bytes = recv(s, hdr, WIRE_HEADER_SIZE, MSG_PEEK | MSG_TRUNC | flags);
+  if (bytes < 0)
+    return bytes;
+  if (bytes > UDP_MAX || !decode_header(hdr, bytes, p))
+    return 0;
+  return bytes;
+}
+
+// Most datagrams handed to the kernel in one sendmmsg/recvmmsg call
+#define WIRE_BATCH 64
+// Most segments in one UDP_SEGMENT message (UDP_MAX_SEGMENTS)
+#define WIRE_GSO_SEGMENTS 64
+// Largest UDP payload over IPv4, the limit for a whole segmented message
+#define WIRE_GSO_BYTES 65507
+// Coalesced datagrams taken by one recvmmsg with UDP_GRO
+#define WIRE_GRO_SLOTS 8
+// Room for one coalesced datagram
+#define WIRE_GRO_BYTES 65536
+
+/**
+ * batch_stats counts how many items (datagrams, buffers) each batched
+ * syscall moved
+ */
+struct batch_stats {
+  unsigned long calls = 0, messages = 0, largest = 0;
+
+  void record(unsigned long n) {
+    calls++;
+    messages += n;
+    if (n > largest)
+      largest = n;
+  }
+
+  double average() const { return calls ? (double)messages / calls : 0; }
+
+  void print(const char* name) const {
+    fprintf(stderr, "%s: %lu in %lu calls (avg %.2f, max %lu)\n", name,
+            messages, calls, average(), largest);
+  }
+};
+
+/**
+ * wire_send_batch collects outgoing datagrams and sends them with as few
+ * sendmmsg calls as possible
+ *
+ * Payloads are referenced, not copied, so they must stay valid until the
+ * batch is flushed. The batch flushes itself once capacity datagrams are
+ * queued.
+ *
+ * With enable_gso(), consecutive datagrams to the same peer are gathered
+ * into one message that the kernel segments (UDP_SEGMENT), so that a run
+ * of up to WIRE_GSO_SEGMENTS datagrams travels down the stack as a single
+ * skb. Every segment but the last of such a message must have the same
+ * size, a shorter datagram closes it.
+ */
+class wire_send_batch {
+ public:
+  /**
+   * @param capacity how many datagrams are queued before the batch flushes
+   *        itself
+   */
+  wire_send_batch(int s, unsigned int capacity = WIRE_BATCH)
+      : s(s), capacity(capacity), count(0), nmsgs(0), gso(false) {
+    msgs = new struct mmsghdr[capacity]();
+    info = new message_info[capacity];
+    control = new gso_control[capacity];
+    iov = new struct iovec[capacity * 2];
+    hdr = new uint8_t[capacity * WIRE_HEADER_SIZE];
+  }
+
+  /**
+   * enable_gso turns on segmentation offload if the kernel supports it
+   *
+   * @return whether datagrams are now gathered for UDP_SEGMENT
+   */
+  bool enable_gso() {
+    int zero = 0;
+
+    // the socket default stays off, each message carries its own size
+    gso = setsockopt(s, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == 0;
+    return gso;
+  }
+
+  bool offloading() { return gso; }
+
+  /**
+   * add queues one datagram, see wire_send for the parameters
+   *
+   * @param payload_crc the CRC32C of the payload if it is known, see
+   *        wire_seal
+   */
+  void add(unsigned int type, unsigned long seqno, const void* data,
+           unsigned int length, const struct sockaddr* to, socklen_t tolen,
+           uint32_t timestamp = 0, uint32_t flow = 0, uint32_t session = 0,
+           const uint32_t* payload_crc = NULL) {
+    unsigned int size = WIRE_HEADER_SIZE + length;
+    uint8_t* h = hdr + count * WIRE_HEADER_SIZE;
+    struct msghdr* msg;
+    message_info* m;
+
+    encode_header(type, seqno, length, timestamp, flow, session, h);
+    wire_seal(h, data, length, payload_crc);
+    iov[count * 2].iov_base = h;
+    iov[count * 2].iov_len = WIRE_HEADER_SIZE;
+    iov[count * 2 + 1].iov_base = (void*)data;
+    iov[count * 2 + 1].iov_len = length;
+
+    if (!continues(size, to, tolen)) {
+      msg = &msgs[nmsgs].msg_hdr;
+      memset(msg, 0, sizeof(*msg));
+      msg->msg_name = (void*)to;
+      msg->msg_namelen = tolen;
+      msg->msg_iov = &iov[count * 2];
+      info[nmsgs].segments = 0;
+      info[nmsgs].size = size;
+      info[nmsgs].bytes = 0;
+      nmsgs++;
+    }
+
+    msg = &msgs[nmsgs - 1].msg_hdr;
+    m = &info[nmsgs - 1];
+    msg->msg_iovlen += 2;
+    m->segments++;
+    m->bytes += size;
+    m->closed = size < m->size;
+
+    if (++count == capacity)
+      flush();
+  }
+
+  /**
+   * add queues the header and the first data_sz bytes of a packet, the
+   * CRC32C of the payload is reused if the packet has it
+   */
+  void add(const packet* p, const struct sockaddr* to, socklen_t tolen) {
+    add(p->type, p->seqno, p->data, p->data_sz, to, tolen, p->timestamp,
+        p->flow, p->session, p->has_crc ? &p->crc : NULL);
+  }
+
+  /**
+   * flush sends every queued datagram
+   *
+   * If the kernel turns a segmented message down, e.g. because the route
+   * goes through a device without checksum offload, segmentation is
+   * turned off and the message is sent one datagram at a time.
+   *
+   * @return the number of datagrams sent, or -1 on error (errno is set by
+   *         sendmmsg and the unsent datagrams are dropped)
+   */
+  int flush() {
+    unsigned int sent = 0, queued = count, total = nmsgs, i;
+    int n;
+
+    for (i = 0; i < nmsgs; i++)
+      set_segment_size(i);
+
+    while (sent < total) {
+      n = sendmmsg(s, msgs + sent, total - sent, 0);
+      if (n < 0 && info[sent].segments > 1 && errno != EAGAIN &&
+          errno != EINTR) {
+        gso = false;
+        if (send_segments(sent) < 0)
+          break;
+        sent++;
+        continue;
+      }
+      if (n < 0)
+        break;
+      stats.record(n);
+      for (i = 0; gso && i < (unsigned int)n; i++)
+        segments.record(info[sent + i].segments);
+      sent += n;
+    }
+    count = nmsgs = 0;
+    return sent < total ? -1 : (int)queued;
+  }
+
+  /**
+   * size is the number of datagrams queued
+   */
+  unsigned int size() { return count; }
+
+  ~wire_send_batch() {
+    delete[] msgs;
+    delete[] info;
+    delete[] control;
+    delete[] iov;
+    delete[] hdr;
+  }
+
+  // datagrams per sendmmsg call
+  batch_stats stats;
+  // datagrams per segmented message
+  batch_stats segments;
+
+ private:
+  struct message_info {
+    unsigned int segments, size, bytes;
+    bool closed;
+  };
+
+  union gso_control {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+  };
+
+  /**
+   * continues tells whether a datagram of size bytes to this peer can be
+   * appended to the last message as one more segment
+   */
+  bool continues(unsigned int size, const struct sockaddr* to,
+                 socklen_t tolen) {
+    if (!gso || nmsgs == 0)
+      return false;
+
+    struct msghdr* msg = &msgs[nmsgs - 1].msg_hdr;
+    message_info* m = &info[nmsgs - 1];
+    return !m->closed && size <= m->size &&
+           m->segments < WIRE_GSO_SEGMENTS &&
+           m->bytes + size <= WIRE_GSO_BYTES && msg->msg_namelen == tolen &&
+           memcmp(msg->msg_name, to, tolen) == 0;
+  }
+
+  /**
+   * set_segment_size attaches the UDP_SEGMENT size to message i if it
+   * holds more than one datagram
+   */
+  void set_segment_size(unsigned int i) {
+    struct msghdr* msg = &msgs[i].msg_hdr;
+    struct cmsghdr* cm;
+    uint16_t size = info[i].size;
+
+    if (info[i].segments < 2)
+      return;
+    msg->msg_control = control[i].buf;
+    msg->msg_controllen = sizeof(control[i].buf);
+    cm = CMSG_FIRSTHDR(msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(size));
+    memcpy(CMSG_DATA(cm), &size, sizeof(size));
+  }
+
+  /**
+   * send_segments sends every segment of message i as its own datagram
+   *
+   * @return 0, or -1 on error (errno is set by sendmsg)
+   */
+  int send_segments(unsigned int i) {
+    struct msghdr msg = msgs[i].msg_hdr;
+    struct iovec* first = msg.msg_iov;
+
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+    msg.msg_iovlen = 2;
+    for (unsigned int j = 0; j < info[i].segments; j++) {
+      msg.msg_iov = first + j * 2;
+      if (sendmsg(s, &msg, 0) < 0)
+        return -1;
+      stats.record(1);
+    }
+    return 0;
+  }
+
+  int s;
+  unsigned int capacity, count, nmsgs;
+  bool gso;
+  struct mmsghdr* msgs;
+  message_info* info;
+  gso_control* control;
+  struct iovec* iov;
+  uint8_t* hdr;
+};
+
+/**
+ * wire_recv_batch drains a burst of datagrams with one recvmmsg call into
+ * a preallocated array of packets
+ *
+ * With enable_gro(), the kernel may hand over runs of datagrams from the
+ * same peer coalesced into one (UDP_GRO). Those are received into large
+ * buffers and split back into packets, so the caller sees one packet per
+ * datagram either way.
+ */
+class wire_recv_batch {
+ public:
+  wire_recv_batch() : corrupt(0), count(0), gro(false), gro_buf(NULL) {
+    memset(msgs, 0, sizeof(msgs));
+    packets = new packet[WIRE_BATCH];
+    for (int i = 0; i < WIRE_BATCH; i++) {
+      iov[i][0].iov_base = hdr[i];
+      iov[i][0].iov_len = WIRE_HEADER_SIZE;
+      iov[i][1].iov_base = packets[i].data;
+      iov[i][1].iov_len = MAX_PACKET_SIZE;
+      msgs[i].msg_hdr.msg_iov = iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 2;
+      msgs[i].msg_hdr.msg_name = &from[i];
+      slot[i] = i;
+    }
+  }
+
+  /**
+   * enable_gro turns on receive offload if the kernel supports it
+   *
+   * @return whether coalesced datagrams are now received and split
+   */
+  bool enable_gro(int s) {
+    int one = 1;
+
+    if (setsockopt(s, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0)
+      return false;
+
+    // every slot now takes a whole coalesced datagram, and each one may
+    // hold up to WIRE_GSO_SEGMENTS packets
+    delete[] packets;
+    packets = new packet[WIRE_GRO_SLOTS * WIRE_GSO_SEGMENTS];
+    gro_buf = new uint8_t[WIRE_GRO_SLOTS * WIRE_GRO_BYTES];
+    for (int i = 0; i < WIRE_GRO_SLOTS; i++) {
+      iov[i][0].iov_base = gro_buf + i * WIRE_GRO_BYTES;
+      iov[i][0].iov_len = WIRE_GRO_BYTES;
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_control = control[i].buf;
+    }
+    gro = true;
+    return true;
+  }
+
+  /**
+   * recv blocks until at least one datagram arrives, then takes whatever
+   * else is already queued on the socket
+   *
+   * @param flags recvmmsg flags, MSG_DONTWAIT to never block
+   * @return the number of datagrams received, or negative on error
+   */
+  int recv(int s, int flags = MSG_WAITFORONE) {
+    if (gro)
+      return recv_coalesced(s, flags);
+
+    for (int i = 0; i < WIRE_BATCH; i++)
+      msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+
+    int n = recvmmsg(s, msgs, WIRE_BATCH, flags, NULL);
+    if (n < 0)
+      return n;
+
+    for (int i = 0; i < n; i++) {
+      valid[i] = !(msgs[i].msg_hdr.msg_flags & MSG_TRUNC) &&
+                 decode_header(hdr[i], msgs[i].msg_len, &packets[i]);
+      if (valid[i] &&
+          !wire_intact(hdr[i], &packets[i], packets[i].data)) {
+        valid[i] = false;
+        corrupt++;
+      }
+    }
+    stats.record(n);
+    count = n;
+    return n;
+  }
+
+  /**
+   * get returns the i-th datagram of the last burst, NULL if it was
+   * malformed
+   */
+  packet* get(int i) { return valid[i] ? &packets[i] : NULL; }
+
+  /**
+   * peer returns the address the i-th datagram of the last burst came from
+   */
+  struct sockaddr* peer(int i) { return (struct sockaddr*)&from[slot[i]]; }
+
+  socklen_t peer_len(int i) { return msgs[slot[i]].msg_hdr.msg_namelen; }
+
+  unsigned int size() { return count; }
+
+  ~wire_recv_batch() {
+    delete[] packets;
+    delete[] gro_buf;
+  }
+
+  // datagrams per recvmmsg call, coalesced ones count once
+  batch_stats stats;
+  // datagrams per coalesced datagram
+  batch_stats segments;
+  // datagrams dropped because their checksum did not match
+  unsigned long corrupt;
+
+ private:
+  union gro_control {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  };
+
+  /**
+   * recv_coalesced receives up to WIRE_GRO_SLOTS coalesced datagrams and
+   * splits them at the segment size the kernel reports
+   */
+  int recv_coalesced(int s, int flags) {
+    struct msghdr* msg;
+    struct cmsghdr* cm;
+    unsigned int off, len, seg;
+    int i, n, gso_size;
+
+    for (i = 0; i < WIRE_GRO_SLOTS; i++) {
+      msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+      msgs[i].msg_hdr.msg_controllen = sizeof(control[i].buf);
+    }
+
+    n = recvmmsg(s, msgs, WIRE_GRO_SLOTS, flags, NULL);
+    if (n < 0)
+      return n;
+
+    count = 0;
+    for (i = 0; i < n; i++) {
+      msg = &msgs[i].msg_hdr;
+      len = msgs[i].msg_len;
+      if (msg->msg_flags & MSG_TRUNC)
+        continue;
+
+      // without the control message the datagram was not coalesced
+      seg = len;
+      for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+          memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+          seg = gso_size;
+        }
+      }
+      if (seg == 0)
+        continue;
+
+      for (off = 0; off < len; off += seg) {
+        split(gro_buf + i * WIRE_GRO_BYTES + off, std::min(seg, len - off),
+              i);
+      }
+      segments.record((len + seg - 1) / seg);
+    }
+    stats.record(n);
+    return count;
+  }
+
+  /**
+   * split decodes one segment of the coalesced datagram in slot into the
+   * next packet
+   */
+  void split(const uint8_t* buf, unsigned int len, int from_slot) {
+    packet* p = &packets[count];
+
+    valid[count] = decode_header(buf, len, p);
+    if (valid[count] && !wire_intact(buf, p, buf + WIRE_HEADER_SIZE)) {
+      valid[count] = false;
+      corrupt++;
+    }
+    if (valid[count])
+      memcpy(p->data, buf + WIRE_HEADER_SIZE, p->data_sz);
+    slot[count] = from_slot;
+    count++;
+  }
+
+  unsigned int count;
+  bool gro;
+  packet* packets;
+  uint8_t* gro_buf;
+  bool valid[WIRE_GRO_SLOTS * WIRE_GSO_SEGMENTS];
+  int slot[WIRE_GRO_SLOTS * WIRE_GSO_SEGMENTS];
+  struct mmsghdr msgs[WIRE_BATCH];
+  struct iovec iov[WIRE_BATCH][2];
+  uint8_t hdr[WIRE_BATCH][WIRE_HEADER_SIZE];
+  struct sockaddr_storage from[WIRE_BATCH];
+  gro_control control[WIRE_GRO_SLOTS];
+};
+
+#endif  // MP2_WIRE_HPP